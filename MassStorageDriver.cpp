@@ -57,12 +57,17 @@ static const uint8_t mbdpGuid[16] PROGMEM = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9,
 				  ((x >> 8) & 0xff00) |  \
                   ((x << 24) & 0xff000000)
 
+// Mass Storage, SCSI transparent command set, Bulk-Only Transport
+static const usb_match_t drive_match[] = {
+	USB_MATCH_PROTOCOL(1, 8, 6, 80, 0)
+};
+
 void USBDrive::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
-	driver_ready_for_device(this);
+	driver_ready_for_device(this, drive_match, sizeof(drive_match)/sizeof(usb_match_t));
 
 	// Keep a list of drives. 
 	_next_drive = s_first_drive;
@@ -590,9 +595,6 @@ uint8_t USBDrive::msReadBlocks(
 							  (uint8_t)(BlockAddress & 0xFF),
 							   0x00, BlockHi, BlockLo, 0x00}
 	};
-	#if defined(__IMXRT1062__)
-	if ((uint32_t)sectorBuffer >= 0x20200000u)  arm_dcache_flush_delete(sectorBuffer, CommandBlockWrapper.TransferLength);
-	#endif
 	return msDoCommand(&CommandBlockWrapper, sectorBuffer);
 }
 
@@ -716,9 +718,6 @@ uint8_t USBDrive::msWriteBlocks(
 							  (uint8_t)(BlockAddress & 0xFF),
 							  0x00, BlockHi, BlockLo, 0x00}
 	};
-	#if defined(__IMXRT1062__)
-	if ((uint32_t)sectorBuffer >= 0x20200000u)  arm_dcache_flush((void*)sectorBuffer, CommandBlockWrapper.TransferLength);
-	#endif
 	return msDoCommand(&CommandBlockWrapper, (void *)sectorBuffer);
 }
 
@@ -57,8 +57,7 @@ hidclaim_t USBSerialEmu::claim_collection(USBHIDParser *driver, Device_t *dev, u
 	collections_claimed++;
 	usage_ = topusage;
 	driver_ = driver;	// remember the driver. 
-	rx_head_ = 0;// receive head
-	rx_tail_ = 0;// receive tail
+	rx_ring_.clear();
 	tx_head_ = 0;
 	rx_pipe_size_ = driver->inSize();
 	tx_pipe_size_ = driver->outSize();
@@ -91,27 +90,9 @@ bool USBSerialEmu::hid_process_in_data(const Transfer_t *transfer)
 	// try using version like serial that uses memcpy.
 	while ((len > 0) && (buffer[len-1] == 0)) len--; // find out the length
 	// Copy data from packet buffer to circular buffer.
-	uint32_t head = rx_head_;
-	uint32_t tail = rx_tail_;
-	uint32_t buffer_free;
-	if (head >= tail) buffer_free =  RX_BUFFER_SIZE - (head - tail);
-	else buffer_free =  head - tail;
-
-	if (++head >= RX_BUFFER_SIZE) head = 0;
-
 	if (len > 0) {
-		DBGPrintf("\tH:%u T:%u A:%u L:%u\n", head, tail, buffer_free, len);
-		if (buffer_free > len) buffer_free = len;
-		memcpy(rx_buffer_ + head, buffer, buffer_free);
-		if (len <= buffer_free) {
-			head += buffer_free - 1;
-			if (head >= RX_BUFFER_SIZE) head = 0;
-		} else {
-			head = len - buffer_free - 1;
-			memcpy(rx_buffer_, buffer + RX_BUFFER_SIZE, head + 1);
-		}
-		rx_head_ = head;
-		DBGPrintf("\tNH:%u T:%u\n", rx_head_, rx_tail_);
+		DBGPrintf("\tA:%u L:%u\n", rx_ring_.space(), len);
+		rx_ring_.write(buffer, len);
 	}
 
 	return true;
@@ -142,28 +123,22 @@ bool USBSerialEmu::sendPacket()
 int USBSerialEmu::available(void)
 {
 	if (!driver_) return 0;
-	uint32_t head = rx_head_;
-	uint32_t tail = rx_tail_;
-	if (head >= tail) return head - tail;
-	return RX_BUFFER_SIZE + head - tail;
+	return rx_ring_.available();
 }
 
 int USBSerialEmu::peek(void)
 {
 	if (!driver_) return -1;
-	if (rx_head_ == rx_tail_) return -1;	
-	uint16_t tail = rx_tail_ + 1;
-	if (tail >= RX_BUFFER_SIZE) tail = 0;
-	return rx_buffer_[tail];
+	const uint8_t *p = rx_ring_.peek();
+	if (!p) return -1;
+	return *p;
 }
 
 int USBSerialEmu::read(void)
 {
 	if (!driver_) return -1;
-	if (rx_head_ == rx_tail_) return -1;
-	if (++rx_tail_ >= RX_BUFFER_SIZE) rx_tail_ = 0;
-	
-	int c = rx_buffer_[rx_tail_];
+	uint8_t c;
+	if (!rx_ring_.get(c)) return -1;
 	return c;
 }
 
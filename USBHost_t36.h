@@ -27,10 +27,12 @@
 #include <stdint.h>
 #include <FS.h>
 
-#if !defined(__MK66FX1M0__) && !defined(__IMXRT1052__) && !defined(__IMXRT1062__)
+#if !defined(__MK66FX1M0__) && !defined(__IMXRT1052__) && !defined(__IMXRT1062__) && !defined(USBHOST_SIMULATOR)
 #error "USBHost_t36 only works with Teensy 3.6 or Teensy 4.x.  Please select it in Tools > Boards"
 #endif
 #include "utility/imxrt_usbhs.h"
+#include "utility/ehci_sim.h"
+#include "utility/ring_buffer.h"
 #include "utility/msc.h"
 
 // Dear inquisitive reader, USB is a complex protocol defined with
@@ -69,6 +71,91 @@
 #define USBHDBGSerial   Serial
 #endif
 
+// Uncomment to record a binary trace of transfers in a RAM buffer, read
+// by USBHost::readTrace().  Unlike debug printing, each event costs only
+// a few cycles, so timing is nearly unchanged.  The most recent
+// USBHOST_TRACE_SIZE events (a power of 2) are kept, 32 bytes each,
+// with a time sync record before any event after a second or more.
+//#define USBHOST_TRACE
+#ifndef USBHOST_TRACE_SIZE
+#define USBHOST_TRACE_SIZE  256
+#endif
+
+// Space for HID report descriptors, in every USBHIDParser and in every
+// Bluetooth connection.  Edit here, or define in the compiler flags (not
+// in a sketch, which would not change the library's own files), to
+// accept larger descriptors, or to save RAM when many instances are
+// used.  For serial and MIDI, use the USBSerial_Custom and
+// MIDIDevice_Custom templates to size each instance.
+#ifndef USBHOST_HID_DESCRIPTOR_SIZE
+#define USBHOST_HID_DESCRIPTOR_SIZE  800
+#endif
+#ifndef USBHOST_BT_DESCRIPTOR_SIZE
+#define USBHOST_BT_DESCRIPTOR_SIZE   800
+#endif
+
+// Bytes in the pool used by USBHost::allocate_DMA_Buffer().  On Teensy 4
+// it is in DTCM (RAM1), which is not cached, so transfers using these
+// buffers need no cache maintenance.  Uncomment USBHOST_DMA_POOL_DMAMEM
+// to put it in OCRAM (RAM2) instead, or set the size to 0 to allocate
+// from the heap.  The pool only uses RAM if allocate_DMA_Buffer is used.
+#ifndef USBHOST_DMA_POOL_SIZE
+#define USBHOST_DMA_POOL_SIZE  8192
+#endif
+//#define USBHOST_DMA_POOL_DMAMEM
+
+// Devices which may read their descriptors at the same time, after they
+// have been given an address.  Each uses a 2K static buffer.  Port resets
+// and the first requests at address 0 are always done one device at a
+// time.  With 1, every device finishes enumeration before the next one
+// starts.  Use 2 to 4 to bring up several devices behind hubs faster.
+#ifndef USBHOST_ENUMERATION_BUFFERS
+#define USBHOST_ENUMERATION_BUFFERS  1
+#endif
+
+// Room for the entries of all drivers' match tables (see usb_match_t),
+// which enumeration searches to find the drivers to offer each device
+// and interface.  A driver whose table doesn't fit is offered them all.
+#ifndef USBHOST_MATCH_INDEX_SIZE
+#define USBHOST_MATCH_INDEX_SIZE  64
+#endif
+
+// Connection timing.  USB 2.0 requires 100 ms debounce after a device
+// connects and 10 ms reset recovery (25 ms is used for hub ports).  Fast
+// attach, meant for known good devices wired on the same board, uses
+// these shorter times, and gives high and low speed devices an address
+// before reading any descriptor.  Uncomment USBHOST_FAST_ATTACH to use it
+// from startup, or call USBHost::setFastAttach().  Devices which aren't
+// ready this soon may need several retries, or fail to enumerate.
+//#define USBHOST_FAST_ATTACH
+#ifndef USBHOST_FAST_DEBOUNCE
+#define USBHOST_FAST_DEBOUNCE  10000  // microseconds
+#endif
+#ifndef USBHOST_FAST_RECOVERY
+#define USBHOST_FAST_RECOVERY  2000   // microseconds
+#endif
+
+// Microframes (125 us) the EHCI may wait to gather completions into one
+// interrupt: 0 (immediate), 1, 2, 4, 8, 16, 32 or 64.  Larger values use
+// less CPU time for fast bulk streams, but add up to this much latency
+// to every completion, including keyboards and mice, and streams slow
+// down if their queued transfers fill before the interrupt.  With the
+// simulated EHCI ("make run" in extras/sim, the coalesce program), 16
+// queued 512 byte bulk IN transfers from a device sending 4 MB/sec:
+//    1: one interrupt per transfer, within the same microframe
+//    8: one interrupt per 8 transfers, 3.5 microframes average latency
+//   64: the queue stays full for most of the wait, 1040 KB/sec
+// TRANSFER_NO_INTERRUPT on 7 of 8 transfers also gives one interrupt
+// per 8, with 4 us latency (Task() noticing them), and doesn't delay
+// other devices.  The simulator only resolves interrupt latency to whole
+// 125 us microframes: its "0 us" at threshold 1 is up to 125 us on
+// hardware.  These are not hardware measurements;
+// examples/Benchmark/Coalesce measures the same on a Teensy.  USBHost::setInterruptThreshold() changes the
+// threshold while running.
+#ifndef USBHOST_INTERRUPT_THRESHOLD
+#define USBHOST_INTERRUPT_THRESHOLD  1
+#endif
+
 
 /************************************************/
 /*  Data Types                                  */
@@ -88,10 +175,13 @@ class USBHost;
 // when any data transfer is added to the EHCI work
 // queues, and then returned to the free pool after the
 // data transfer completes and the driver has processed
-// the results.
+// the results.  Isochronous_t is used instead of
+// Transfer_t for isochronous endpoints, where each one
+// schedules a single frame of packets.
 typedef struct Device_struct       Device_t;
 typedef struct Pipe_struct         Pipe_t;
 typedef struct Transfer_struct     Transfer_t;
+typedef struct Isochronous_struct  Isochronous_t;
 typedef enum { CLAIM_NO = 0, CLAIM_REPORT, CLAIM_INTERFACE} hidclaim_t;
 
 // All USB device drivers inherit use these classes.
@@ -178,6 +268,174 @@ typedef struct {
     uint8_t buffer[STRING_BUF_SIZE];
 } strbuf_t;
 
+// Microseconds each step of connecting a device took.
+typedef struct {
+    uint32_t debounce;   // connect detected until port reset
+    uint32_t reset;      // port reset and reset recovery
+    uint32_t address;    // requests at address zero, until SET_ADDRESS
+    uint32_t device;     // device descriptor
+    uint32_t strings;    // language ID and strings
+    uint32_t config;     // config descriptor, from the device or cache
+    uint32_t configure;  // SET_CONFIGURATION and drivers claiming
+} enumeration_times_t;
+
+// enumbuf_t holds a device's descriptors while it enumerates.
+// See USBHOST_ENUMERATION_BUFFERS.
+typedef struct {
+    uint8_t  buffer[2048] __attribute__ ((aligned(32)));
+    setup_t  setup;
+    uint16_t len;          // config descriptor length
+    uint32_t start_micros; // micros() when enumeration began
+    uint32_t phase_micros; // micros() when the current phase began
+    uint8_t  phase;
+    enumeration_times_t times;
+} enumbuf_t;
+
+// usb_match_t is one entry of a driver's match table, listing devices
+// or interfaces its claim() may accept.  Each entry matches VID/PID,
+// or class with optional subclass & protocol.  Drivers give their table
+// to driver_ready_for_device, and are then only offered devices or
+// interfaces matching one of its entries.  claim() still checks the
+// descriptors, and may use info to remember which entry matched.
+typedef struct {
+    uint8_t  level;      // 0=device, 1=interface, 2=IAD (function class)
+    uint8_t  flags;      // USB_MATCH_FLAG_ID, CLASS, SUBCLASS, PROTOCOL
+    uint8_t  bClass;     // device or interface class, subclass & protocol
+    uint8_t  bSubClass;
+    uint8_t  bProtocol;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint32_t info;       // for the driver's use, eg device type
+} usb_match_t;
+
+#define USB_MATCH_FLAG_ID        1
+#define USB_MATCH_FLAG_CLASS     2
+#define USB_MATCH_FLAG_SUBCLASS  4
+#define USB_MATCH_FLAG_PROTOCOL  8
+#define USB_MATCH_ID(level, vid, pid, info) \
+    { level, USB_MATCH_FLAG_ID, 0, 0, 0, vid, pid, info }
+#define USB_MATCH_CLASS(level, cls, info) \
+    { level, USB_MATCH_FLAG_CLASS, cls, 0, 0, 0, 0, info }
+#define USB_MATCH_SUBCLASS(level, cls, sub, info) \
+    { level, USB_MATCH_FLAG_CLASS | USB_MATCH_FLAG_SUBCLASS, cls, sub, 0, 0, 0, info }
+#define USB_MATCH_PROTOCOL(level, cls, sub, proto, info) \
+    { level, USB_MATCH_FLAG_CLASS | USB_MATCH_FLAG_SUBCLASS | USB_MATCH_FLAG_PROTOCOL, \
+      cls, sub, proto, 0, 0, info }
+
+// True if a match table entry accepts a device or interface with these
+// IDs and class.  The entry's level is not checked.
+constexpr bool usb_match(const usb_match_t &m, uint16_t vid, uint16_t pid,
+    uint8_t cls, uint8_t subclass, uint8_t protocol)
+{
+    return (!(m.flags & USB_MATCH_FLAG_ID) || (m.idVendor == vid && m.idProduct == pid))
+        && (!(m.flags & USB_MATCH_FLAG_CLASS) || m.bClass == cls)
+        && (!(m.flags & USB_MATCH_FLAG_SUBCLASS) || m.bSubClass == subclass)
+        && (!(m.flags & USB_MATCH_FLAG_PROTOCOL) || m.bProtocol == protocol);
+}
+
+// segment_t is one piece of a scatter-gather data transfer.
+// See queue_Data_Transfer_SG.
+typedef struct {
+    void     *buffer;
+    uint32_t length;
+} segment_t;
+
+// batch_t describes one of several data transfers queued together.
+// See queue_Data_Transfers.
+typedef struct {
+    void      *buffer;
+    uint32_t  length;
+    USBDriver *driver;
+    uint32_t  flags;     // TRANSFER_NO_INTERRUPT
+} batch_t;
+
+// pipe_stats_t and device_stats_t are snapshots of the transfer
+// statistics kept for every pipe.  See USBHost::getPipeStats.
+typedef struct {
+    const Pipe_t *pipe;
+    uint8_t  address;    // device address
+    uint8_t  endpoint;   // endpoint number, 0x80 set for IN
+    uint8_t  type;       // 0=control, 1=isochronous, 2=bulk, 3=interrupt
+    uint8_t  queued;     // transfers currently queued
+    uint8_t  max_queued; // most transfers ever queued at once
+    uint16_t errors;
+    uint32_t transfers;  // completed transfers (frames for isochronous)
+    uint32_t bytes;
+    // interrupt & isochronous pipes: where they are in the periodic schedule
+    uint16_t interval;   // microframes between transactions
+    uint16_t uframe;     // first microframe used
+    uint8_t  start_mask; // microframes of each frame with start (or SSPLIT)
+    uint8_t  complete_mask; // microframes with CSPLIT (full & low speed)
+    uint8_t  stime;      // bandwidth used by each start (or SSPLIT)
+    uint8_t  ctime;      // bandwidth used by each CSPLIT
+} pipe_stats_t;
+
+// Bandwidth use of the periodic schedule, in units of 32 bytes of high
+// speed bus time (533 ns).  See USBHost::getPeriodicStats.
+typedef struct {
+    uint16_t uframes;    // microframes in the schedule
+    uint16_t capacity;   // units in each microframe
+    uint16_t limit;      // most units interrupt & isochronous may use
+    uint16_t max_load;   // busiest microframe
+    uint16_t available;  // units left in the busiest microframe
+    uint16_t pipes;      // interrupt & isochronous pipes
+    uint32_t total_load; // sum of all microframes
+    uint32_t failures;   // pipes not created for lack of bandwidth
+    uint16_t tts;        // transaction translators in use
+    uint16_t tt_max_load; // busiest TT frame, microseconds of 12 Mbit/sec time
+    uint32_t tt_overflows; // pipes scheduled without a TT budget, all in use
+} periodic_stats_t;
+
+typedef struct {
+    const Device_t *device;
+    uint8_t  address;
+    uint8_t  speed;      // 0=12, 1=1.5, 2=480 Mbit/sec
+    uint8_t  num_pipes;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t errors;
+    uint32_t transfers;
+    uint32_t bytes;
+} device_stats_t;
+
+// Enumeration timing, from the first device detected after begin() or
+// USBHost::resetEnumerationStats().  See USBHost::getEnumerationStats.
+typedef struct {
+    uint16_t configured;   // devices which completed enumeration
+    uint16_t failures;     // devices abandoned after too many errors
+    uint8_t  active;       // devices enumerating now
+    uint8_t  max_active;   // most devices enumerating at once
+    uint16_t cached;       // descriptors found in the descriptor cache
+    uint32_t bringup_micros; // first device detected to latest configured
+    uint32_t max_micros;   // slowest single device, from connect
+    enumeration_times_t last; // latest device configured
+} enumeration_stats_t;
+
+// trace_event_t is one record of the binary transfer trace.  See
+// USBHOST_TRACE and extras/usbtrace2pcap.py
+typedef struct {
+    uint32_t cycles;     // ARM_DWT_CYCCNT when the event occurred
+    uint32_t id;         // address of Transfer_t or Isochronous_t, or millis()
+    uint8_t  event;      // 'S'=submit, 'C'=complete, 'E'=error, 'T'=time sync
+    uint8_t  address;    // device address
+    uint8_t  endpoint;   // endpoint number, 0x80 set for IN
+    uint8_t  type;       // 0=control, 1=isochronous, 2=bulk, 3=interrupt
+    uint16_t length;     // requested length (submit) or actual length
+    uint16_t status;     // qTD error bits, 0x100 if cancelled, or
+                         // isochronous status (see followup_Isochronous)
+    uint8_t  data[16];   // SETUP packet for control submit, then data
+} trace_event_t;
+
+// pool_stats_t reports the use of one of the memory pools drivers
+// contribute.  See USBHost::poolStats.
+// For POOL_DMA_BUFFER, the numbers are 32 byte cache lines.
+typedef struct {
+    uint16_t total;      // number contributed
+    uint16_t available;  // number free now
+    uint16_t low_water;  // fewest ever free
+    uint16_t failures;   // allocations which failed because none were free
+} pool_stats_t;
+
 #define DEVICE_STRUCT_STRING_BUF_SIZE 50
 
 // Device_t holds all the information about a USB device
@@ -187,10 +445,13 @@ struct Device_struct {
     Device_t *next;
     USBDriver *drivers;
     strbuf_t *strbuf;
+    enumbuf_t *enumbuf; // only while enumerating
     uint8_t  speed; // 0=12, 1=1.5, 2=480 Mbit/sec
     uint8_t  address;
     uint8_t  hub_address;
     uint8_t  hub_port;
+    uint8_t  tt_address; // full & low speed: high speed hub with our TT, 0=root
+    uint8_t  tt_port;    // its port, if Multi-TT, or 0
     uint8_t  enum_state;
     uint8_t  bDeviceClass;
     uint8_t  bDeviceSubClass;
@@ -199,8 +460,10 @@ struct Device_struct {
     uint8_t  bMaxPower;
     uint16_t idVendor;
     uint16_t idProduct;
+    uint16_t bcdDevice;
     uint16_t LanguageID;
     uint8_t  enum_error_count;
+    uint32_t serial_hash; // serial number string, for the descriptor cache
 };
 
 // Pipe_t holes all information about each USB endpoint/pipe
@@ -222,7 +485,10 @@ struct Pipe_struct {
     uint8_t  start_mask;
     uint8_t  complete_mask;
     Pipe_t   *next;
-    void     (*callback_function)(const Transfer_t *);
+    union {
+        void (*callback_function)(const Transfer_t *);
+        void (*iso_callback_function)(const Isochronous_t *); // type=1 only
+    };
     void     (*error_callback_function)(const Transfer_t *);
     uint16_t periodic_interval;
     uint16_t periodic_offset;
@@ -231,11 +497,23 @@ struct Pipe_struct {
     uint16_t bandwidth_shift;
     uint8_t  bandwidth_stime;
     uint8_t  bandwidth_ctime;
-    uint32_t unused1;
-    uint32_t unused2;
-    uint32_t unused3;
-    uint32_t unused4;
-};
+    uint8_t  bandwidth_tt;    // full & low speed: TT budget index + 1
+    uint16_t bandwidth_usecs; // full & low speed: time used on TT's bus
+    uint16_t iso_next_frame; // next frame to schedule (isochronous only)
+    uint16_t iso_pending;    // number of Isochronous_t queued
+    Transfer_t *halt;        // halt qTD, always the end of the qTD list
+    Transfer_t *followup_first; // queued qTDs, in order, not yet completed
+    Transfer_t *followup_last;
+    Pipe_t   *next_active;   // list of pipes with queued qTDs
+    Pipe_t   *prev_active;
+    setup_t  clear_halt_setup; // CLEAR_FEATURE(ENDPOINT_HALT) after STALL
+    uint32_t stat_bytes;     // statistics, see USBHost::getPipeStats
+    uint32_t stat_transfers;
+    uint16_t stat_errors;
+    uint8_t  stat_queued;
+    uint8_t  stat_max_queued;
+    uint32_t stat_remaining; // bytes not done in the transfer's earlier qTDs
+} __attribute__ ((aligned(32)));
 
 // Transfer_t represents a single transaction on the USB bus.
 // The first portion is an EHCI qTD structure.  Transfer_t are
@@ -256,16 +534,61 @@ struct Transfer_struct {
     // Linked list of queued, not-yet-completed transfers
     Transfer_t *next_followup;
     Transfer_t *prev_followup;
-    Pipe_t     *pipe;
     // Data to be used by callback function.  When a group
-    // of Transfer_t are created, these fields and the
-    // interrupt-on-complete bit in the qTD token are only
-    // set in the last Transfer_t of the list.
+    // of Transfer_t are created, these fields are only set
+    // in the last Transfer_t of the list.  Others have pipe
+    // NULL, so pipe marks the end of each transfer.  The
+    // interrupt-on-complete bit is normally set there too,
+    // unless queued with TRANSFER_NO_INTERRUPT.  For bulk and
+    // interrupt transfers, setup holds the last qTD's own buffer
+    // range, and the others' buffer & length hold theirs.
+    Pipe_t     *pipe;
     void       *buffer;
     uint32_t   length;
     setup_t    setup;
     USBDriver  *driver;
-};
+} __attribute__ ((aligned(32)));
+
+// Isochronous_t represents 1 frame (1 ms) of isochronous packets.
+// The first portion is an EHCI iTD for high speed devices, or a
+// siTD for full speed devices using split transactions.  These are
+// linked directly into the periodic schedule for the specific frame
+// they will transmit or receive.  When the frame has completed, the
+// lengths array is updated with the actual number of bytes for each
+// packet and the pipe's iso_callback_function is called.
+struct Isochronous_struct {
+    union {
+        // Isochronous Transfer Descriptor (iTD), EHCI pg 33-38
+        struct {  // must be aligned to 32 byte boundary
+            volatile uint32_t next;
+            volatile uint32_t transaction[8];
+            volatile uint32_t buffer[7];
+        } itd;
+        // Split Transaction Isochronous Transfer Descriptor (siTD), EHCI pg 38-43
+        struct {  // must be aligned to 32 byte boundary
+            volatile uint32_t next;
+            volatile uint32_t capabilities;
+            volatile uint32_t schedule;
+            volatile uint32_t state;
+            volatile uint32_t buffer[2];
+            volatile uint32_t back;
+            uint32_t unused[9];
+        } sitd;
+    };
+    // Linked list of queued, not-yet-completed frames
+    Isochronous_t *next_followup;
+    Isochronous_t *prev_followup;
+    Pipe_t     *pipe;
+    // Data to be used by callback function
+    void       *buffer;
+    uint16_t   *lengths;      // one per packet, updated with actual length
+    USBDriver  *driver;
+    uint16_t   frame;         // frame number (0-2047) this is scheduled to run
+    uint16_t   retire_uframe; // microframe when removed from the schedule
+    uint8_t    num_packets;
+    uint8_t    status;        // 0=success, nonzero if any error or missed
+    uint16_t   unused;
+} __attribute__ ((aligned(32)));
 
 
 /************************************************/
@@ -276,32 +599,134 @@ class USBHost {
 public:
     static void begin();
     static void Task();
+    // Driver callbacks are normally called from the USB interrupt.  When
+    // deferred, completed transfers are instead placed into a ring buffer
+    // and Task() calls up to max_per_task of their callbacks.  Or call
+    // processCallbacks() from any other non-interrupt context.  The USB
+    // interrupt is masked while each callback runs, other interrupts aren't.
+    static void deferCallbacks(bool enable, uint32_t max_per_task = 8);
+    static uint32_t processCallbacks(uint32_t max = 0);
+    // Microframes the EHCI may delay completion interrupts, to combine
+    // several into one.  See USBHOST_INTERRUPT_THRESHOLD.
+    static void setInterruptThreshold(uint32_t microframes);
+    // Complete transfers queued with TRANSFER_NO_INTERRUPT which have
+    // finished, but not yet been noticed by any interrupt.  Task() does
+    // this automatically while such transfers are pending.
+    static void flushCompletions();
     static void countFree(uint32_t &devices, uint32_t &pipes, uint32_t &trans, uint32_t &strs);
+    // Usage of each memory pool, to check how many of each item drivers
+    // should contribute.  resetPoolStats() restarts the low water marks
+    // and failure counts.
+    enum {POOL_DEVICE=0, POOL_PIPE, POOL_TRANSFER, POOL_STRBUF, POOL_ISOCHRONOUS,
+          POOL_DMA_BUFFER, POOL_COUNT};
+    static void poolStats(uint32_t pool, pool_stats_t &stats);
+    static void resetPoolStats();
+    // Number of USBDriverTimer interrupts, and CPU cycles they used
+    static void timerStats(uint32_t &count, uint32_t &cycles, uint32_t &max_cycles);
+    // Copy the transfer statistics of every pipe, or every device, into
+    // list.  Returns the total number, which may be more than max.  The
+    // USB interrupt is blocked during one pass over all devices.
+    static uint32_t getPipeStats(pipe_stats_t *list, uint32_t max);
+    static uint32_t getDeviceStats(device_stats_t *list, uint32_t max);
+    static void clearStats();
+    // How long devices took to enumerate.  After resetEnumerationStats(),
+    // bringup_micros restarts from the next device detected.
+    static void getEnumerationStats(enumeration_stats_t &stats);
+    static void resetEnumerationStats();
+    // Shorter connect timing, and SET_ADDRESS first.  See USBHOST_FAST_ATTACH.
+    static void setFastAttach(bool enable);
+    static bool fastAttach();
+    // Optional cache of config and HID report descriptors, so devices
+    // which connect again are configured with fewer requests.  Entries
+    // are matched by VID, PID, bcdDevice and serial number (if the device
+    // has one), and a cached config descriptor is used only if its first
+    // 9 bytes match the device's.  To keep the cache across restarts, save the first
+    // descriptorCacheUsed() bytes of buffer to a file, and later restore
+    // them and use keep=true.  Damaged entries are discarded.
+    static void setDescriptorCache(void *buffer, uint32_t size, bool keep = false);
+    static void clearDescriptorCache();
+    static uint32_t descriptorCacheUsed();
+    // Bandwidth used by interrupt and isochronous pipes.  getPeriodicLoad
+    // copies up to max microframes' usage, and returns the number of
+    // microframes in the schedule.  See getPipeStats for each pipe's slot.
+    static void getPeriodicStats(periodic_stats_t &stats);
+    static uint32_t getPeriodicLoad(uint8_t *list, uint32_t max);
+    // Copy up to max of the oldest trace events not yet read, when
+    // USBHOST_TRACE is defined.  Returns the number copied.  Events
+    // overwritten before they were read are counted by traceDropped().
+    static uint32_t readTrace(trace_event_t *list, uint32_t max);
+    static uint32_t traceDropped();
 protected:
+    // Data transfer flags.  TRANSFER_NO_INTERRUPT completes without its
+    // own interrupt.  Its callback runs when a later interrupt on the
+    // same schedule (async or periodic) is handled, or an error occurs,
+    // or at the latest by the next Task() or flushCompletions().  Use it
+    // for all but the last of several transfers queued together.
+    enum {TRANSFER_NO_INTERRUPT = 1};
     static Pipe_t * new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
                              uint32_t direction, uint32_t maxlen, uint32_t interval = 0);
+    // Check whether new_Pipe would find enough periodic bandwidth, before
+    // claiming a device.  load receives the busiest microframe's usage.
+    static bool check_Pipe_Bandwidth(Device_t *dev, uint32_t type, uint32_t direction,
+                                     uint32_t maxlen, uint32_t interval, uint32_t *load = NULL);
     static bool queue_Control_Transfer(Device_t *dev, setup_t *setup,
                                        void *buf, USBDriver *driver);
+    // Descriptors kept by setDescriptorCache.  Type is the descriptor
+    // type, index is the interface number for interface descriptors
+    // (for example 0x22, HID report).  find copies into buf and returns
+    // len, or 0 if not cached with that length or not beginning with
+    // header, which may be the start of buf.
+    static uint32_t find_Cached_Descriptor(Device_t *dev, uint32_t type, uint32_t index,
+                                       void *buf, uint32_t len, const void *header = NULL,
+                                       uint32_t header_len = 0);
+    static void cache_Descriptor(Device_t *dev, uint32_t type, uint32_t index,
+                                       const void *data, uint32_t len);
     static bool queue_Data_Transfer(Pipe_t *pipe, void *buffer,
-                                    uint32_t len, USBDriver *driver);
-    static Device_t * new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port);
+                                    uint32_t len, USBDriver *driver, uint32_t flags = 0);
+    static bool queue_Data_Transfer_SG(Pipe_t *pipe, const segment_t *segments,
+                                    uint32_t num, USBDriver *driver, uint32_t flags = 0);
+    static bool queue_Data_Transfers(Pipe_t *pipe, const batch_t *batch, uint32_t num);
+    static uint32_t cancel_Transfers(Pipe_t *pipe,
+                                    void (*callback)(const Transfer_t *, uint32_t) = NULL);
+    static bool queue_Isochronous_Transfer(Pipe_t *pipe, void *buffer,
+                                    uint16_t *lengths, uint32_t num, USBDriver *driver);
+    // connect_micros & reset_micros are micros() when the connection was
+    // detected and when the port reset began, for enumeration_times_t.
+    static Device_t * new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port,
+                                 uint32_t connect_micros, uint32_t reset_micros);
     static void disconnect_Device(Device_t *dev);
     static void enumeration_transmit(Device_t *dev);
     static void enumeration_receive(const Transfer_t *transfer);
     static void enumeration_error(const Transfer_t *transfer);
+    static void enumeration_release(Device_t *dev, bool free_buffer);
+    static void clear_Halt_complete(const Transfer_t *transfer);
     static void driver_ready_for_device(USBDriver *driver);
+    static void driver_ready_for_device(USBDriver *driver,
+                                        const usb_match_t *table, uint32_t count);
     static volatile bool enumeration_busy;
 public: // Maybe others may want/need to contribute memory example HID devices may want to add transfers.
     static void contribute_Devices(Device_t *devices, uint32_t num);
     static void contribute_Pipes(Pipe_t *pipes, uint32_t num);
     static void contribute_Transfers(Transfer_t *transfers, uint32_t num);
     static void contribute_String_Buffers(strbuf_t *strbuf, uint32_t num);
+    static void contribute_Isochronous(Isochronous_t *isos, uint32_t num);
+    // Allocate memory for transfers, aligned to 32 byte cache lines and
+    // padded to a whole number of lines, from USBHOST_DMA_POOL_SIZE.
+    // Buffers which share a cache line with other data can be corrupted
+    // by IN transfers on Teensy 4, unless they are in DTCM.
+    static void * allocate_DMA_Buffer(uint32_t size);
+    static void free_DMA_Buffer(void *buffer);
 private:
     static void isr();
     static void convertStringDescriptorToASCIIString(uint8_t string_index, Device_t *dev, const Transfer_t *transfer);
     static void claim_drivers(Device_t *dev);
+    static bool offer_drivers(Device_t *dev, int type, const uint8_t *descriptors,
+                              uint32_t len, uint32_t cls, uint32_t subclass, uint32_t protocol);
     static uint32_t assign_address(void);
     static bool queue_Transfer(Pipe_t *pipe, Transfer_t *transfer);
+    static Transfer_t * build_Data_Transfer(Pipe_t *pipe, const segment_t *segments,
+                                    uint32_t num, USBDriver *driver, uint32_t flags,
+                                    Transfer_t **last);
     static void init_Device_Pipe_Transfer_memory(void);
     static Device_t * allocate_Device(void);
     static void delete_Pipe(Pipe_t *pipe);
@@ -310,13 +735,21 @@ private:
     static void free_Pipe(Pipe_t *q);
     static Transfer_t * allocate_Transfer(void);
     static void free_Transfer(Transfer_t *q);
+    static Isochronous_t * allocate_Isochronous(void);
+    static void free_Isochronous(Isochronous_t *q);
     static strbuf_t * allocate_string_buffer(void);
     static void free_string_buffer(strbuf_t *strbuf);
     static bool allocate_interrupt_pipe_bandwidth(Pipe_t *pipe,
             uint32_t maxlen, uint32_t interval);
     static void add_qh_to_periodic_schedule(Pipe_t *pipe);
-    static bool followup_Transfer(Transfer_t *transfer);
+    static void followup_Pipe(Pipe_t *pipe);
+    static void followup_Pipes(Pipe_t *list);
+    static bool followup_Isochronous(Isochronous_t *iso);
+    static void release_retired_Isochronous(void);
     static void followup_Error(void);
+    static void followup_Errors(Pipe_t *list);
+    static bool clear_Halt(Pipe_t *pipe);
+    static bool is_clear_Halt(const Transfer_t *transfer);
 public: // Maybe others may want/need to contribute memory example HID devices may want to add transfers.
 #ifdef USBHOST_PRINT_DEBUG
     static void print_(const Transfer_t *transfer);
@@ -443,8 +876,11 @@ public:
         if (dev == nullptr || dev->strbuf == nullptr) return nullptr;
         return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
     }
+    // Number of times a Pipe_t, Transfer_t or Isochronous_t could not be
+    // allocated for this driver, because too few were contributed.
+    uint32_t allocationFailures() { return alloc_failures; }
 protected:
-    USBDriver() : next(NULL), device(NULL) {}
+    USBDriver() : next(NULL), device(NULL), alloc_failures(0), match_table(NULL) {}
     // Check if a driver wishes to claim a device or interface or group
     // of interfaces within a device.  When this function returns true,
     // the driver is considered bound or loaded for that device.  When
@@ -453,7 +889,11 @@ protected:
     // to the new device.
     //   device has its vid&pid, class/subclass fields initialized
     //   type is 0 for device level, 1 for interface level, 2 for IAD
-    //   descriptors points to the specific descriptor data
+    //   descriptors points to the specific descriptor data: for type 0
+    //   all after the config descriptor, for type 1 the interface with
+    //   its alternate settings, for type 2 the IAD and the interfaces
+    //   it groups.  When an IAD's group isn't claimed, its interfaces
+    //   are offered one at a time.
     virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len) = 0;
 
     // When an unknown (not chapter 9) control transfer completes, this
@@ -494,6 +934,14 @@ protected:
     // wish to claim any device or interface (eg, if getting data
     // from the HID parser).
     Device_t *device;
+
+    // Counts failures to allocate memory for this driver's pipes
+    // (while claiming) and transfers.
+    uint32_t alloc_failures;
+
+    // The match table given to driver_ready_for_device.  When NULL,
+    // this driver is offered every device and interface.
+    const usb_match_t *match_table;
     friend class USBHost;
 };
 
@@ -510,10 +958,15 @@ public:
     uint32_t integer;
     uint32_t started_micros; // testing only
 private:
+    void link();
+    void unlink();
+    static void advance();
+    static bool program(bool expired_waiting);
     USBDriver      *driver;
-    uint32_t       usec;
+    uint32_t       expires; // timer wheel tick
     USBDriverTimer *next;
     USBDriverTimer *prev;
+    uint8_t        slot = 0xFF; // timer wheel list, 0xFF when not started
     friend class USBHost;
 };
 
@@ -648,6 +1101,7 @@ protected:
     void new_port_status(uint32_t port, uint32_t status);
     void start_debounce_timer(uint32_t port);
     void stop_debounce_timer(uint32_t port);
+    uint32_t debounce_interval();
 private:
     Device_t mydevices[MAXPORTS];
     Pipe_t mypipes[2] __attribute__ ((aligned(32)));
@@ -674,6 +1128,8 @@ private:
     uint8_t  port_doing_reset;
     uint8_t  port_doing_reset_speed;
     uint8_t  portstate[MAXPORTS];
+    uint32_t connect_micros[MAXPORTS];
+    uint32_t reset_micros;
     portbitmask_t send_pending_poweron;
     portbitmask_t send_pending_getstatus;
     portbitmask_t send_pending_clearstatus_connect;
@@ -728,6 +1184,7 @@ protected:
     void out_data(const Transfer_t *transfer);
     bool check_if_using_report_id();
     void parse();
+    void report_descriptor_ready();
     USBHIDInput * find_driver(uint32_t topusage);
     void parse(uint16_t type_and_report_id, const uint8_t *data, uint32_t len);
     void init();
@@ -761,8 +1218,11 @@ private:
 	uint8_t _tx_state = 0;
 	uint8_t _tx_mask = 3;
     bool hid_driver_claimed_control_ = false;
+    bool report_from_cache = false; // parse when hidTimer fires
     USBDriverTimer hidTimer;
-	uint8_t _bigBuffer[800 + 64+64];
+	static_assert(USBHOST_HID_DESCRIPTOR_SIZE >= 64 && USBHOST_HID_DESCRIPTOR_SIZE <= 16384,
+		"USBHOST_HID_DESCRIPTOR_SIZE must be from 64 to 16384");
+	uint8_t _bigBuffer[USBHOST_HID_DESCRIPTOR_SIZE + 64+64];
 	uint8_t *_bigBufferEnd = _bigBuffer + sizeof(_bigBuffer);
 	uint16_t _big_buffer_size = sizeof(_bigBuffer);
     uint8_t bInterfaceNumber = 0;
@@ -1157,13 +1617,9 @@ private:
     uint8_t         txbuf_[64];     // buffer to use to send commands to joystick
     volatile bool       send_Control_packet_active_;
     // Mapping table to say which devices we handle
-    typedef struct {
-        uint16_t    idVendor;
-        uint16_t    idProduct;
-        joytype_t   joyType;
-        bool        hidDevice;
-    } product_vendor_mapping_t;
-    static product_vendor_mapping_t pid_vid_mapping[];
+    // info is the joyType, plus JOY_HID_DEVICE if claimed by the HID parser
+    static const usb_match_t pid_vid_mapping[];
+    static const uint32_t JOY_HID_DEVICE = 0x100;
 };
 
 
@@ -1196,10 +1652,13 @@ public:
         SystemReset           = 0xFF, // System Real Time - System Reset
     };
     MIDIDeviceBase(USBHost &host, uint32_t *rx, uint32_t *tx1, uint32_t *tx2,
-                   uint16_t bufsize, uint32_t *rqueue, uint16_t qsize) :
+                   uint16_t bufsize, uint32_t *rqueue, uint16_t qsize,
+                   Pipe_t *pipes, uint32_t num_pipes,
+                   Transfer_t *transfers, uint32_t num_transfers) :
         txtimer(this), rx_buffer(rx), tx_buffer1(tx1), tx_buffer2(tx2),
-        rx_queue(rqueue), max_packet_size(bufsize), rx_queue_size(qsize) {
-        init();
+        max_packet_size(bufsize) {
+        rx_ring.begin(rqueue, qsize);
+        init(pipes, num_pipes, transfers, num_transfers);
     }
     void sendNoteOff(uint8_t note, uint8_t velocity, uint8_t channel, uint8_t cable = 0) {
         send(0x80, note, velocity, channel, cable);
@@ -1343,6 +1802,10 @@ public:
     uint16_t getSysExArrayLength(void) {
         return msg_data2 << 8 | msg_data1;
     }
+    // Received messages lost because the receive queue was full
+    uint32_t droppedMessages(void) {
+        return rx_dropped;
+    }
     void setHandleNoteOff(void (*fptr)(uint8_t channel, uint8_t note, uint8_t velocity)) {
         // type: 0x80  NoteOff
         handleNoteOff = fptr;
@@ -1443,7 +1906,7 @@ protected:
     static void tx_callback(const Transfer_t *transfer);
     void rx_data(const Transfer_t *transfer);
     void tx_data(const Transfer_t *transfer);
-    void init();
+    void init(Pipe_t *pipes, uint32_t num_pipes, Transfer_t *transfers, uint32_t num_transfers);
     void write_packed(uint32_t data);
     void send_sysex_buffer_has_term(const uint8_t *data, uint32_t length, uint8_t cable);
     void send_sysex_add_term_bytes(const uint8_t *data, uint32_t length, uint8_t cable);
@@ -1463,12 +1926,10 @@ private:
     uint16_t rx_size;
     uint16_t tx_size;
     //uint32_t rx_queue[RX_QUEUE_SIZE];
-    uint32_t * const rx_queue;
+    USBRingBuffer<uint32_t> rx_ring;
+    volatile uint32_t rx_dropped = 0;
     volatile bool rx_packet_queued;
     const uint16_t max_packet_size;
-    const uint16_t rx_queue_size;
-    uint16_t rx_head;
-    uint16_t rx_tail;
     volatile uint8_t tx1_count;
     volatile uint8_t tx2_count;
     uint8_t rx_ep;
@@ -1502,37 +1963,43 @@ private:
     void (*handleActiveSensing)(void);
     void (*handleSystemReset)(void);
     void (*handleRealTimeSystem)(uint8_t rtb);
-    Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-    Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
     strbuf_t mystring_bufs[1];
 };
 
-class MIDIDevice : public MIDIDeviceBase {
+// MIDIDevice_Custom lets you choose the buffer sizes, and how many pipes
+// and transfers this instance adds to the shared pools.  One MIDI device
+// needs 2 pipes and 5 transfers, so PIPES=2 and TRANSFERS=5 trims RAM
+// when many instances are used, or more transfers deepen the queues.
+template <uint16_t MAX_PACKET_SIZE, uint16_t RX_QUEUE_SIZE,
+          uint32_t PIPES = 3, uint32_t TRANSFERS = 7>
+class MIDIDevice_Custom : public MIDIDeviceBase {
 public:
-    MIDIDevice(USBHost &host) :
-        MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, RX_QUEUE_SIZE) {};
-    // MIDIDevice(USBHost *host) : ....
+    MIDIDevice_Custom(USBHost &host) :
+        MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, RX_QUEUE_SIZE,
+                       mypipes, PIPES, mytransfers, TRANSFERS) {};
 private:
-    enum { MAX_PACKET_SIZE = 64 };
-    enum { RX_QUEUE_SIZE = 80 }; // must be more than MAX_PACKET_SIZE/4
+    static_assert(MAX_PACKET_SIZE >= 64 && MAX_PACKET_SIZE <= 512 && (MAX_PACKET_SIZE % 4) == 0,
+        "MIDIDevice_Custom MAX_PACKET_SIZE must be a multiple of 4, from 64 to 512");
+    static_assert(RX_QUEUE_SIZE >= MAX_PACKET_SIZE / 4,
+        "MIDIDevice_Custom RX_QUEUE_SIZE must be at least MAX_PACKET_SIZE/4");
+    static_assert(PIPES >= 2, "MIDIDevice_Custom needs at least 2 pipes");
+    static_assert(TRANSFERS >= 5, "MIDIDevice_Custom needs at least 5 transfers");
+    Pipe_t mypipes[PIPES] __attribute__ ((aligned(32)));
+    Transfer_t mytransfers[TRANSFERS] __attribute__ ((aligned(32)));
     uint32_t rx[MAX_PACKET_SIZE / 4];
     uint32_t tx1[MAX_PACKET_SIZE / 4];
     uint32_t tx2[MAX_PACKET_SIZE / 4];
     uint32_t queue[RX_QUEUE_SIZE];
 };
 
-class MIDIDevice_BigBuffer : public MIDIDeviceBase {
+class MIDIDevice : public MIDIDevice_Custom<64, 80> {
 public:
-    MIDIDevice_BigBuffer(USBHost &host) :
-        MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, RX_QUEUE_SIZE) {};
-    // MIDIDevice(USBHost *host) : ....
-private:
-    enum { MAX_PACKET_SIZE = 512 };
-    enum { RX_QUEUE_SIZE = 400 }; // must be more than MAX_PACKET_SIZE/4
-    uint32_t rx[MAX_PACKET_SIZE / 4];
-    uint32_t tx1[MAX_PACKET_SIZE / 4];
-    uint32_t tx2[MAX_PACKET_SIZE / 4];
-    uint32_t queue[RX_QUEUE_SIZE];
+    MIDIDevice(USBHost &host) : MIDIDevice_Custom(host) {};
+};
+
+class MIDIDevice_BigBuffer : public MIDIDevice_Custom<512, 400> {
+public:
+    MIDIDevice_BigBuffer(USBHost &host) : MIDIDevice_Custom(host) {};
 };
 
 
@@ -1550,7 +2017,9 @@ public:
     USBSerialBase(USBHost &host, uint32_t *big_buffer, uint16_t buffer_size,
                   uint16_t min_pipe_rxtx, uint16_t max_pipe_rxtx,
                   uint16_t vid_to_claim, uint16_t pid_to_claim, 
-                  sertype_t vid_pid_sertype, int vid_pid_claim_at_type
+                  sertype_t vid_pid_sertype, int vid_pid_claim_at_type,
+                  Pipe_t *pipes, uint32_t num_pipes,
+                  Transfer_t *transfers, uint32_t num_transfers
                 ) :
         txtimer(this),
         _bigBuffer(big_buffer),
@@ -1564,7 +2033,7 @@ public:
 
     {
 
-        init();
+        init(pipes, num_pipes, transfers, num_transfers);
     }
 
     void begin(uint32_t baud, uint32_t format = USBHOST_SERIAL_8N1);
@@ -1576,6 +2045,7 @@ public:
     virtual int read(void);
     virtual int availableForWrite();
     virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *buffer, size_t size);
     virtual void flush(void);
 
     bool setDTR(bool fSet);
@@ -1595,14 +2065,13 @@ private:
     static void tx_callback(const Transfer_t *transfer);
     void rx_data(const Transfer_t *transfer);
     void tx_data(const Transfer_t *transfer);
-    void rx_queue_packets(uint32_t head, uint32_t tail);
-    void init();
+    void rx_queue_packets();
+    void tx_queue_packets();
+    void init(Pipe_t *pipes, uint32_t num_pipes, Transfer_t *transfers, uint32_t num_transfers);
     static bool check_rxtx_ep(uint32_t &rxep, uint32_t &txep);
     bool init_buffers(uint32_t rsize, uint32_t tsize);
     void ch341_setBaud(uint8_t byte_index);
 private:
-    Pipe_t mypipes[3] __attribute__ ((aligned(32)));
-    Transfer_t mytransfers[7] __attribute__ ((aligned(32)));
     strbuf_t mystring_bufs[1];
     USBDriverTimer txtimer;
     uint32_t *_bigBuffer;
@@ -1627,16 +2096,10 @@ private:
     Pipe_t *txpipe;
     uint8_t *rx1;   // location for first incoming packet
     uint8_t *rx2;   // location for second incoming packet
-    uint8_t *rxbuf; // receive circular buffer
     uint8_t *tx1;   // location for first outgoing packet
     uint8_t *tx2;   // location for second outgoing packet
-    uint8_t *txbuf;
-    volatile uint16_t rxhead;// receive head
-    volatile uint16_t rxtail;// receive tail
-    volatile uint16_t txhead;
-    volatile uint16_t txtail;
-    uint16_t rxsize;// size of receive circular buffer
-    uint16_t txsize;// size of transmit circular buffer
+    USBRingBuffer<uint8_t> rxring; // receive circular buffer, in _bigBuffer
+    USBRingBuffer<uint8_t> txring; // transmit circular buffer, in _bigBuffer
     volatile uint8_t  rxstate;// bitmask: which receive packets are queued
     volatile uint8_t  txstate;
     uint8_t pending_control;
@@ -1649,18 +2112,38 @@ private:
 
     sertype_t sertype;
 
-    typedef struct {
-        uint16_t    idVendor;
-        uint16_t    idProduct;
-        sertype_t   sertype;
-        int         claim_at_type;
-    } product_vendor_mapping_t;
-    static product_vendor_mapping_t pid_vid_mapping[];
+    // level is the claim type, info is the sertype
+    static const usb_match_t pid_vid_mapping[];
 
 };
 
+// USBSerial_Custom class - lets you choose the buffer size, the largest packet size, and how
+// many pipes and transfers this instance adds to the shared pools.  One serial device needs
+// 2 pipes and 6 transfers, so PIPES=2 and TRANSFERS=6 trims RAM when many are used.
+// Parameters are the same as USBSerial_BigBuffer, except min_rxtx defaults to 1.
+template <uint32_t BUFSIZE, uint16_t MAX_PACKET_SIZE = 512,
+          uint32_t PIPES = 3, uint32_t TRANSFERS = 7>
+class USBSerial_Custom : public USBSerialBase {
+public:
+    USBSerial_Custom(USBHost &host, uint16_t min_rxtx = 1,
+              uint16_t vid_to_claim = 0, uint16_t pid_to_claim = 0, 
+              sertype_t vid_pid_sertype = USBSerialBase::UNKNOWN, int vid_pid_claim_at_type = 0) :
+        USBSerialBase(host, bigbuffer, sizeof(bigbuffer), min_rxtx, MAX_PACKET_SIZE, vid_to_claim, pid_to_claim,
+                      vid_pid_sertype, vid_pid_claim_at_type, mypipes, PIPES, mytransfers, TRANSFERS) {};
+private:
+    static_assert(MAX_PACKET_SIZE >= 8 && MAX_PACKET_SIZE <= 512,
+        "USBSerial_Custom MAX_PACKET_SIZE must be from 8 to 512");
+    static_assert(BUFSIZE >= MAX_PACKET_SIZE * 6 + 2 && BUFSIZE <= 65532,
+        "USBSerial_Custom BUFSIZE must hold at least 6 max size packets, plus 2 extra bytes");
+    static_assert(PIPES >= 2, "USBSerial_Custom needs at least 2 pipes");
+    static_assert(TRANSFERS >= 6, "USBSerial_Custom needs at least 6 transfers");
+    Pipe_t mypipes[PIPES] __attribute__ ((aligned(32)));
+    Transfer_t mytransfers[TRANSFERS] __attribute__ ((aligned(32)));
+    uint32_t bigbuffer[(BUFSIZE + 3) / 4];
+};
+
 // USBSerial class - is setup to handle most USB to serial devices that work at USB Full speed with max of 64 byte packets
-class USBSerial : public USBSerialBase {
+class USBSerial : public USBSerial_Custom<648, 64> {
 public:
     // Constructor
     // typically you just need to pass in the reference to the host object,
@@ -1671,13 +2154,10 @@ public:
               uint16_t vid_to_claim = 0, uint16_t pid_to_claim = 0, 
               sertype_t vid_pid_sertype = USBSerial::UNKNOWN, int vid_pid_claim_at_type = 0) :
         // hard code the normal one to 1 and 64 bytes for most likely most are 64
-        USBSerialBase(host, bigbuffer, sizeof(bigbuffer), 1, 64, vid_to_claim, pid_to_claim, vid_pid_sertype, vid_pid_claim_at_type) {};
-private:
-    enum { BUFFER_SIZE = 648 }; // must hold at least 6 max size packets, plus 2 extra bytes
-    uint32_t bigbuffer[(BUFFER_SIZE + 3) / 4];
+        USBSerial_Custom(host, 1, vid_to_claim, pid_to_claim, vid_pid_sertype, vid_pid_claim_at_type) {};
 };
 
-class USBSerial_BigBuffer: public USBSerialBase {
+class USBSerial_BigBuffer: public USBSerial_Custom<4096, 512> {
 public:
     // USBSerial_BigBuffer: handles devices that run at USB highspeed and can read and/or write up to 512 bytes per packet,
     // Parameters:
@@ -1690,10 +2170,7 @@ public:
     USBSerial_BigBuffer(USBHost &host, uint16_t min_rxtx = 65,
               uint16_t vid_to_claim = 0, uint16_t pid_to_claim = 0, 
               sertype_t vid_pid_sertype = USBSerial::UNKNOWN, int vid_pid_claim_at_type = 0) :
-        USBSerialBase(host, bigbuffer, sizeof(bigbuffer), min_rxtx, 512, vid_to_claim, pid_to_claim, vid_pid_sertype, vid_pid_claim_at_type) {};
-private:
-    enum { BUFFER_SIZE = 4096 }; // must hold at least 6 max size packets, plus 2 extra bytes
-    uint32_t bigbuffer[(BUFFER_SIZE + 3) / 4];
+        USBSerial_Custom(host, min_rxtx, vid_to_claim, pid_to_claim, vid_pid_sertype, vid_pid_claim_at_type) {};
 };
 
 //--------------------------------------------------------------------------
@@ -1756,10 +2233,9 @@ private:
     Pipe_t *rxpipe;
     Pipe_t *txpipe;
     bool first_update;
-    uint8_t txbuffer[240];
+    USBRingBuffer<uint8_t, 256> txring; // messages, each preceded by its length
+    uint8_t txpacket[64];
     uint8_t rxpacket[64];
-    volatile uint16_t txhead;
-    volatile uint16_t txtail;
     volatile bool     txready;
     volatile uint8_t  rxlen;
     volatile bool     do_polling;
@@ -2004,13 +2480,11 @@ private:
     enum { RX_BUFFER_SIZE = 1024, TX_BUFFER_SIZE = 512 };
     enum { DEFAULT_WRITE_TIMEOUT = 3500};
 
-    uint8_t rx_buffer_[RX_BUFFER_SIZE];
+    USBRingBuffer<uint8_t, RX_BUFFER_SIZE> rx_ring_;
     uint8_t tx_buffer_[TX_BUFFER_SIZE];
 
     volatile uint8_t tx_out_data_pending_ = 0;
 
-    volatile uint16_t rx_head_;// receive head
-    volatile uint16_t rx_tail_;// receive tail
     volatile uint16_t tx_head_;
     uint16_t rx_pipe_size_;// size of receive circular buffer
     uint16_t tx_pipe_size_;// size of transmit circular buffer
@@ -2106,7 +2580,9 @@ public:
     bool have_hid_descriptor_ = false;
     uint8_t *sdp_buffer_ = nullptr;
     uint16_t sdp_buffer_len_ = 0;
-    uint8_t descriptor_[800];
+    static_assert(USBHOST_BT_DESCRIPTOR_SIZE >= 64 && USBHOST_BT_DESCRIPTOR_SIZE <= 16384,
+        "USBHOST_BT_DESCRIPTOR_SIZE must be from 64 to 16384");
+    uint8_t descriptor_[USBHOST_BT_DESCRIPTOR_SIZE];
     enum {REMOTE_NAME_SIZE = 32};
     uint8_t remote_name_[REMOTE_NAME_SIZE] = {0};
     uint16_t descsize_;
@@ -2391,11 +2867,7 @@ private:
     int             pairing_keys_eeprom_start_index_ = -1;
     int             pairing_keys_max_ = 5;
 
-    typedef struct {
-        uint16_t    idVendor;
-        uint16_t    idProduct;
-    } product_vendor_mapping_t;
-    static product_vendor_mapping_t pid_vid_mapping[];
+    static const usb_match_t pid_vid_mapping[];
 
 };
 
@@ -2418,7 +2890,7 @@ protected:
     void rx_data(const Transfer_t *transfer);
     void tx_data(const Transfer_t *transfer);
     void init();
-    void rx_queue_packets(uint32_t head, uint32_t tail);
+    void rx_queue_packets();
     void sendStr(Device_t *dev, uint8_t index, char *str);
 private:
     int state = 0;
@@ -2430,10 +2902,8 @@ private:
     uint8_t tx_buffer[MAX_PACKET_SIZE];
     uint16_t rx_size;
     uint16_t tx_size;
-    uint8_t rx_queue[RX_QUEUE_SIZE];
+    USBRingBuffer<uint8_t, RX_QUEUE_SIZE> rx_ring;
     bool rx_packet_queued;
-    uint16_t rx_head;
-    uint16_t rx_tail;
     uint8_t rx_ep;
     uint8_t tx_ep;
     char *manufacturer;
@@ -31,6 +31,12 @@
 #define ADK_VID   0x18D1
 #define ADK_PID   0x2D00
 #define ADB_PID   0x2D01
+
+static const usb_match_t adk_match[] = {
+	USB_MATCH_ID(1, ADK_VID, ADK_PID, 0),
+	USB_MATCH_ID(1, ADK_VID, ADB_PID, 0)
+};
+
 #define USB_SETUP_DEVICE_TO_HOST 	0x80
 #define USB_SETUP_HOST_TO_DEVICE 	0x00 
 #define USB_SETUP_TYPE_VENDOR 		0x40 
@@ -59,9 +65,7 @@ void ADK::init()
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	
-	rx_head = 0;
-	rx_tail = 0;
-	driver_ready_for_device(this);
+	driver_ready_for_device(this, adk_match, sizeof(adk_match)/sizeof(usb_match_t));
 	
 	state = 0;
 }
@@ -196,8 +200,7 @@ bool ADK::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t le
 			txpipe = NULL;
 		}
 		
-		rx_head = 0;
-		rx_tail = 0;
+		rx_ring.clear();
 
 		// claim if either pipe created
 		bool created = (rxpipe || txpipe);
@@ -309,31 +312,20 @@ void ADK::rx_data(const Transfer_t *transfer)
 	print(" Data: ");
 	print_hexbytes(transfer->buffer, len);
 	
-	uint32_t head = rx_head;
-	
-	uint8_t *p = (uint8_t *)transfer->buffer;
+	const uint8_t *p = (const uint8_t *)transfer->buffer;
 	if (p != NULL && len != 0)
-	{
-		do 
-		{
-			if (++head >= RX_QUEUE_SIZE) 
-				head = 0;
-		
-			rx_queue[head] = *p++;
-		} while (--len);
-	}
-	rx_head = head;
+		rx_ring.write(p, len);
 	
 	rx_packet_queued = false;
-	rx_queue_packets(rx_head, rx_tail);
+	rx_queue_packets();
 }
 
-void ADK::rx_queue_packets(uint32_t head, uint32_t tail)
+void ADK::rx_queue_packets()
 {
 	if (rx_packet_queued)
 		return;
 	
-	uint32_t avail = (head < tail) ? tail - head - 1 : RX_QUEUE_SIZE - 1 - head + tail;
+	uint32_t avail = rx_ring.space();
 	
 	println("rx_size = ", rx_size);
 	println("avail = ", avail);
@@ -390,13 +382,7 @@ int ADK::available(void)
 	if (!device) 
 		return 0;
 	
-	uint32_t head = rx_head;
-	uint32_t tail = rx_tail;
-	
-	if (head >= tail) 
-		return head - tail;
-	
-	return RX_QUEUE_SIZE + head - tail;
+	return rx_ring.available();
 }
 
 int ADK::peek(void)
@@ -404,16 +390,12 @@ int ADK::peek(void)
 	if (!device) 
 		return -1;
 	
-	uint32_t head = rx_head;
-	uint32_t tail = rx_tail;
+	const uint8_t *p = rx_ring.peek();
 	
-	if (head == tail) 
+	if (!p) 
 		return -1;
 	
-	if (++tail >= RX_QUEUE_SIZE) 
-		tail = 0;
-	
-	return rx_queue[tail];
+	return *p;
 }
 
 int ADK::read(void)
@@ -421,19 +403,12 @@ int ADK::read(void)
 	if (!device) 
 		return -1;
 	
-	uint32_t head = rx_head;
-	uint32_t tail = rx_tail;
+	uint8_t c;
 	
-	if (head == tail) 
+	if (!rx_ring.get(c)) 
 		return -1;
 	
-	if (++tail >= RX_QUEUE_SIZE) 
-		tail = 0;
-	
-	int c = rx_queue[tail];
-	rx_tail = tail;
-	
-	rx_queue_packets(head, tail);
+	rx_queue_packets();
 	
 	return c;
 }
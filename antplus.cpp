@@ -34,6 +34,11 @@
 #define ANTPLUS_2_PID   0x1008
 #define ANTPLUS_M_PID   0x1009
 
+static const usb_match_t antplus_match[] = {
+	USB_MATCH_ID(1, ANTPLUS_VID, ANTPLUS_2_PID, 0),
+	USB_MATCH_ID(1, ANTPLUS_VID, ANTPLUS_M_PID, 0)
+};
+
 #define print   USBHost::print_
 #define println USBHost::println_
 
@@ -54,7 +59,7 @@ void AntPlus::init()
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
-	driver_ready_for_device(this);
+	driver_ready_for_device(this, antplus_match, sizeof(antplus_match)/sizeof(usb_match_t));
 	user_onStatusChange = NULL;
 	user_onDeviceID = NULL;
 	user_onHeartRateMonitor = NULL;
@@ -97,11 +102,9 @@ bool AntPlus::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_
 	if (rxpipe && txpipe) {
 		rxpipe->callback_function = rx_callback;
 		txpipe->callback_function = tx_callback;
-		txhead = 0;
-		txtail = 0;
+		txring.clear();
 		//rxhead = 0;
 		//rxtail = 0;
-		memset(txbuffer, 0, sizeof(txbuffer));
 		first_update = true;
 		txready = true;
 		updatetimer.start(500000);
@@ -148,20 +151,10 @@ void AntPlus::rx_data(const Transfer_t *transfer)
 
 void AntPlus::tx_data(const Transfer_t *transfer)
 {
-	uint8_t *p = (uint8_t *)transfer->buffer;
-	//print("tx_data, len=", *(p-1));
-	//print(", tail=", (p-1) - txbuffer);
-	//println(", tail=", txtail);
-	uint32_t tail = txtail;
-	uint8_t size = *(p-1);
-	tail += size + 1;
-	if (tail >= sizeof(txbuffer)) tail -= sizeof(txbuffer);
-	txtail = tail;
-	//println("new tail=", tail);
+	//println("tx_data, len=", transfer->length);
 	txready = true;
 	transmit();
 	//txtimer.start(8000);
-	// adjust tail...
 	// start timer if more data to send
 }
 
@@ -172,31 +165,15 @@ size_t AntPlus::write(const void *data, const size_t size)
 	//print(" bytes: ");
 	//print_hexbytes(data, size);
 	if (size > 64) return 0;
-	uint32_t head = txhead;
-	if (++head >= sizeof(txbuffer)) head = 0;
-	uint32_t remain = sizeof(txbuffer) - head;
-	if (remain < size + 1) {
-		// not enough space at end of buffer
-		txbuffer[head] = 0xFF;
-		head = 0;
-	}
-	uint32_t avail;
 	uint8_t attempts = 100;
-	do {
-		uint32_t tail = txtail;
-		if (head > tail) {
-			avail = sizeof(txbuffer) - head + tail;
-		} else {
-			avail = tail - head;
-		}
-		attempts--;
-	} while ((avail < size + 1) && attempts > 0 ); // wait for space in buffer
-	txbuffer[head] = size;
-	memcpy(txbuffer + head + 1, data, size);
-	txhead = head + size;
-	//print("head=", txhead);
-	//println(", tail=", txtail);
-	//print_hexbytes(txbuffer, 60);
+	while (txring.space() < size + 1) { // wait for space in buffer
+		if (--attempts == 0) return 0;
+	}
+	// length and data are added together, so transmit never sees half
+	uint8_t msg[65];
+	msg[0] = size;
+	memcpy(msg + 1, data, size);
+	txring.write(msg, size + 1);
 	NVIC_DISABLE_IRQ(IRQ_USBHS);
 	transmit();
 	NVIC_ENABLE_IRQ(IRQ_USBHS);
@@ -206,24 +183,14 @@ size_t AntPlus::write(const void *data, const size_t size)
 void AntPlus::transmit()
 {
 	if (!txready) return;
-	uint32_t head = txhead;
-	uint32_t tail = txtail;
-	if (head == tail) {
+	uint8_t size;
+	if (!txring.get(size)) {
 		//println("no data to transmit");
 		return; // no data to transit
 	}
-	if (++tail >= sizeof(txbuffer)) tail = 0;
-	uint32_t size = txbuffer[tail];
-	//print("tail=", tail);
-	//println(", tx size=", size);
-	if (size == 0xFF) {
-		txtail = 0;
-		tail = 0;
-		size = txbuffer[0];
-		//println("tx size=", size);
-	}
-	//txtail = tail + size;
-	queue_Data_Transfer(txpipe, txbuffer + tail + 1, size, this);
+	//println("tx size=", size);
+	txring.read(txpacket, size);
+	queue_Data_Transfer(txpipe, txpacket, size, this);
 	//txtimer.start(8000);
 	txready = false;
 }
@@ -120,8 +120,9 @@ bool BluetoothController::queue_Data_Transfer_Debug(Pipe_t *pipe, void *buffer,
 //12 01 00 02 FF 01 01 40 5C 0A E8 21 12 01 01 02 03 01
 //VendorID = 0A5C, ProductID = 21E8, Version = 0112
 //Class/Subclass/Protocol = 255 / 1 / 1
-BluetoothController::product_vendor_mapping_t BluetoothController::pid_vid_mapping[] = {
-    { 0xA5C, 0x21E8 }
+const usb_match_t BluetoothController::pid_vid_mapping[] = {
+    USB_MATCH_PROTOCOL(0, 0xE0, 1, 1, 0),  // Bluetooth Programming Interface
+    USB_MATCH_ID(0, 0xA5C, 0x21E8, 0)
 };
 
 /************************************************************/
@@ -133,7 +134,7 @@ void BluetoothController::init()
     contribute_Pipes(mypipes, sizeof(mypipes) / sizeof(Pipe_t));
     contribute_Transfers(mytransfers, sizeof(mytransfers) / sizeof(Transfer_t));
     contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs) / sizeof(strbuf_t));
-    driver_ready_for_device(this);
+    driver_ready_for_device(this, pid_vid_mapping, sizeof(pid_vid_mapping) / sizeof(pid_vid_mapping[0]));
 }
 
 bool BluetoothController::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
@@ -148,7 +149,8 @@ bool BluetoothController::claim(Device_t *dev, int type, const uint8_t *descript
     if (dev->bDeviceClass != 0xe0)  {
         bool special_case_device = false;
         for (uint8_t i = 0; i < (sizeof(pid_vid_mapping) / sizeof(pid_vid_mapping[0])); i++) {
-            if ((pid_vid_mapping[i].idVendor == dev->idVendor) && (pid_vid_mapping[i].idProduct == dev->idProduct)) {
+            if (usb_match(pid_vid_mapping[i], dev->idVendor, dev->idProduct,
+                    dev->bDeviceClass, dev->bDeviceSubClass, dev->bDeviceProtocol)) {
                 special_case_device = true;
                 break;
             }
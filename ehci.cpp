@@ -60,7 +60,7 @@
 #define PERIODIC_LIST_SIZE  32
 #endif
 
-// The EHCI periodic schedule, used for interrupt pipes/endpoints
+// The EHCI periodic schedule, used for interrupt & isochronous pipes/endpoints
 static uint32_t periodictable[PERIODIC_LIST_SIZE] __attribute__ ((aligned(4096), used));
 static uint8_t  uframe_bandwidth[PERIODIC_LIST_SIZE*8];
 
@@ -74,32 +74,116 @@ static uint8_t  port_state;
 
 // The device currently connected, or NULL when no device
 static Device_t   *rootdev=NULL;
+static uint32_t   root_connect_micros=0;
+static uint32_t   root_reset_micros=0;
+
+// List of all pipes with queued transfers in the asychronous schedule
+// (control & bulk).  Each pipe keeps its own list of queued transfers,
+// in the order the EHCI will complete them.  When the EHCI completes
+// transfers, these lists are how we locate them in memory.
+static Pipe_t *async_active_first=NULL;
+static Pipe_t *async_active_last=NULL;
+
+// List of all pipes with queued transfers in the periodic schedule
+// (interrupt endpoints).
+static Pipe_t *periodic_active_first=NULL;
+static Pipe_t *periodic_active_last=NULL;
+
+// List of all queued isochronous frames (iTD & siTD) in the periodic
+// schedule.  Completed frames are moved to the retired list, because
+// the EHCI may still be reading them during the current microframe.
+static Isochronous_t *iso_followup_first=NULL;
+static Isochronous_t *iso_followup_last=NULL;
+static Isochronous_t *iso_retired_first=NULL;
+static Isochronous_t *iso_retired_last=NULL;
+
+// Completed transfers awaiting their driver callback, used only when
+// deferCallbacks() is enabled.  Only the ISR writes callback_ring_head
+// and only processCallbacks() writes callback_ring_tail.
+#if defined(USBHOST_CALLBACK_RING_SIZE)
+#define CALLBACK_RING_SIZE (USBHOST_CALLBACK_RING_SIZE)
+#else
+#define CALLBACK_RING_SIZE  32
+#endif
+static Transfer_t *callback_ring[CALLBACK_RING_SIZE];
+static volatile uint16_t callback_ring_head=0;
+static volatile uint16_t callback_ring_tail=0;
+static volatile bool callback_ring_full=false;
+static bool callbacks_deferred=false;
+static uint16_t callbacks_per_task=8;
+
+// Set when a transfer without interrupt-on-complete is queued, so Task()
+// knows to look for its completion.
+static volatile bool quiet_pending=false;
+
+#if USBHOST_INTERRUPT_THRESHOLD > 64 || (USBHOST_INTERRUPT_THRESHOLD & (USBHOST_INTERRUPT_THRESHOLD - 1))
+#error "USBHOST_INTERRUPT_THRESHOLD must be 0, 1, 2, 4, 8, 16, 32 or 64"
+#endif
 
-// List of all queued transfers in the asychronous schedule (control & bulk).
-// When the EHCI completes these transfers, this list is how we locate them
-// in memory.
-static Transfer_t *async_followup_first=NULL;
-static Transfer_t *async_followup_last=NULL;
-
-// List of all queued transfers in the asychronous schedule (interrupt endpoints)
-// When the EHCI completes these transfers, this list is how we locate them
-// in memory.
-static Transfer_t *periodic_followup_first=NULL;
-static Transfer_t *periodic_followup_last=NULL;
-
-// List of all pending timers.  This double linked list is stored in
-// chronological order.  Each timer is stored with the number of
-// microseconds which need to elapsed from the prior timer on this
-// list, to allow efficient servicing from the timer interrupt.
-static USBDriverTimer *active_timers=NULL;
+// Pending timers are kept in a hierarchical timer wheel, so start() and
+// stop() take constant time.  Level 0 slots are each one tick, and each
+// higher level's slots span all the slots of the level below.  Timers
+// in higher levels move ("cascade") to lower levels as their time nears.
+// Bitmaps of non-empty slots let the ISR find the next work quickly, so
+// the hardware timer only interrupts when something needs to be done.
+#ifndef USBHOST_TIMER_TICK_SHIFT
+#define USBHOST_TIMER_TICK_SHIFT 4 // 16 us resolution
+#endif
+#define TIMER_TICK_SHIFT  USBHOST_TIMER_TICK_SHIFT
+#define TIMER_TICK_US     (1 << TIMER_TICK_SHIFT)
+#define TIMER_SLOT_BITS   5
+#define TIMER_SLOTS       (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS      4
+#define TIMER_MAX_TICKS   ((1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+#define TIMER_EXPIRED     (TIMER_LEVELS * TIMER_SLOTS) // waiting for ISR
+#define TIMER_IDLE        0xFF
+#define TIMER_MIN_US      5 // TODO: is 5us a safe minimum?
+static USBDriverTimer *timer_heads[TIMER_LEVELS * TIMER_SLOTS + 1];
+static uint32_t timer_bitmap[TIMER_LEVELS];
+static uint32_t timer_tick=0;    // wheel's current time, in ticks
+static uint32_t timer_micros=0;  // micros() at the start of timer_tick
+static uint32_t timer_count=0;
+static uint32_t timer_isr_count=0;
+static uint32_t timer_isr_cycles=0;
+static uint32_t timer_isr_max_cycles=0;
+
+// Binary trace of transfer events, see USBHOST_TRACE.  Events are only
+// written by the ISR or with the USB interrupt disabled.  The head and
+// tail count all events ever written and read, so a full ring simply
+// overwrites its oldest events.
+// Before an event more than a second after the previous time sync, a
+// 'T' record holds millis(), so gaps longer than the cycle counter's
+// wrap (about 7 seconds at 600 MHz) can be measured.
+#ifdef USBHOST_TRACE
+static_assert(USBHOST_TRACE_SIZE > 0 && (USBHOST_TRACE_SIZE & (USBHOST_TRACE_SIZE - 1)) == 0,
+	"USBHOST_TRACE_SIZE must be a power of 2");
+static trace_event_t trace_ring[USBHOST_TRACE_SIZE];
+static uint32_t trace_head=0;
+static uint32_t trace_tail=0;
+static uint32_t trace_dropped=0;
+static uint32_t trace_sync_millis=0;
+static bool trace_synced=false;
+static void trace_event(uint32_t event, const Pipe_t *pipe, const void *id, bool in,
+	uint32_t length, uint32_t status, const setup_t *setup, const void *data);
+static void trace_transfer(uint32_t event, const Transfer_t *transfer,
+	uint32_t length, uint32_t status);
+#endif
 
 
 static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
               uint32_t pid, uint32_t data01, bool irq);
-static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last);
-static void remove_from_async_followup_list(Transfer_t *transfer);
-static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last);
-static void remove_from_periodic_followup_list(Transfer_t *transfer);
+static void dma_prepare(const void *buf, uint32_t len, uint32_t in);
+static void dma_complete(const Pipe_t *pipe, const Transfer_t *transfer);
+static void dma_discard(void *buf, uint32_t len);
+static void add_to_followup_list(Pipe_t *pipe, Transfer_t *first, Transfer_t *last);
+static void remove_from_followup_list(Pipe_t *pipe, Transfer_t *transfer);
+static void remove_from_active_list(Pipe_t *pipe);
+static void update_pipe_stats(Pipe_t *pipe, const Transfer_t *transfer);
+static bool has_quiet_transfers(const Pipe_t *list);
+static void add_to_iso_followup_list(Isochronous_t *iso);
+static void remove_from_iso_followup_list(Isochronous_t *iso);
+static void retire_isochronous(Isochronous_t *iso);
+static volatile uint32_t * periodic_qh_link(uint32_t slot);
 
 #define print   USBHost::print_
 #define println USBHost::println_
@@ -224,6 +308,9 @@ void USBHost::begin()
 	println(" reset waited ", reset_count);
 
 	init_Device_Pipe_Transfer_memory();
+	// cycle counter, for timerStats()
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
 	for (int i=0; i < PERIODIC_LIST_SIZE; i++) {
 		periodictable[i] = 1;
 	}
@@ -239,7 +326,7 @@ void USBHost::begin()
 	USBHS_PERIODICLISTBASE = (uint32_t)periodictable;
 	USBHS_FRINDEX = 0;
 	USBHS_ASYNCLISTADDR = 0;
-	USBHS_USBCMD = USBHS_USBCMD_ITC(1) | USBHS_USBCMD_RS |
+	USBHS_USBCMD = USBHS_USBCMD_ITC(USBHOST_INTERRUPT_THRESHOLD) | USBHS_USBCMD_RS |
 		USBHS_USBCMD_ASP(3) | USBHS_USBCMD_ASPE | USBHS_USBCMD_PSE |
 		#if PERIODIC_LIST_SIZE == 8
 		USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(3);
@@ -330,36 +417,30 @@ void USBHost::isr()
 
 	if (stat & USBHS_USBSTS_UAI) { // completed qTD(s) from the async schedule
 		//println("Async Followup");
-		//print(async_followup_first, async_followup_last);
-		Transfer_t *p = async_followup_first;
-		while (p) {
-			if (followup_Transfer(p)) {
-				// transfer completed
-				Transfer_t *next = p->next_followup;
-				remove_from_async_followup_list(p);
-				free_Transfer(p);
-				p = next;
-			} else {
-				// transfer still pending
-				p = p->next_followup;
-			}
-		}
-		//print(async_followup_first, async_followup_last);
+		followup_Pipes(async_active_first);
 	}
 	if (stat & USBHS_USBSTS_UPI) { // completed qTD(s) from the periodic schedule
 		//println("Periodic Followup");
-		Transfer_t *p = periodic_followup_first;
-		while (p) {
-			if (followup_Transfer(p)) {
-				// transfer completed
-				Transfer_t *next = p->next_followup;
-				remove_from_periodic_followup_list(p);
-				free_Transfer(p);
-				p = next;
-			} else {
-				// transfer still pending
-				p = p->next_followup;
+		followup_Pipes(periodic_active_first);
+	}
+	if (stat & (USBHS_USBSTS_UPI | USBHS_USBSTS_FRI)) {
+		// Isochronous frames are retired when they complete, or by
+		// the frame list rollover once their frame has passed, so
+		// a missed iTD or siTD is never run again when the list wraps.
+		// Rollover stays enabled until the retired ones are freed.
+		release_retired_Isochronous();
+		Isochronous_t *iso = iso_followup_first;
+		while (iso) {
+			Isochronous_t *next = iso->next_followup;
+			if (followup_Isochronous(iso)) {
+				// frame completed or missed
+				remove_from_iso_followup_list(iso);
+				retire_isochronous(iso);
 			}
+			iso = next;
+		}
+		if (iso_followup_first == NULL && iso_retired_first == NULL) {
+			USBHS_USBINTR &= ~USBHS_USBINTR_FRE;
 		}
 	}
 	if (stat & USBHS_USBSTS_UEI) {
@@ -380,7 +461,9 @@ void USBHost::isr()
 				  || port_state == PORT_STATE_DEBOUNCE) {
 					// 100 ms debounce (USB 2.0: TATTDB, page 150 & 188)
 					port_state = PORT_STATE_DEBOUNCE;
-					USBHS_GPTIMER0LD = 100000; // microseconds
+					root_connect_micros = micros();
+					USBHS_GPTIMER0LD = fastAttach() ?
+						USBHOST_FAST_DEBOUNCE : 100000; // microseconds
 					USBHS_GPTIMER0CTL =
 						USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
 					stat &= ~USBHS_USBSTS_TI0;
@@ -400,7 +483,8 @@ void USBHost::isr()
 			println("  port enabled");
 			port_state = PORT_STATE_RECOVERY;
 			// 10 ms reset recover (USB 2.0: TRSTRCY, page 151 & 188)
-			USBHS_GPTIMER0LD = 10000; // microseconds
+			USBHS_GPTIMER0LD = fastAttach() ?
+				USBHOST_FAST_RECOVERY : 10000; // microseconds
 			USBHS_GPTIMER0CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
 			if (USBHS_PORTSC1 & USBHS_PORTSC_HSP) {
 				// turn on high-speed disconnect detector
@@ -421,6 +505,7 @@ void USBHost::isr()
 			// are ever supported, we would need to remain in
 			// debounce if any other port was resetting or
 			// enumerating a device.
+			root_reset_micros = micros();
 			USBHS_PORTSC1 |= USBHS_PORTSC_PR; // begin reset sequence
 			println("  begin reset");
 		} else if (port_state == PORT_STATE_RECOVERY) {
@@ -428,51 +513,28 @@ void USBHost::isr()
 			println("  end recovery");
 			//  HCSPARAMS  TTCTRL  page 1671
 			uint32_t speed = (USBHS_PORTSC1 >> 26) & 3;
-			rootdev = new_Device(speed, 0, 0);
+			rootdev = new_Device(speed, 0, 0, root_connect_micros, root_reset_micros);
 		}
 	}
 	if (stat & USBHS_USBSTS_TI1) { // timer 1 - used for USBDriverTimer
 		//println("timer1");
-		USBDriverTimer *list = NULL, *last = NULL;
-		USBDriverTimer *timer = active_timers;
-		while (timer) {
-			USBDriverTimer *next = timer->next;
-			active_timers = next;
-			// create a list of all timer_event() callbacks to do
-			if (list == NULL) {
-				list = timer;
-				last = timer;
-			} else {
-				last->next = timer;
-				last = timer;
-			}
-			timer->next = NULL;
-			if (!next) break;
-			next->prev = NULL;
-			if (next->usec >= 5) { // TODO: is 5us a safe minimum?
-				USBHS_GPTIMER1LD = next->usec - 1;
-				USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-				break;
-			} else {
-				// next timer will be too soon for the hardware timer, so
-				// allow the next loop iteration to add it to the list
-				if (next->usec > 0 && next->next != NULL) {
-					// when we "lose" microseconds by calling early,
-					// adjust future timers so errors don't accumulate
-					next->next->usec += next->usec;
-				}
-				timer = next;
-			}
-		}
+		uint32_t cycles = ARM_DWT_CYCCNT;
+		do {
+			USBDriverTimer::advance();
+		} while (!USBDriverTimer::program(false));
 		// do all callbacks after hardware timer is started, so time spent by
-		// the callback functions can't delay starting the hardware timer
-		while (list) {
-			USBDriverTimer *next = list->next;
-			list->prev = NULL;
-			list->next = NULL;
-			list->driver->timer_event(list);
-			list = next;
+		// the callback functions can't delay starting the hardware timer.
+		// A callback may stop or restart any timer, even one still on the
+		// expired list, so always take the first remaining.
+		USBDriverTimer *timer;
+		while ((timer = timer_heads[TIMER_EXPIRED]) != NULL) {
+			timer->unlink();
+			timer->driver->timer_event(timer);
 		}
+		cycles = ARM_DWT_CYCCNT - cycles;
+		timer_isr_count++;
+		timer_isr_cycles += cycles;
+		if (cycles > timer_isr_max_cycles) timer_isr_max_cycles = cycles;
 	}
 }
 
@@ -487,91 +549,158 @@ void USBDriverTimer::start(uint32_t microseconds)
 	USBHost::println_((uint32_t)this, HEX);
 #endif
 	if (!driver) return;
-	if (microseconds < 100) return; // minimum timer duration
+	__disable_irq();
+	if (slot != TIMER_IDLE) unlink();
 	started_micros = micros();
-	if (active_timers == NULL) {
-		// schedule is empty, just add this timer
-		usec = microseconds;
-		next = NULL;
-		prev = NULL;
-		active_timers = this;
-		USBHS_GPTIMER1LD = microseconds - 1;
-		USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-		return;
-	}
-	uint32_t remain = USBHS_GPTIMER1CTL & 0xFFFFFF;
-	//USBHDBGSerial.print("remain = ");
-	//USBHDBGSerial.println(remain);
-	if (microseconds < remain) {
-		// this timer event is before any on the schedule
-		__disable_irq();
-		USBHS_GPTIMER1CTL = 0;
-		USBHS_USBSTS = USBHS_USBSTS_TI1; // TODO: UPI & UAI safety?!
-		usec = microseconds;
-		next = active_timers;
-		prev = NULL;
-		active_timers->usec = remain - microseconds;
-		active_timers->prev = this;
-		active_timers = this;
-		USBHS_GPTIMER1LD = microseconds - 1;
-		USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-		__enable_irq();
-		return;
-	}
-	// add this timer to the schedule, somewhere after the first timer
-	microseconds -= remain;
-	USBDriverTimer *list = active_timers;
-	while (list->next) {
-		list = list->next;
-		if (microseconds < list->usec) {
-			// add timer into middle of list
-			list->usec -= microseconds;
-			usec = microseconds;
-			next = list;
-			prev = list->prev;
-			list->prev = this;
-			prev->next = this;
-			return;
-		}
-		microseconds -= list->usec;
-	}
-	// add timer to the end of the schedule
-	usec = microseconds;
-	next = NULL;
-	prev = list;
-	list->next = this;
+	if (timer_count == 0) {
+		// wheel is empty, so its time can simply jump to now
+		timer_micros = started_micros;
+	} else {
+		advance();
+	}
+	// round up to whole ticks, counting from the start of the current tick
+	uint32_t us = started_micros - timer_micros + microseconds;
+	uint32_t ticks = (us + TIMER_TICK_US - 1) >> TIMER_TICK_SHIFT;
+	if (ticks < 1) ticks = 1;
+	if (ticks > TIMER_MAX_TICKS) ticks = TIMER_MAX_TICKS;
+	expires = timer_tick + ticks;
+	link();
+	while (!program(timer_heads[TIMER_EXPIRED] != NULL)) advance();
+	__enable_irq();
 }
 
 void USBDriverTimer::stop()
 {
 	__disable_irq();
-	if (active_timers) {
-		if (active_timers == this) {
-			USBHS_GPTIMER1CTL = 0;
-			if (next) {
-				uint32_t usec_til_next = USBHS_GPTIMER1CTL & 0xFFFFFF;
-				usec_til_next += next->usec;
-				next->usec = usec_til_next;
-				USBHS_GPTIMER1LD = usec_til_next;
-				USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-				next->prev = NULL;
-				active_timers = next;
-			} else {
-				active_timers = NULL;
-			}
-		} else {
-			for (USBDriverTimer *t = active_timers->next; t; t = t->next) {
-				if (t == this) {
-					t->prev->next = t->next;
-					if (t->next) {
-						t->next->usec += t->usec;
-						t->next->prev = t->prev;
-					}
-					break;
-				}
+	// the hardware timer is left running, an early interrupt is harmless
+	if (slot != TIMER_IDLE) unlink();
+	__enable_irq();
+}
+
+// Add timer to the wheel, at the level where its remaining ticks fit
+// the slots' range.  Each level has 2^TIMER_SLOT_BITS slots, each 2^
+// TIMER_SLOT_BITS times as long as the level below.
+void USBDriverTimer::link()
+{
+	uint32_t delta = expires - timer_tick;
+	uint32_t n;
+	if (delta == 0) {
+		n = TIMER_EXPIRED;
+	} else {
+		uint32_t level = 0;
+		while (delta >> ((level + 1) * TIMER_SLOT_BITS)) level++;
+		uint32_t index = (expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+		timer_bitmap[level] |= (1 << index);
+		n = level * TIMER_SLOTS + index;
+	}
+	slot = n;
+	prev = NULL;
+	next = timer_heads[n];
+	if (next) next->prev = this;
+	timer_heads[n] = this;
+	timer_count++;
+}
+
+void USBDriverTimer::unlink()
+{
+	if (prev) {
+		prev->next = next;
+	} else {
+		timer_heads[slot] = next;
+		if (next == NULL && slot != TIMER_EXPIRED) {
+			timer_bitmap[slot / TIMER_SLOTS] &= ~(1 << (slot & (TIMER_SLOTS - 1)));
+		}
+	}
+	if (next) next->prev = prev;
+	next = NULL;
+	prev = NULL;
+	slot = TIMER_IDLE;
+	timer_count--;
+}
+
+// Number of ticks until the wheel has work to do: the next level 0 slot
+// with timers, or the next time a higher level slot with timers cascades
+// to lower levels.  Zero if the wheel has no pending timers.
+static uint32_t timer_next_ticks(void)
+{
+	uint32_t min = 0;
+	for (uint32_t level=0; level < TIMER_LEVELS; level++) {
+		uint32_t bitmap = timer_bitmap[level];
+		if (!bitmap) continue;
+		uint32_t shift = level * TIMER_SLOT_BITS;
+		uint32_t group = timer_tick >> shift;
+		uint32_t r = (group + 1) & (TIMER_SLOTS - 1);
+		if (r) bitmap = (bitmap >> r) | (bitmap << (TIMER_SLOTS - r));
+		group += 1 + __builtin_ctz(bitmap);
+		uint32_t ticks = (group << shift) - timer_tick;
+		if (min == 0 || ticks < min) min = ticks;
+	}
+	return min;
+}
+
+// Bring the wheel up to the current time.  Timers which are due move to
+// the expired list, for the ISR to call their drivers.
+void USBDriverTimer::advance()
+{
+	uint32_t elapsed = (micros() - timer_micros) >> TIMER_TICK_SHIFT;
+	timer_micros += elapsed << TIMER_TICK_SHIFT;
+	uint32_t now = timer_tick + elapsed;
+	while (1) {
+		uint32_t ticks = timer_next_ticks();
+		if (ticks == 0 || ticks > now - timer_tick) break;
+		timer_tick += ticks;
+		// cascade higher levels first, so timers can fall through
+		// several levels within the same tick
+		for (uint32_t level=TIMER_LEVELS-1; level > 0; level--) {
+			uint32_t shift = level * TIMER_SLOT_BITS;
+			if (timer_tick & ((1 << shift) - 1)) continue;
+			uint32_t n = level * TIMER_SLOTS + ((timer_tick >> shift) & (TIMER_SLOTS - 1));
+			USBDriverTimer *t;
+			while ((t = timer_heads[n]) != NULL) {
+				t->unlink();
+				t->link();
 			}
 		}
+		uint32_t n = timer_tick & (TIMER_SLOTS - 1);
+		USBDriverTimer *t;
+		while ((t = timer_heads[n]) != NULL) {
+			t->unlink();
+			t->link(); // expires == timer_tick, so expired list
+		}
 	}
+	timer_tick = now;
+}
+
+// Start the hardware timer for the wheel's next work, or as soon as
+// possible if expired timers are waiting for the ISR.  Returns false if
+// that time has already passed, so advance() needs to run again.
+bool USBDriverTimer::program(bool expired_waiting)
+{
+	uint32_t ticks = timer_next_ticks();
+	int32_t us = 0;
+	if (expired_waiting) {
+		us = 0;
+	} else if (ticks > 0) {
+		us = (int32_t)((ticks << TIMER_TICK_SHIFT) - (micros() - timer_micros));
+		if (us <= 0) return false;
+	} else {
+		USBHS_GPTIMER1CTL = 0;
+		return true;
+	}
+	if (us < TIMER_MIN_US) us = TIMER_MIN_US;
+	if (us > 0xFFFFFF) us = 0xFFFFFF;
+	USBHS_GPTIMER1CTL = 0;
+	USBHS_GPTIMER1LD = us - 1;
+	USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
+	return true;
+}
+
+void USBHost::timerStats(uint32_t &count, uint32_t &cycles, uint32_t &max_cycles)
+{
+	__disable_irq();
+	count = timer_isr_count;
+	cycles = timer_isr_cycles;
+	max_cycles = timer_isr_max_cycles;
 	__enable_irq();
 }
 
@@ -598,40 +727,51 @@ static uint32_t QH_capabilities2(uint32_t high_bw_mult, uint32_t hub_port_number
 // Create a new pipe.  It's QH is added to the async or periodic schedule,
 // and a halt qTD is added to the QH, so we can grow the qTD list later.
 //   dev:       device owning this pipe/endpoint
-//   type:      0=control, 2=bulk, 3=interrupt
-//   endpoint:  0 for control, 1-15 for bulk or interrupt
+//   type:      0=control, 1=isochronous, 2=bulk, 3=interrupt
+//   endpoint:  0 for control, 1-15 for bulk, interrupt or isochronous
 //   direction: 0=OUT, 1=IN  (unused for control)
-//   maxlen:    maximum packet size
-//   interval:  polling interval for interrupt, power of 2, unused if control or bulk
+//   maxlen:    maximum packet size (wMaxPacketSize for isochronous)
+//   interval:  polling interval (bInterval) for interrupt or isochronous,
+//              unused if control or bulk
+//
+// Isochronous pipes have no QH or halt qTD.  Each frame's packets are
+// scheduled separately with queue_Isochronous_Transfer().
 //
 Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 	uint32_t direction, uint32_t maxlen, uint32_t interval)
 {
 	Pipe_t *pipe;
-	Transfer_t *halt;
-	uint32_t c=0, dtc=0;
+	Transfer_t *halt = NULL;
+	uint32_t c=0, dtc=0, mult=1;
 
 	println("new_Pipe");
 	pipe = allocate_Pipe();
 	if (!pipe) return NULL;
-	halt = allocate_Transfer();
-	if (!halt) {
-		free_Pipe(pipe);
-		return NULL;
-	}
 	memset(pipe, 0, sizeof(Pipe_t));
-	memset(halt, 0, sizeof(Transfer_t));
-	halt->qtd.next = 1;
-	halt->qtd.token = 0x40;
+	if (type != 1) {
+		halt = allocate_Transfer();
+		if (!halt) {
+			free_Pipe(pipe);
+			return NULL;
+		}
+		memset(halt, 0, sizeof(Transfer_t));
+		halt->qtd.next = 1;
+		halt->qtd.token = 0x40;
+		pipe->qh.next = (uint32_t)halt;
+		pipe->halt = halt;
+	} else if (dev->speed == 2) {
+		// high bandwidth isochronous, USB 2.0 table 9-13, page 271
+		mult = ((maxlen >> 11) & 3) + 1;
+		maxlen &= 0x7FF;
+	}
 	pipe->device = dev;
-	pipe->qh.next = (uint32_t)halt;
 	pipe->qh.alt_next = 1;
 	pipe->direction = direction;
 	pipe->type = type;
-	if (type == 3) {
-		// interrupt transfers require bandwidth & microframe scheduling
-		if (!allocate_interrupt_pipe_bandwidth(pipe, maxlen, interval)) {
-			free_Transfer(halt);
+	if (type == 1 || type == 3) {
+		// interrupt & isochronous transfers require bandwidth & microframe scheduling
+		if (!allocate_interrupt_pipe_bandwidth(pipe, maxlen * mult, interval)) {
+			if (halt) free_Transfer(halt);
 			free_Pipe(pipe);
 			return NULL;
 		}
@@ -658,7 +798,7 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 	}
 	pipe->qh.capabilities[0] = QH_capabilities1(15, c, maxlen, 0,
 		dtc, dev->speed, endpoint, 0, dev->address);
-	pipe->qh.capabilities[1] = QH_capabilities2(1, dev->hub_port,
+	pipe->qh.capabilities[1] = QH_capabilities2(mult, dev->hub_port,
 		dev->hub_address, pipe->complete_mask, pipe->start_mask);
 
 	if (type == 0 || type == 2) {
@@ -708,6 +848,63 @@ static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
 	t->qtd.buffer[4] = addr + 0x4000;
 }
 
+// Cache maintenance for a buffer the EHCI is about to access.  OUT data
+// is written back to memory.  IN buffers are also invalidated, so no
+// dirty line is later evicted over the received data.  Teensy 4's
+// DTCM (below OCRAM at 0x20200000) is not cached, nor is Teensy 3.6.
+//
+static void dma_prepare(const void *buf, uint32_t len, uint32_t in)
+{
+#if defined(__IMXRT1052__) || defined(__IMXRT1062__)
+	if (len == 0 || (uint32_t)buf < 0x20200000u) return;
+	if (in) {
+		if ((((uint32_t)buf | len) & 31) != 0) {
+			println("IN buffer shares a cache line: ", (uint32_t)buf, HEX);
+		}
+		arm_dcache_flush_delete((void *)buf, len);
+	} else {
+		arm_dcache_flush((void *)buf, len);
+	}
+#endif
+}
+
+// Cache maintenance for a completed qTD, before its IN data is used.
+// The Cortex-M7 may speculatively read the buffer while the EHCI is
+// writing it, so any lines loaded during the transfer are discarded.
+// Control transfers use the range in their status qTD.  Bulk and
+// interrupt qTDs each have their own range (see build_Data_Transfer).
+//
+static void dma_complete(const Pipe_t *pipe, const Transfer_t *transfer)
+{
+#if defined(__IMXRT1052__) || defined(__IMXRT1062__)
+	void *buf;
+	uint32_t len;
+	if (pipe->type == 0) {
+		if (!transfer->pipe || !(transfer->setup.bmRequestType & 0x80)) return;
+		buf = transfer->buffer;
+		len = transfer->length;
+	} else {
+		if (!pipe->direction) return;
+		if (transfer->pipe) {
+			buf = (void *)transfer->setup.word1;
+			len = transfer->setup.word2;
+		} else {
+			buf = transfer->buffer;
+			len = transfer->length;
+		}
+	}
+	dma_discard(buf, len);
+#endif
+}
+
+static void dma_discard(void *buf, uint32_t len)
+{
+#if defined(__IMXRT1052__) || defined(__IMXRT1062__)
+	if (len == 0 || (uint32_t)buf < 0x20200000u) return;
+	arm_dcache_delete(buf, len);
+#endif
+}
+
 
 
 // Create a Control Transfer and queue it
@@ -722,12 +919,14 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 	transfer = allocate_Transfer();
 	if (!transfer) {
 		println("  error allocating setup transfer");
+		if (driver) driver->alloc_failures++;
 		return false;
 	}
 	status = allocate_Transfer();
 	if (!status) {
 		println("  error allocating status transfer");
 		free_Transfer(transfer);
+		if (driver) driver->alloc_failures++;
 		return false;
 	}
 	if (setup->wLength > 0) {
@@ -736,13 +935,14 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 			println("  error allocating data transfer");
 			free_Transfer(transfer);
 			free_Transfer(status);
+			if (driver) driver->alloc_failures++;
 			return false;
 		}
 		uint32_t pid = (setup->bmRequestType & 0x80) ? 1 : 0;
 		init_qTD(data, buf, setup->wLength, pid, 1, false);
 		transfer->qtd.next = (uint32_t)data;
 		data->qtd.next = (uint32_t)status;
-		data->pipe = dev->control_pipe;
+		data->pipe = NULL;
 		status_direction = pid ^ 1;
 	} else {
 		transfer->qtd.next = (uint32_t)status;
@@ -751,6 +951,9 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 	//println("setup address ", (uint32_t)setup, HEX);
 	init_qTD(transfer, setup, 8, 2, 0, false);
 	init_qTD(status, NULL, 0, status_direction, 1, true);
+	transfer->pipe = NULL;
+	dma_prepare(setup, 8, 0);
+	dma_prepare(buf, setup->wLength, (setup->bmRequestType & 0x80) ? 1 : 0);
 	status->pipe = dev->control_pipe;
 	status->buffer = buf;
 	status->length = setup->wLength;
@@ -764,29 +967,126 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 
 // Create a Bulk or Interrupt Transfer and queue it
 //
-bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver)
+bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len,
+	USBDriver *driver, uint32_t flags)
 {
-	Transfer_t *transfer, *data, *next;
-	uint8_t *p = (uint8_t *)buffer;
-	uint32_t count;
-	bool last = false;
-	
+	segment_t segment = {buffer, len};
+	return queue_Data_Transfer_SG(pipe, &segment, 1, driver, flags);
+}
+
+// A qTD's 5 buffer pointers can access 20K, minus the buffer's starting
+// offset within its first 4K page.  So buffers aligned to 4K use
+// fewer qTDs.  When data remains for another qTD,
+// the length must be a multiple of the packet size, so a short packet
+// isn't sent in the middle of the transfer.
+static uint32_t qTD_length(uint32_t addr, uint32_t len, uint32_t maxpacket)
+{
+	uint32_t capacity = 0x5000 - (addr & 0xFFF);
+	if (len <= capacity) return len;
+	if (maxpacket > 0) capacity -= capacity % maxpacket;
+	return capacity;
+}
+
+// Create a bulk or interrupt data transfer from several separate buffers,
+// without copying.  Each segment uses its own qTD(s), and every qTD ends
+// with a short packet if its length isn't a multiple of the max packet
+// size, so all segments except the last must be multiples of the pipe's
+// max packet size.  The driver's callback is called once, when all
+// segments have completed, with the transfer's buffer set to the first
+// segment's buffer and its length set to the total of all segments.
+//
+bool USBHost::queue_Data_Transfer_SG(Pipe_t *pipe, const segment_t *segments,
+	uint32_t num, USBDriver *driver, uint32_t flags)
+{
+	Transfer_t *transfer, *last;
+
 	// We always want to do this while the interrupt is disabled. 
 	// But only re-enable if it was enabled coming in. 
 	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
 	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	transfer = build_Data_Transfer(pipe, segments, num, driver, flags, &last);
+	bool return_value = false;
+	if (transfer) return_value = queue_Transfer(pipe, transfer);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return return_value;
+}
 
+// Create several data transfers at once, each with its own buffer and
+// driver callback.  All are added to the pipe together, so the EHCI
+// sees all the buffers back-to-back.  Either all are queued, or none
+// are queued if not enough Transfer_t are available.
+//
+bool USBHost::queue_Data_Transfers(Pipe_t *pipe, const batch_t *batch, uint32_t num)
+{
+	Transfer_t *first=NULL, *last=NULL;
+
+	if (num == 0) return false;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	for (uint32_t i=0; i < num; i++) {
+		segment_t segment = {batch[i].buffer, batch[i].length};
+		Transfer_t *chain_last;
+		Transfer_t *chain = build_Data_Transfer(pipe, &segment, 1,
+			batch[i].driver, batch[i].flags, &chain_last);
+		if (!chain) {
+			// free all qTDs already created
+			while (first) {
+				Transfer_t *next = (Transfer_t *)first->qtd.next;
+				free_Transfer(first);
+				first = (first == last) ? NULL : next;
+			}
+			if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+			return false;
+		}
+		if (last) {
+			last->qtd.next = (uint32_t)chain;
+		} else {
+			first = chain;
+		}
+		last = chain_last;
+	}
+	bool return_value = queue_Transfer(pipe, first);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return return_value;
+}
+
+// Allocate and initialize the qTDs for a bulk or interrupt data transfer.
+// Returns the first qTD and sets last to the final qTD, which has the
+// info for followup.  Returns NULL if the segments aren't usable or not
+// enough Transfer_t are available.  Must be called with interrupt disabled.
+//
+Transfer_t * USBHost::build_Data_Transfer(Pipe_t *pipe, const segment_t *segments,
+	uint32_t num, USBDriver *driver, uint32_t flags, Transfer_t **last_qtd)
+{
+	Transfer_t *transfer, *data, *next;
+	uint32_t count=0, total=0;
+
+	if (num == 0) return NULL;
+	const uint32_t maxpacket = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
+	for (uint32_t i=0; i < num; i++) {
+		uint32_t len = segments[i].length;
+		if (i < num - 1 && maxpacket > 0 && (len % maxpacket) != 0) return NULL;
+		total += len;
+		uint32_t addr = (uint32_t)segments[i].buffer;
+		while (len > 0) {
+			uint32_t n = qTD_length(addr, len, maxpacket);
+			addr += n;
+			len -= n;
+			count++;
+		}
+	}
 	// TODO: option for zero length packet?  Maybe in Pipe_t fields?
+	if (count == 0) count = 1; // zero length transfer
 
 	//println("new_Data_Transfer");
 	// allocate qTDs
 	transfer = allocate_Transfer();
 	if (!transfer) {
-		if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
-		return false;
+		if (driver) driver->alloc_failures++;
+		return NULL;
 	}
 	data = transfer;
-	for (count=((len-1) >> 14); count; count--) {
+	for (count--; count; count--) {
 		next = allocate_Transfer();
 		if (!next) {
 			// free already-allocated qTDs
@@ -796,50 +1096,277 @@ bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBD
 				if (transfer == data) break;
 				transfer = next;
 			}
-			if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
-			return false;
+			if (driver) driver->alloc_failures++;
+			return NULL;
 		}
 		data->qtd.next = (uint32_t)next;
+		data->pipe = NULL;
 		data = next;
 	}
 	// last qTD needs info for followup
 	data->qtd.next = 1;
 	data->pipe = pipe;
-	data->buffer = buffer;
-	data->length = len;
+	data->buffer = segments[0].buffer;
+	data->length = total;
 	data->setup.word1 = 0;
 	data->setup.word2 = 0;
 	data->driver = driver;
-	// initialize all qTDs
+	*last_qtd = data;
+	// initialize all qTDs, up to 20K each
 	data = transfer;
-	while (1) {
-		uint32_t count = len;
-		if (count > 16384) {
-			count = 16384;
-		} else {
-			last = true;
+	bool irq = !(flags & TRANSFER_NO_INTERRUPT);
+	if (total == 0) {
+		init_qTD(data, segments[0].buffer, 0, pipe->direction, 0, irq);
+	}
+	for (uint32_t i=0; i < num; i++) {
+		uint8_t *p = (uint8_t *)segments[i].buffer;
+		uint32_t len = segments[i].length;
+		while (len > 0) {
+			uint32_t count = qTD_length((uint32_t)p, len, maxpacket);
+			bool last = (data->qtd.next == 1);
+			init_qTD(data, p, count, pipe->direction, 0, last && irq);
+			// each qTD's own range, for dma_complete
+			if (last) {
+				data->setup.word1 = (uint32_t)p;
+				data->setup.word2 = count;
+				break;
+			}
+			data->buffer = p;
+			data->length = count;
+			p += count;
+			len -= count;
+			data = (Transfer_t *)(data->qtd.next);
 		}
-		init_qTD(data, p, count, pipe->direction, 0, last);
-		if (last) break;
-		p += count;
-		len -= count;
-		data = (Transfer_t *)(data->qtd.next);
+		dma_prepare(segments[i].buffer, segments[i].length, pipe->direction);
+	}
+	return transfer;
+}
+
+
+// Schedule 1 frame of isochronous packets.  For high speed, one packet
+// is sent or received in each microframe selected by the pipe's
+// start_mask, so up to 8 packets per frame.  For full speed, only
+// 1 packet per frame is possible.  The packets are stored consecutively
+// in the buffer.  When the frame completes, the lengths array is updated
+// with the actual number of bytes for each packet (IN only) and the
+// pipe's iso_callback_function is called.  Frames are scheduled in
+// consecutive order, up to PERIODIC_LIST_SIZE frames into the future.
+//
+bool USBHost::queue_Isochronous_Transfer(Pipe_t *pipe, void *buffer,
+	uint16_t *lengths, uint32_t num, USBDriver *driver)
+{
+	if (pipe->type != 1 || num == 0) return false;
+	const bool highspeed = (pipe->device->speed == 2);
+	const uint32_t mask = pipe->start_mask;
+	if (num > (highspeed ? (uint32_t)__builtin_popcount(mask) : 1)) return false;
+
+	// Since this may be called from other code or from the
+	// ISR, we must disable USB interrupts.
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	release_retired_Isochronous();
+	Isochronous_t *iso = allocate_Isochronous();
+	if (!iso) {
+		if (driver) driver->alloc_failures++;
+		if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+		return false;
 	}
-	bool return_value = queue_Transfer(pipe, transfer);
+	memset(iso, 0, sizeof(Isochronous_t));
+
+	// choose which frame to use
+	const uint32_t interval = pipe->periodic_interval;
+	uint32_t now = (USBHS_FRINDEX >> 3) & 0x7FF;
+	uint32_t frame = pipe->iso_next_frame;
+	uint32_t ahead = (frame - now) & 0x7FF;
+	if (ahead < 2 || ahead >= 0x400 ||
+	  (ahead >= PERIODIC_LIST_SIZE && pipe->iso_pending == 0)) {
+		// not yet started, or fell behind, so begin 2 frames from now
+		frame = now + 2;
+		frame = (frame + ((pipe->periodic_offset - frame) & (interval - 1))) & 0x7FF;
+	} else if (ahead >= PERIODIC_LIST_SIZE) {
+		// can't schedule further ahead than the periodic table's size
+		free_Isochronous(iso);
+		if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+		return false;
+	}
+
+	uint32_t addr = (uint32_t)buffer;
+	uint32_t caps = pipe->qh.capabilities[0];
+	if (highspeed) {
+		// iTD: EHCI 3.3, page 33
+		uint32_t offset = 0, n = 0, last = 0;
+		for (uint32_t uframe=0; uframe < 8 && n < num; uframe++) {
+			if (!(mask & (1 << uframe))) continue;
+			uint32_t p = addr + offset;
+			uint32_t len = lengths[n];
+			uint32_t pg = (p >> 12) - (addr >> 12);
+			if (((p + len) >> 12) - (addr >> 12) > 6) {
+				// iTD can only access 7 pages (28K)
+				free_Isochronous(iso);
+				if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+				return false;
+			}
+			iso->itd.transaction[uframe] = 0x80000000 | (len << 16) |
+				(pg << 12) | (p & 0xFFF);
+			offset += len;
+			last = uframe;
+			n++;
+		}
+		iso->itd.transaction[last] |= 0x8000; // IOC
+		for (uint32_t i=0; i < 7; i++) {
+			iso->itd.buffer[i] = (addr & 0xFFFFF000) + (i << 12);
+		}
+		iso->itd.buffer[0] |= (((caps >> 8) & 15) << 8) | (caps & 0x7F);
+		iso->itd.buffer[1] |= (pipe->direction << 11) | ((caps >> 16) & 0x7FF);
+		iso->itd.buffer[2] |= pipe->qh.capabilities[1] >> 30;
+	} else {
+		// siTD: EHCI 3.4, page 38
+		Device_t *dev = pipe->device;
+		uint32_t len = lengths[0];
+		uint32_t tp_tcount = 0;
+		if (pipe->direction == 0) {
+			// OUT is sent as 1 or more SSPLIT, up to 188 bytes each
+			uint32_t count = (len + 187) / 188;
+			if (count == 0) count = 1;
+			tp_tcount = ((count > 1) ? 0x08 : 0x00) | count; // TP=begin or all
+		}
+		iso->sitd.capabilities = (pipe->direction << 31) | (dev->hub_port << 24) |
+			(dev->hub_address << 16) | (((caps >> 8) & 15) << 8) | (caps & 0x7F);
+		iso->sitd.schedule = (pipe->complete_mask << 8) | pipe->start_mask;
+		iso->sitd.state = 0x80000000 | (len << 16) | 0x80; // IOC, Active
+		iso->sitd.buffer[0] = addr;
+		iso->sitd.buffer[1] = ((addr & 0xFFFFF000) + 0x1000) | tp_tcount;
+		iso->sitd.back = 1;
+	}
+	iso->pipe = pipe;
+	iso->buffer = buffer;
+	iso->lengths = lengths;
+	iso->driver = driver;
+	iso->num_packets = num;
+	iso->frame = frame;
+	uint32_t total = 0;
+	for (uint32_t i=0; i < num; i++) total += lengths[i];
+	dma_prepare(buffer, total, pipe->direction);
+
+	// add to the front of this frame's list, ahead of any interrupt QH
+	uint32_t slot = frame & (PERIODIC_LIST_SIZE-1);
+	iso->itd.next = periodictable[slot];
+	add_to_iso_followup_list(iso);
+	periodictable[slot] = (uint32_t)iso | (highspeed ? 0 : 4); // 0=iTD, 4=siTD
+	USBHS_USBINTR |= USBHS_USBINTR_FRE; // sweep passed frames at each rollover
+	pipe->iso_next_frame = (frame + interval) & 0x7FF;
+	pipe->iso_pending++;
+	if (pipe->iso_pending > pipe->stat_max_queued) {
+		pipe->stat_max_queued = (pipe->iso_pending < 255) ? pipe->iso_pending : 255;
+	}
+#ifdef USBHOST_TRACE
+	trace_event('S', pipe, iso, pipe->direction, total, 0, NULL,
+		pipe->direction ? NULL : buffer);
+#endif
 	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
-	return return_value;
+	return true;
 }
 
+// Check whether a scheduled isochronous frame has completed.  If done,
+// update the packet lengths and status, and call the pipe's callback.
+// Frames which were never processed by the EHCI (because they were
+// scheduled too late or their frame passed) are also considered done,
+// with status 0x80, and their active bits are cleared so the EHCI will
+// not run them if it sees this frame list slot again after a wrap.
+//
+// status bits: 0x80 = missed, 0x40 = data buffer error, 0x20 = babble,
+//              0x10 = transaction error
+//
+bool USBHost::followup_Isochronous(Isochronous_t *iso)
+{
+	Pipe_t *pipe = iso->pipe;
+	uint32_t now = (USBHS_FRINDEX >> 3) & 0x7FF;
+	uint32_t elapsed = (now - iso->frame) & 0x7FF;
+	bool passed = (elapsed > 0 && elapsed < 0x400);
+	uint32_t status = 0;
+	uint32_t iso_total = 0; // buffer size, before lengths are updated
+	for (uint32_t i=0; i < iso->num_packets; i++) {
+		iso_total += iso->lengths[i];
+	}
+
+	if (pipe->device->speed == 2) {
+		if (!passed) {
+			for (uint32_t uframe=0; uframe < 8; uframe++) {
+				if (iso->itd.transaction[uframe] & 0x80000000) return false;
+			}
+		}
+		uint32_t n = 0;
+		for (uint32_t uframe=0; uframe < 8 && n < iso->num_packets; uframe++) {
+			if (!(pipe->start_mask & (1 << uframe))) continue;
+			uint32_t t = iso->itd.transaction[uframe];
+			if (t & 0x80000000) {
+				iso->itd.transaction[uframe] = t & ~0x80000000;
+				status |= 0x80;
+				if (pipe->direction) iso->lengths[n] = 0;
+			} else {
+				status |= (t >> 24) & 0x70;
+				if (pipe->direction) iso->lengths[n] = (t >> 16) & 0xFFF;
+			}
+			n++;
+		}
+	} else {
+		uint32_t state = iso->sitd.state;
+		if ((state & 0x80) && !passed) return false;
+		if (state & 0x84) {
+			iso->sitd.state = state & ~0x80;
+			status |= 0x80;
+			if (pipe->direction) iso->lengths[0] = 0;
+		} else {
+			if (state & 0x20) status |= 0x40;
+			if (state & 0x10) status |= 0x20;
+			if (state & 0x48) status |= 0x10;
+			if (pipe->direction) iso->lengths[0] -= (state >> 16) & 0x3FF;
+		}
+	}
+	if (pipe->direction) dma_discard(iso->buffer, iso_total);
+	iso->status = status;
+	if (pipe->iso_pending > 0) pipe->iso_pending--;
+	pipe->stat_transfers++;
+	if (status) pipe->stat_errors++;
+	uint32_t bytes = 0;
+	for (uint32_t i=0; i < iso->num_packets; i++) {
+		bytes += iso->lengths[i];
+	}
+	pipe->stat_bytes += bytes;
+#ifdef USBHOST_TRACE
+	trace_event('C', pipe, iso, pipe->direction, bytes, status, NULL,
+		pipe->direction ? iso->buffer : NULL);
+#endif
+	if (pipe->iso_callback_function) {
+		(*pipe->iso_callback_function)(iso);
+	}
+	return true;
+}
+
+// Free the retired isochronous frames, once the EHCI has moved on
+// to another microframe and can no longer be reading them.
+void USBHost::release_retired_Isochronous(void)
+{
+	uint32_t uframe = USBHS_FRINDEX & 0x3FFF;
+	Isochronous_t *iso = iso_retired_first;
+	while (iso && iso->retire_uframe != uframe) {
+		Isochronous_t *next = iso->next_followup;
+		free_Isochronous(iso);
+		iso = next;
+	}
+	iso_retired_first = iso;
+	if (iso == NULL) iso_retired_last = NULL;
+}
 
 bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 {
-	// find halt qTD
-	Transfer_t *halt = (Transfer_t *)(pipe->qh.next);
-	while (!(halt->qtd.token & 0x40)) halt = (Transfer_t *)(halt->qtd.next);
+	// the halt qTD is always at the end of the pipe's list
+	Transfer_t *halt = pipe->halt;
 	// transfer's token
 	uint32_t token = transfer->qtd.token;
 	// transfer becomes new halt qTD
 	transfer->qtd.token = 0x40;
+	pipe->halt = transfer;
 	// copy transfer non-token fields to halt
 	halt->qtd.next = transfer->qtd.next;
 	halt->qtd.alt_next = transfer->qtd.alt_next;
@@ -848,7 +1375,7 @@ bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 	halt->qtd.buffer[2] = transfer->qtd.buffer[2];
 	halt->qtd.buffer[3] = transfer->qtd.buffer[3];
 	halt->qtd.buffer[4] = transfer->qtd.buffer[4];
-	halt->pipe = pipe;
+	halt->pipe = transfer->pipe;
 	halt->buffer = transfer->buffer;
 	halt->length = transfer->length;
 	halt->setup = transfer->setup;
@@ -872,219 +1399,573 @@ bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 	p->prev_followup = prev;
 	p->next_followup = NULL;
 	//print(halt, p);
-	// add them to a followup list
-	if (pipe->type == 0 || pipe->type == 2) {
-		// control or bulk
-		add_to_async_followup_list(halt, p);
-	} else {
-		// interrupt
-		add_to_periodic_followup_list(halt, p);
+	// count the new transfers (each ends with pipe set) for statistics
+	uint32_t queued = pipe->stat_queued;
+	for (Transfer_t *t = halt; t; t = t->next_followup) {
+		if (t->pipe) {
+			if (!(((t == halt) ? token : t->qtd.token) & 0x8000)) quiet_pending = true;
+			queued++;
+#ifdef USBHOST_TRACE
+			trace_transfer('S', t, t->length, 0);
+#endif
+		}
 	}
+	pipe->stat_queued = (queued < 255) ? queued : 255;
+	if (pipe->stat_queued > pipe->stat_max_queued) pipe->stat_max_queued = pipe->stat_queued;
+	// add them to the pipe's followup list
+	add_to_followup_list(pipe, halt, p);
 	// old halt becomes new transfer, this commits all new qTDs to QH
 	halt->qtd.token = token;
 	return true;
 }
 
-// Perform transfer completion tasks if the tranfers completed sucessfully
-//  return true if the transfer is complete, no further action needed
-//  rerurn false if the tranfer is still active, or if it has any error
-bool USBHost::followup_Transfer(Transfer_t *transfer)
+// Perform transfer completion tasks for all of a pipe's transfers which
+// completed sucessfully.  The EHCI processes each pipe's qTDs in order,
+// so we can stop at the first transfer which is still active or has
+// any error (errors are handled by followup_Error).
+void USBHost::followup_Pipe(Pipe_t *pipe)
 {
-	//print("  Followup ", (uint32_t)transfer, HEX);
-	//println("    token=", transfer->qtd.token, HEX);
-
-	uint32_t token = transfer->qtd.token;
-	if ((token & 0xFC) == 0) {
+	Transfer_t *transfer;
+	while ((transfer = pipe->followup_first) != NULL) {
+		//print("  Followup ", (uint32_t)transfer, HEX);
+		//println("    token=", transfer->qtd.token, HEX);
+		uint32_t token = transfer->qtd.token;
+		if (token & 0xFC) break;
 		// transfer is no longer active and does not have any error flags
-		if ((token & 0x8000) && (transfer->pipe->callback_function != NULL)) {
+		dma_complete(pipe, transfer);
+		if (transfer->pipe && (pipe->callback_function != NULL)) {
+			if (callbacks_deferred) {
+				// processCallbacks will do the callback and free it.
+				// If the ring is full, stop so callbacks remain in order.
+				uint32_t head = callback_ring_head + 1;
+				if (head >= CALLBACK_RING_SIZE) head = 0;
+				if (head == callback_ring_tail) {
+					callback_ring_full = true;
+					break;
+				}
+				update_pipe_stats(pipe, transfer);
+				remove_from_followup_list(pipe, transfer);
+				callback_ring[head] = transfer;
+				callback_ring_head = head;
+				continue;
+			}
 			// do the callback
-			(*(transfer->pipe->callback_function))(transfer);
+			(*(pipe->callback_function))(transfer);
 		}
 		//println("    completed");
-		return true;
+		update_pipe_stats(pipe, transfer);
+		remove_from_followup_list(pipe, transfer);
+		free_Transfer(transfer);
 	}
-	return false;
 }
 
+// Perform completion tasks for all pipes on an active list, and
+// remove the pipes which no longer have any transfers queued.
+void USBHost::followup_Pipes(Pipe_t *list)
+{
+	Pipe_t *pipe = list;
+	while (pipe) {
+		followup_Pipe(pipe);
+		Pipe_t *next = pipe->next_active;
+		if (pipe->followup_first == NULL) remove_from_active_list(pipe);
+		pipe = next;
+	}
+}
+
+void USBHost::deferCallbacks(bool enable, uint32_t max_per_task)
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	callbacks_deferred = enable;
+	callbacks_per_task = (max_per_task > 0) ? max_per_task : 1;
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+// Call the driver callbacks for transfers which completed while callbacks
+// are deferred.  Up to max are called, or the deferCallbacks() max_per_task
+// if max is zero.  Returns the number of callbacks.
+uint32_t USBHost::processCallbacks(uint32_t max)
+{
+	if (max == 0) max = callbacks_per_task;
+	uint32_t count = 0;
+	while (count < max) {
+		uint32_t tail = callback_ring_tail;
+		if (tail == callback_ring_head) break;
+		if (++tail >= CALLBACK_RING_SIZE) tail = 0;
+		Transfer_t *transfer = callback_ring[tail];
+		// Drivers expect callbacks never to be interrupted by the USB
+		// interrupt (their timer events, or a disconnect deleting the
+		// pipe), so it stays masked while the callback runs.  Other
+		// interrupts still run.
+		bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+		NVIC_DISABLE_IRQ(IRQ_USBHS);
+		// pipe is NULL if it was deleted after the transfer completed
+		Pipe_t *pipe = transfer->pipe;
+		if (pipe && pipe->callback_function) (*(pipe->callback_function))(transfer);
+		callback_ring_tail = tail;
+		free_Transfer(transfer);
+		if (callback_ring_full) {
+			// resume completions which didn't fit into the ring
+			callback_ring_full = false;
+			followup_Pipes(async_active_first);
+			followup_Pipes(periodic_active_first);
+		}
+		if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+		count++;
+	}
+	return count;
+}
+
+void USBHost::setInterruptThreshold(uint32_t microframes)
+{
+	// round up to a value the EHCI supports
+	uint32_t itc = 0;
+	if (microframes > 0) {
+		itc = 1;
+		while (itc < microframes && itc < 64) itc <<= 1;
+	}
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	USBHS_USBCMD = (USBHS_USBCMD & ~USBHS_USBCMD_ITC(0xFF)) | USBHS_USBCMD_ITC(itc);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+// Transfers queued without interrupt-on-complete may finish while no
+// interrupt happens, so Task() calls this to complete them.  Polling
+// continues as long as any of them remain queued.
+void USBHost::flushCompletions()
+{
+	if (!quiet_pending) return;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	quiet_pending = false;
+	followup_Pipes(async_active_first);
+	followup_Pipes(periodic_active_first);
+	if (has_quiet_transfers(async_active_first) || has_quiet_transfers(periodic_active_first)) {
+		quiet_pending = true;
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+// Handle errors on both schedules.  EHCI halts a QH when a qTD fails,
+// so look for halted qTDs on all pipes with transfers queued.
 void USBHost::followup_Error(void)
 {
 	println("ERROR Followup");
-#if 0
-	println("Async followup list:");
-	Transfer_t *t = async_followup_first;
-	while (t) {
-		print_(t);
-		Pipe_t *p = t->pipe;
-		print("   pipe current:", p->qh.current, HEX);
-		println();
-		Transfer_t *next = t->next_followup;
-		if (next == NULL && t != async_followup_last) {
-			print("Yikes, last transfer is not async_followup_last=");
-			println((uint32_t)async_followup_last, HEX);
+	followup_Errors(async_active_first);
+	followup_Errors(periodic_active_first);
+	println("end of error followup");
+}
+
+void USBHost::followup_Errors(Pipe_t *list)
+{
+	Pipe_t *pipe = list;
+	while (pipe) {
+		// Skip past all normally completed transfers.  Because each
+		// pipe's qTDs are processed in order, only the first one which
+		// isn't completed could have an error.
+		Transfer_t *transfer = pipe->followup_first;
+		while (transfer) {
+			uint32_t token = transfer->qtd.token;
+			if (token & 0x80) {
+				transfer = NULL; // still active, no error
+			} else if ((token & 0x7C) == 0) {
+				transfer = transfer->next_followup;
+				continue;
+			}
+			break;
 		}
-		t = next;
-	}
-	println();
-#endif
-	Transfer_t *transfer = async_followup_first;
-	while (transfer) {
-		uint32_t token = transfer->qtd.token;
-		// Skip past all active and normally completed transfers
-		if ((token & 0x80) || (token & 0x7C) == 0) {
-			transfer = transfer->next_followup;
+		if (transfer == NULL) {
+			pipe = pipe->next_active;
 			continue;
 		}
-		// Remove the error transfer from followup list
-		Transfer_t *next = transfer->next_followup;
-		remove_from_async_followup_list(transfer);
 		println("Remove ERROR transfer: ", (uint32_t)transfer, HEX);
 		print_(transfer);
-		transfer->prev_followup = NULL;
-		transfer->next_followup = NULL;
-		// Traverse the rest of the followup list to also remove
-		// all transfers using same pipe.  But do not touch any
-		// transfers using other pipes.  Create a simple forward
-		// only list of the removed transfers, so we can later
-		// free them.
-		Transfer_t *last_from_pipe = transfer;
-		Pipe_t *pipe = transfer->pipe;
-		Transfer_t *t = next;
-		while (t) {
-			if (t->pipe == pipe) {
-				Transfer_t *n = t->next_followup;
-				remove_from_async_followup_list(t);
-				println("Remove extra transfer: ", (uint32_t)t, HEX);
-				print_(t);
-				t->prev_followup = NULL;
-				t->next_followup = NULL;
-				last_from_pipe->next_followup = t;
-				last_from_pipe = t;
-				if (t == next) next = n;
-				t = n;
-			} else {
-				t = t->next_followup;
-			}
+		uint32_t token = transfer->qtd.token;
+		Transfer_t *last = transfer;
+		while (!last->pipe && last->next_followup) {
+			last = last->next_followup;
+		}
+		// A STALL (halted without other error bits) on a bulk or
+		// interrupt endpoint means the device has set its endpoint
+		// halt feature.  The QH stays halted while a Clear Feature
+		// request is sent, and later transfers remain queued, to
+		// resume after it.  After other errors, the endpoint's state
+		// isn't known, so all of the pipe's transfers are flushed.
+		bool stall = ((token & 0x7C) == 0x40) && (pipe->type >= 2);
+		if (stall && !clear_Halt(pipe)) stall = false;
+		Transfer_t *flush = (stall) ? NULL : last->next_followup;
+		// Remove the error qTD and the rest of its transfer (up to
+		// its last qTD) from this pipe's followup list, and all that
+		// follow it unless resuming.
+		Transfer_t *prev = transfer->prev_followup;
+		Transfer_t *next = (stall) ? last->next_followup : NULL;
+		if (prev) {
+			prev->next_followup = next;
+		} else {
+			pipe->followup_first = next;
+		}
+		if (next) {
+			next->prev_followup = prev;
+		} else {
+			pipe->followup_last = prev;
+		}
+		last->next_followup = NULL;
+		pipe->stat_errors++;
+#ifdef USBHOST_TRACE
+		trace_transfer('E', last, 0, token & 0x7C);
+#endif
+		pipe->stat_remaining = 0;
+		if (pipe->stat_queued > 0) pipe->stat_queued--;
+		while (flush) {
+			Transfer_t *n = flush->next_followup;
+			println("free flushed transfer ", (uint32_t)flush, HEX);
+			if (flush->pipe && pipe->stat_queued > 0) pipe->stat_queued--;
+			free_Transfer(flush);
+			flush = n;
 		}
-		// Assume last followup transfer links to pipe's dummy halt.
-		// Restore the pipe to a usable state
-		Transfer_t *dummy_halt = (Transfer_t *)last_from_pipe->qtd.next;
-		println("pipe's next will be dummy halt at ", (uint32_t)dummy_halt, HEX);
-		print_(dummy_halt);
-		pipe->qh.next = last_from_pipe->qtd.next;
+		// Restore the pipe to continue with the next transfer, or only
+		// its dummy halt if no more transfers are queued
+		Transfer_t *resume = (next) ? next : pipe->halt;
+		println("pipe's next will be ", (uint32_t)resume, HEX);
+		pipe->qh.next = (uint32_t)resume;
+		pipe->qh.alt_next = 1;
 		pipe->qh.current = 0;
-		pipe->qh.token = 0;
-		// free all but the first transfer with the error status
-		t = transfer->next_followup;
-		while (t) {
+		if (stall) {
+			pipe->qh.token = 0x40; // halted, DATA0 after Clear Feature
+		} else if (pipe->type == 0) {
+			pipe->qh.token = 0;
+		} else {
+			pipe->qh.token &= 0x80000000;
+		}
+		// free all but the last qTD, which has the driver's info
+		for (Transfer_t *t = transfer; t != last; ) {
 			Transfer_t *n = t->next_followup;
-			println("free ", (uint32_t)t, HEX);
+			println("free extra transfer ", (uint32_t)t, HEX);
+			dma_complete(pipe, t);
 			free_Transfer(t);
 			t = n;
 		}
+		dma_complete(pipe, last);
 		// If this pipe has an error callback, inform the driver of
 		// the transfer with error status
 		if (pipe->error_callback_function != NULL) {
 			println("calling driver's error callback function");
-			transfer->next_followup = NULL;
-			(*(pipe->error_callback_function))(transfer);
+			last->qtd.token = token;
+			(*(pipe->error_callback_function))(last);
 		}
-		println("free ", (uint32_t)transfer, HEX);
-		free_Transfer(transfer);
+		println("free ", (uint32_t)last, HEX);
+		free_Transfer(last);
+
+		Pipe_t *next_pipe = pipe->next_active;
+		if (pipe->followup_first == NULL) remove_from_active_list(pipe);
+		pipe = next_pipe;
+	}
+}
+
+// Clear Feature requests sent after a STALL are queued as this driver's
+// control transfers, so their completion comes to its control() like
+// any driver's request.
+class ClearHaltDriver : public USBDriver {
+protected:
+	virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) { return false; }
+	virtual void control(const Transfer_t *transfer) { clear_Halt_complete(transfer); }
+	virtual void disconnect() { }
+};
+static ClearHaltDriver clear_halt_driver;
+
+// Send CLEAR_FEATURE(ENDPOINT_HALT) for a stalled bulk or interrupt pipe.
+// The pipe's QH stays halted until clear_Halt_complete() restarts it.
+bool USBHost::clear_Halt(Pipe_t *pipe)
+{
+	Device_t *dev = pipe->device;
+	uint32_t endpoint = (pipe->qh.capabilities[0] >> 8) & 15;
+	if (pipe->direction) endpoint |= 0x80;
+	println("Clear Feature, endpoint halt ", endpoint, HEX);
+	mk_setup(pipe->clear_halt_setup, 0x02, 1 /*1=CLEAR_FEATURE*/, 0 /*ENDPOINT_HALT*/, endpoint, 0);
+	return queue_Control_Transfer(dev, &pipe->clear_halt_setup, NULL, &clear_halt_driver);
+}
 
-		// TODO: for halt condition on non-control pipes (presumably
-		// because the device answered with a STALL token), do we
-		// need to queue a Clear Feature control transfer to get
-		// device out of stall mode?? - WANTED: any commerical USB
-		// products which stall their non-control endpoints...
+bool USBHost::is_clear_Halt(const Transfer_t *transfer)
+{
+	return transfer->driver == &clear_halt_driver;
+}
 
-		transfer = next;
+// Called when the Clear Feature control transfer completes (or fails).
+// The device has reset its data toggle, so resume the pipe with DATA0.
+// Pipes are only deleted when the device disconnects, which also deletes
+// the control pipe, so a pending Clear Feature then has no pipe.
+void USBHost::clear_Halt_complete(const Transfer_t *transfer)
+{
+	if (!transfer->pipe) return;
+	Device_t *dev = transfer->pipe->device;
+	uint32_t endpoint = transfer->setup.wIndex;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	for (Pipe_t *pipe = dev->data_pipes; pipe; pipe = pipe->next) {
+		if (pipe->type < 2) continue;
+		if (((pipe->qh.capabilities[0] >> 8) & 15) != (endpoint & 15)) continue;
+		if (pipe->direction != ((endpoint & 0x80) ? 1 : 0)) continue;
+		println("Clear Feature complete, resume pipe ", (uint32_t)pipe, HEX);
+		if (pipe->qh.token == 0x40) pipe->qh.token = 0;
+		break;
 	}
-	// TODO: handle errors from periodic schedule!  USB devices which
-	// give this sort of error wanted for testing...
-	println("end of error followu");
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
 }
 
-static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last)
+// Add qTDs to the end of a pipe's followup list, and add the
+// pipe to the async or periodic active list if not already there.
+static void add_to_followup_list(Pipe_t *pipe, Transfer_t *first, Transfer_t *last)
 {
 	last->next_followup = NULL; // always add to end of list
-	if (async_followup_last == NULL) {
+	if (pipe->followup_last == NULL) {
 		first->prev_followup = NULL;
-		async_followup_first = first;
+		pipe->followup_first = first;
+	} else {
+		first->prev_followup = pipe->followup_last;
+		pipe->followup_last->next_followup = first;
+	}
+	pipe->followup_last = last;
+
+	Pipe_t **list_first, **list_last;
+	if (pipe->type == 0 || pipe->type == 2) {
+		list_first = &async_active_first;
+		list_last = &async_active_last;
+	} else {
+		list_first = &periodic_active_first;
+		list_last = &periodic_active_last;
+	}
+	if (pipe->prev_active != NULL || *list_first == pipe) return; // already listed
+	pipe->next_active = NULL;
+	if (*list_last == NULL) {
+		pipe->prev_active = NULL;
+		*list_first = pipe;
 	} else {
-		first->prev_followup = async_followup_last;
-		async_followup_last->next_followup = first;
+		pipe->prev_active = *list_last;
+		(*list_last)->next_active = pipe;
 	}
-	async_followup_last = last;
+	*list_last = pipe;
 }
 
-static void remove_from_async_followup_list(Transfer_t *transfer)
+static void remove_from_followup_list(Pipe_t *pipe, Transfer_t *transfer)
 {
 	Transfer_t *next = transfer->next_followup;
 	Transfer_t *prev = transfer->prev_followup;
 	if (prev) {
 		prev->next_followup = next;
 	} else {
-		async_followup_first = next;
+		pipe->followup_first = next;
 	}
 	if (next) {
 		next->prev_followup = prev;
 	} else {
-		async_followup_last = prev;
+		pipe->followup_last = prev;
 	}
 }
 
-static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last)
+// Check whether any pipe on an active list still has a transfer queued
+// without interrupt-on-complete.
+static bool has_quiet_transfers(const Pipe_t *list)
 {
-	last->next_followup = NULL; // always add to end of list
-	if (periodic_followup_last == NULL) {
-		first->prev_followup = NULL;
-		periodic_followup_first = first;
+	for (const Pipe_t *pipe = list; pipe; pipe = pipe->next_active) {
+		for (const Transfer_t *t = pipe->followup_first; t; t = t->next_followup) {
+			if (t->pipe && !(t->qtd.token & 0x8000)) return true;
+		}
+	}
+	return false;
+}
+
+// Count a successfully completed qTD in its pipe's statistics.  Only the
+// last qTD of each transfer has the whole transfer's length.
+static void update_pipe_stats(Pipe_t *pipe, const Transfer_t *transfer)
+{
+	uint32_t token = transfer->qtd.token;
+	pipe->stat_remaining += (token >> 16) & 0x7FFF;
+	if (transfer->pipe) {
+		uint32_t remaining = pipe->stat_remaining;
+		uint32_t len = (remaining < transfer->length) ? transfer->length - remaining : 0;
+		pipe->stat_bytes += len;
+		pipe->stat_remaining = 0;
+		pipe->stat_transfers++;
+		if (pipe->stat_queued > 0) pipe->stat_queued--;
+#ifdef USBHOST_TRACE
+		trace_transfer('C', transfer, len, 0);
+#endif
+	}
+}
+
+#ifdef USBHOST_TRACE
+static void trace_event(uint32_t event, const Pipe_t *pipe, const void *id, bool in,
+	uint32_t length, uint32_t status, const setup_t *setup, const void *data)
+{
+	uint32_t ms = millis();
+	if (!trace_synced || ms - trace_sync_millis >= 1000) {
+		trace_event_t *t = &trace_ring[trace_head++ & (USBHOST_TRACE_SIZE - 1)];
+		memset(t, 0, sizeof(trace_event_t));
+		t->cycles = ARM_DWT_CYCCNT;
+		t->id = ms;
+		t->event = 'T';
+		trace_sync_millis = ms;
+		trace_synced = true;
+	}
+	trace_event_t *e = &trace_ring[trace_head++ & (USBHOST_TRACE_SIZE - 1)];
+	e->cycles = ARM_DWT_CYCCNT;
+	e->id = (uint32_t)id;
+	e->event = event;
+	e->address = pipe->qh.capabilities[0] & 0x7F;
+	e->endpoint = ((pipe->qh.capabilities[0] >> 8) & 15) | (in ? 0x80 : 0);
+	e->type = pipe->type;
+	e->length = length;
+	e->status = status;
+	uint8_t *p = e->data;
+	if (setup) {
+		memcpy(p, setup, 8);
+		p += 8;
+	}
+	if (data) {
+		uint32_t room = e->data + sizeof(e->data) - p;
+		memcpy(p, data, (length < room) ? length : room);
+	}
+}
+
+// Trace a transfer, using the info in its last qTD.  OUT data is
+// recorded when submitted, IN data when completed.
+static void trace_transfer(uint32_t event, const Transfer_t *transfer,
+	uint32_t length, uint32_t status)
+{
+	const Pipe_t *pipe = transfer->pipe;
+	bool in = (pipe->type == 0) ? (transfer->setup.bmRequestType & 0x80) : pipe->direction;
+	bool data = (event == 'S') ? !in : (event == 'C' && in);
+	trace_event(event, pipe, transfer, in, length, status,
+		(event == 'S' && pipe->type == 0) ? &transfer->setup : NULL,
+		data ? transfer->buffer : NULL);
+}
+#endif
+
+uint32_t USBHost::readTrace(trace_event_t *list, uint32_t max)
+{
+	uint32_t count = 0;
+#ifdef USBHOST_TRACE
+	while (count < max) {
+		bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+		NVIC_DISABLE_IRQ(IRQ_USBHS);
+		uint32_t head = trace_head;
+		if (head - trace_tail > USBHOST_TRACE_SIZE) {
+			trace_dropped += head - trace_tail - USBHOST_TRACE_SIZE;
+			trace_tail = head - USBHOST_TRACE_SIZE;
+		}
+		bool empty = (trace_tail == head);
+		if (!empty) {
+			list[count++] = trace_ring[trace_tail++ & (USBHOST_TRACE_SIZE - 1)];
+		}
+		if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+		if (empty) break;
+	}
+#endif
+	return count;
+}
+
+uint32_t USBHost::traceDropped()
+{
+#ifdef USBHOST_TRACE
+	return trace_dropped;
+#else
+	return 0;
+#endif
+}
+
+// Remove a pipe from the async or periodic active list.  The pipe's
+// next_active is left unchanged, so a list traversal in progress may
+// continue past it.
+static void remove_from_active_list(Pipe_t *pipe)
+{
+	Pipe_t **list_first, **list_last;
+	if (pipe->type == 0 || pipe->type == 2) {
+		list_first = &async_active_first;
+		list_last = &async_active_last;
+	} else {
+		list_first = &periodic_active_first;
+		list_last = &periodic_active_last;
+	}
+	if (pipe->prev_active == NULL && *list_first != pipe) return; // not listed
+	Pipe_t *next = pipe->next_active;
+	Pipe_t *prev = pipe->prev_active;
+	if (prev) {
+		prev->next_active = next;
+	} else {
+		*list_first = next;
+	}
+	if (next) {
+		next->prev_active = prev;
 	} else {
-		first->prev_followup = periodic_followup_last;
-		periodic_followup_last->next_followup = first;
+		*list_last = prev;
 	}
-	periodic_followup_last = last;
+	pipe->prev_active = NULL;
 }
 
-static void remove_from_periodic_followup_list(Transfer_t *transfer)
+static void add_to_iso_followup_list(Isochronous_t *iso)
 {
-	Transfer_t *next = transfer->next_followup;
-	Transfer_t *prev = transfer->prev_followup;
+	iso->next_followup = NULL; // always add to end of list
+	if (iso_followup_last == NULL) {
+		iso->prev_followup = NULL;
+		iso_followup_first = iso;
+	} else {
+		iso->prev_followup = iso_followup_last;
+		iso_followup_last->next_followup = iso;
+	}
+	iso_followup_last = iso;
+}
+
+static void remove_from_iso_followup_list(Isochronous_t *iso)
+{
+	Isochronous_t *next = iso->next_followup;
+	Isochronous_t *prev = iso->prev_followup;
 	if (prev) {
 		prev->next_followup = next;
 	} else {
-		periodic_followup_first = next;
+		iso_followup_first = next;
 	}
 	if (next) {
 		next->prev_followup = prev;
 	} else {
-		periodic_followup_last = prev;
+		iso_followup_last = prev;
 	}
 }
 
-
-static uint32_t max4(uint32_t n1, uint32_t n2, uint32_t n3, uint32_t n4)
+// Remove an isochronous frame from the periodic schedule.  The EHCI
+// might still be reading it during this microframe, so it's placed
+// on the retired list, to be freed later by release_retired_Isochronous.
+static void retire_isochronous(Isochronous_t *iso)
 {
-	if (n1 > n2) {
-		// can't be n2
-		if (n1 > n3) {
-			// can't be n3
-			if (n1 > n4) return n1;
-		} else {
-			// can't be n1
-			if (n3 > n4) return n3;
+	volatile uint32_t *link = &periodictable[iso->frame & (PERIODIC_LIST_SIZE-1)];
+	while (!(*link & 1) && (*link & 6) != 2) {
+		Isochronous_t *node = (Isochronous_t *)(*link & 0xFFFFFFE0);
+		if (node == iso) {
+			*link = iso->itd.next;
+			break;
 		}
+		link = &node->itd.next;
+	}
+	iso->retire_uframe = USBHS_FRINDEX & 0x3FFF;
+	iso->next_followup = NULL;
+	if (iso_retired_last) {
+		iso_retired_last->next_followup = iso;
 	} else {
-		// can't be n1
-		if (n2 > n3) {
-			// can't be n3
-			if (n2 > n4) return n2;
-		} else {
-			// can't be n2
-			if (n3 > n4) return n3;
-		}
+		iso_retired_first = iso;
+	}
+	iso_retired_last = iso;
+}
+
+// Each frame's periodic list begins with any isochronous iTD & siTD,
+// followed by the tree of interrupt QH.  Return the link pointer where
+// the QH portion begins.  (iTD & siTD both have their link at offset 0)
+static volatile uint32_t * periodic_qh_link(uint32_t slot)
+{
+	volatile uint32_t *link = &periodictable[slot];
+	while (!(*link & 1) && (*link & 6) != 2) {
+		link = &((Isochronous_t *)(*link & 0xFFFFFFE0))->itd.next;
 	}
-	return n4;
+	return link;
 }
 
 static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
@@ -1095,36 +1976,159 @@ static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
 	return maxnum;
 }
 
-// Allocate bandwidth for an interrupt pipe.  Given the packet size
-// and other parameters, find the best place to schedule this pipe.
-// Returns true if enough bandwidth is available, and the best
-// frame offset, smask and cmask.  Or returns false if no group
-// of microframes has enough bandwidth available.
+// Convert an exponent bInterval (2^(n-1)) to a count, clamped to 1 to maxnum
+static uint32_t exponent_interval(uint32_t n, uint32_t maxnum)
+{
+	if (n < 1) n = 1;
+	if (n > 16) n = 16;
+	uint32_t interval = 1 << (n - 1);
+	return (interval < maxnum) ? interval : maxnum;
+}
+
+// Where an interrupt or isochronous pipe fits into the periodic schedule,
+// found by plan_periodic_bandwidth.  Bandwidth is in units of 32 bytes
+// (533 ns).  A 125 us micro frame can fit 7500 bytes, or 234 of these
+// units, and periodic pipes may use up to 80% (234 * 0.8) of any uframe.
+#define PERIODIC_BANDWIDTH_LIMIT  187
+typedef struct {
+	uint32_t interval;  // uframes (high speed) or frames (full & low speed)
+	uint32_t offset;    // uframe (high speed) or frame (full & low speed)
+	uint32_t shift;     // full & low speed: uframe within frame
+	uint32_t stime;     // bandwidth used by each start (or SSPLIT)
+	uint32_t ctime;     // bandwidth used by each CSPLIT
+	uint32_t smask;
+	uint32_t cmask;
+	uint32_t periodic_interval;
+	uint32_t periodic_offset;
+	uint32_t worst;     // busiest uframe's bandwidth with this pipe added
+	uint32_t tt;        // full & low speed: TT index + 1, or 0 if none
+	uint32_t tt_usecs;  // full & low speed: time used on the TT's bus
+} bandwidth_plan_t;
+
+static uint32_t periodic_pipes=0;
+static uint32_t periodic_failures=0;
+static uint32_t periodic_tt_overflows=0;
+
+// Full and low speed periodic transfers are done by a transaction
+// translator (TT) in the nearest high speed hub, or in the EHCI for
+// devices on the root port.  Single-TT hubs have one TT for all ports,
+// Multi-TT hubs one per port.  Each TT's 12 Mbit/sec frame is budgeted
+// here, per microframe, so the TT can finish every transaction before
+// its complete-splits.  Transactions longer than 125 us use the whole
+// microframe(s) before the last.  USB 2.0 section 11.18.
+// Each budget uses 4 + 8 * PERIODIC_LIST_SIZE bytes (260 with the usual
+// 32 frame list).  A budget is only taken by a TT with full or low speed
+// periodic pipes: the root port's, each Single-TT hub's, and each port of
+// a Multi-TT hub where such a device is connected.  4 covers the root
+// port and 3 of these.  Pipes on any more TTs are scheduled without a
+// budget, counted in periodic_stats_t tt_overflows.
+#ifndef USBHOST_TT_COUNT
+#define USBHOST_TT_COUNT  4
+#endif
+typedef struct {
+	uint8_t  hub_address; // 0 = TT for the root port
+	uint8_t  port;        // Multi-TT hub port, or 0 for Single-TT
+	uint16_t pipes;       // periodic pipes using this TT, 0 = unused
+	uint8_t  usecs[PERIODIC_LIST_SIZE][8];
+} tt_budget_t;
+static tt_budget_t tt_budget[USBHOST_TT_COUNT];
+
+// full speed time available in each B-frame microframe (Y0 to Y7), as
+// Linux's ehci-sched.c uses.  780 us is less than the 90% periodic limit
+// of a full speed host (USB 2.0 section 5.7.4), because the TT's frame
+// lags the host's by up to a microframe, and its last transactions must
+// end before the end of frame interval, with complete-splits still able
+// to collect them in Y7 and the next Y0.  So no transaction starts in Y7.
+static const uint8_t tt_max_usecs[8] = {125, 125, 125, 125, 125, 125, 30, 0};
+
+// Find the TT a full or low speed device uses, or an unused one.
+// Returns index + 1, or 0 if all are in use by other TTs.
+static uint32_t find_tt(const Device_t *dev)
+{
+	uint32_t unused = 0;
+	for (uint32_t i=0; i < USBHOST_TT_COUNT; i++) {
+		const tt_budget_t *tt = &tt_budget[i];
+		if (tt->pipes == 0) {
+			if (!unused) unused = i + 1;
+		} else if (tt->hub_address == dev->tt_address && tt->port == dev->tt_port) {
+			return i + 1;
+		}
+	}
+	return unused;
+}
+
+// Full or low speed bus time for one transaction, in microseconds,
+// USB 2.0 section 5.11.3, plus 1 us for the host (TT) delay.
+static uint32_t tt_transaction_usecs(uint32_t speed, uint32_t type,
+	uint32_t direction, uint32_t maxlen)
+{
+	uint32_t bits = (3167 + maxlen * 56000 / 6) / 1000; // with bit stuffing
+	uint32_t ns;
+	if (speed == 1) {
+		ns = ((direction) ? 64060 : 64107) + 2 * 333 + bits * 67667 / 100;
+	} else if (type == 1) {
+		ns = ((direction) ? 7268 : 6265) + bits * 8354 / 100;
+	} else {
+		ns = 9107 + bits * 8354 / 100;
+	}
+	return (ns + 1000 + 999) / 1000;
+}
+
+// Check whether a transaction fits into a TT's frame, starting at the
+// B-frame microframe y.
+static bool tt_fits(const tt_budget_t *tt, uint32_t frame, uint32_t y, uint32_t usecs)
+{
+	while (usecs > 0) {
+		if (y > 7) return false;
+		uint32_t n = (usecs < 125) ? usecs : 125;
+		if (tt->usecs[frame][y] + n > tt_max_usecs[y]) return false;
+		usecs -= n;
+		y++;
+	}
+	return true;
+}
+
+static void tt_update(tt_budget_t *tt, uint32_t frame, uint32_t y, uint32_t usecs, bool add)
+{
+	while (usecs > 0 && y < 8) {
+		uint32_t n = (usecs < 125) ? usecs : 125;
+		if (add) tt->usecs[frame][y] += n;
+		else tt->usecs[frame][y] -= n;
+		usecs -= n;
+		y++;
+	}
+}
+
+// Find the best place to schedule an interrupt or isochronous pipe.
+// Given the packet size and other parameters, returns true and the best
+// frame offset, smask and cmask, if enough bandwidth is available.  Or
+// returns false if no group of microframes has enough bandwidth.
 //
-//   pipe:
-//     device->speed      [in]   0=full speed, 1=low speed, 2=high speed
-//     direction          [in]   0=OUT, 1=IN
-//     start_mask         [out]  uframes to start transfer
-//     complete_mask      [out]  uframes to complete transfer (FS & LS only)
-//     periodic_interval  [out]  fream repeat level: 1, 2, 4, 8... PERIODIC_LIST_SIZE
-//     periodic_offset    [out]  frame repeat offset: 0 to periodic_interval-1
-//   maxlen:              [in]   maximum packet length
-//   interval:            [in]   polling interval: LS+FS: frames, HS: 2^(n-1) uframes
+//   dev:         device, for its speed and TT
+//   type:        1=isochronous, 3=interrupt
+//   direction:   0=OUT, 1=IN
+//   maxlen:      maximum packet length (times mult for HS isochronous)
+//   interval:    polling interval: LS+FS: frames, HS: 2^(n-1) uframes
+//                (FS isochronous: 2^(n-1) frames)
 //
-bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, uint32_t interval)
+static bool plan_periodic_bandwidth(const Device_t *dev, uint32_t type, uint32_t direction,
+	uint32_t maxlen, uint32_t interval, bandwidth_plan_t *plan)
 {
-	println("allocate_interrupt_pipe_bandwidth");
+	const uint32_t speed = dev->speed;
 	if (interval == 0) interval = 1;
+	plan->tt = 0;
+	plan->tt_usecs = 0;
+	if (speed < 2) {
+		plan->tt = find_tt(dev);
+		plan->tt_usecs = tt_transaction_usecs(speed, type, direction, maxlen);
+		if (!plan->tt) println("  no TT budget available, scheduling without it");
+	}
 	maxlen = (maxlen * 76459) >> 16; // worst case bit stuffing
-	if (pipe->device->speed == 2) {
+	if (speed == 2) {
 		// high speed 480 Mbit/sec
 		println("  ep interval = ", interval);
-		if (interval > 15) interval = 15;
-		interval = 1 << (interval - 1);
-		if (interval > PERIODIC_LIST_SIZE*8) interval = PERIODIC_LIST_SIZE*8;
+		interval = exponent_interval(interval, PERIODIC_LIST_SIZE*8);
 		println("  interval = ", interval);
-		uint32_t pinterval = interval >> 3;
-		pipe->periodic_interval = (pinterval > 0) ? pinterval : 1;
 		uint32_t stime = (55 + 32 + maxlen) >> 5; // time units: 32 bytes or 533 ns
 		uint32_t best_offset = 0xFFFFFFFF;
 		uint32_t best_bandwidth = 0xFFFFFFFF;
@@ -1142,104 +2146,274 @@ bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, u
 			}
 		}
 		print(" best_bandwidth = ", best_bandwidth);
-		//print(best_bandwidth);
 		println(", at offset = ", best_offset);
-		//println(best_offset);
-		// a 125 us micro frame can fit 7500 bytes, or 234 of our 32-byte units
-		// fail if the best found needs more than 80% (234 * 0.8) in any uframe
-		if (best_bandwidth > 187) return false;
-		// save essential bandwidth specs, for cleanup in delete_Pipe
-		pipe->bandwidth_interval = interval;
-		pipe->bandwidth_offset = best_offset;
-		pipe->bandwidth_stime = stime;
-		for (uint32_t i=best_offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
-			uframe_bandwidth[i] += stime;
-		}
+		plan->worst = best_bandwidth;
+		if (best_bandwidth > PERIODIC_BANDWIDTH_LIMIT) return false;
+		plan->interval = interval;
+		plan->offset = best_offset;
+		plan->shift = 0;
+		plan->stime = stime;
+		plan->ctime = 0;
 		if (interval == 1) {
-			pipe->start_mask = 0xFF;
+			plan->smask = 0xFF;
 		} else if (interval == 2) {
-			pipe->start_mask = 0x55 << (best_offset & 1);
+			plan->smask = 0x55 << (best_offset & 1);
 		} else if (interval <= 4) {
-			pipe->start_mask = 0x11 << (best_offset & 3);
+			plan->smask = 0x11 << (best_offset & 3);
 		} else {
-			pipe->start_mask = 0x01 << (best_offset & 7);
+			plan->smask = 0x01 << (best_offset & 7);
 		}
-		pipe->periodic_offset = best_offset >> 3;
-		pipe->complete_mask = 0;
+		plan->cmask = 0;
+		uint32_t pinterval = interval >> 3;
+		plan->periodic_interval = (pinterval > 0) ? pinterval : 1;
+		plan->periodic_offset = best_offset >> 3;
 	} else {
 		// full speed 12 Mbit/sec or low speed 1.5 Mbit/sec
-		interval = round_to_power_of_two(interval, PERIODIC_LIST_SIZE);
-		pipe->periodic_interval = interval;
-		uint32_t stime, ctime;
-		if (pipe->direction == 0) {
+		if (type == 1) {
+			interval = exponent_interval(interval, PERIODIC_LIST_SIZE);
+		} else {
+			interval = round_to_power_of_two(interval, PERIODIC_LIST_SIZE);
+		}
+		uint32_t stime, ctime, smask, cmask;
+		if (type == 1) {
+			// isochronous split transactions move up to 188 bytes
+			// per uframe, EHCI 4.12.3.1, page 103
+			uint32_t count = (maxlen + 187) / 188;
+			uint32_t len = (maxlen < 188) ? maxlen : 188;
+			if (direction == 0) {
+				// OUT: data in SSPLITs, no CSPLIT
+				stime = (100 + 32 + len) >> 5;
+				ctime = 0;
+				smask = (1 << count) - 1;
+				cmask = 0;
+			} else {
+				// IN: 1 SSPLIT, data returned in CSPLITs
+				if (count > 5) count = 5;
+				stime = (40 + 32) >> 5;
+				ctime = (70 + 32 + len) >> 5;
+				smask = 0x01;
+				cmask = ((1 << (count + 1)) - 1) << 2;
+			}
+		} else if (direction == 0) {
 			// for OUT direction, SSPLIT will carry the data payload
 			// TODO: how much time to SSPLIT & CSPLIT actually take?
 			// they're not documented in 5.7 or 5.11.3.
 			stime = (100 + 32 + maxlen) >> 5;
 			ctime = (55 + 32) >> 5;
+			smask = 0x01;
+			cmask = 0x1C;
 		} else {
 			// for IN direction, data payload in CSPLIT
 			stime = (40 + 32) >> 5;
 			ctime = (70 + 32 + maxlen) >> 5;
+			smask = 0x01;
+			cmask = 0x1C;
 		}
-		// TODO: should we take Single-TT hubs into account, avoid
-		// scheduling overlapping SSPLIT & CSPLIT to the same hub?
-		// TODO: even if Multi-TT, do we need to worry about packing
-		// too many into the same uframe?
+		// Each SSPLIT's transaction runs on the TT's full speed bus in
+		// the next uframe, B-frame microframe Y(shift).  Placements where
+		// the TT's frame doesn't have time are skipped.
+		const tt_budget_t *tt = (plan->tt) ? &tt_budget[plan->tt - 1] : NULL;
+		const uint32_t usedmask = smask | cmask;
 		uint32_t best_shift = 0;
 		uint32_t best_offset = 0xFFFFFFFF;
 		uint32_t best_bandwidth = 0xFFFFFFFF;
 		for (uint32_t offset=0; offset < interval; offset++) {
-			// for each 1ms frame offset, compute the worst uframe usage
-			uint32_t max_bandwidth = 0;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				for (uint32_t j=0; j <= 3; j++) { // max 3 without FSTN
-					// at each location, find worst uframe usage
-					// for SSPLIT+CSPLITs
-					uint32_t n = (i << 3) + j;
-					uint32_t bw1 = uframe_bandwidth[n+0] + stime;
-					uint32_t bw2 = uframe_bandwidth[n+2] + ctime;
-					uint32_t bw3 = uframe_bandwidth[n+3] + ctime;
-					uint32_t bw4 = uframe_bandwidth[n+4] + ctime;
-					max_bandwidth = max4(bw1, bw2, bw3, bw4);
-					// remember the best usage found
-					if (max_bandwidth < best_bandwidth) {
-						best_bandwidth = max_bandwidth;
-						best_offset = i;
-						best_shift = j;
+			for (uint32_t shift=0; (usedmask << shift) <= 0xFF; shift++) { // no FSTN
+				// for each 1ms frame offset and uframe shift, compute
+				// the worst uframe usage for SSPLIT+CSPLITs
+				uint32_t max_bandwidth = 0;
+				for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
+					if (tt && !tt_fits(tt, i, shift, plan->tt_usecs)) {
+						max_bandwidth = 0xFFFFFFFF;
+						break;
+					}
+					for (uint32_t j=0; j < 8; j++) {
+						uint32_t bw = uframe_bandwidth[(i << 3) + j];
+						if ((smask << shift) & (1 << j)) {
+							bw += stime;
+						} else if ((cmask << shift) & (1 << j)) {
+							bw += ctime;
+						} else {
+							continue;
+						}
+						if (bw > max_bandwidth) max_bandwidth = bw;
 					}
 				}
+				// remember the best usage found
+				if (max_bandwidth < best_bandwidth) {
+					best_bandwidth = max_bandwidth;
+					best_offset = offset;
+					best_shift = shift;
+				}
 			}
 		}
 		print(" best_bandwidth = ", best_bandwidth);
-		//println(best_bandwidth);
 		print(", at offset = ", best_offset);
-		//print(best_offset);
 		println(", shift= ", best_shift);
-		//println(best_shift);
-		// a 125 us micro frame can fit 7500 bytes, or 234 of our 32-byte units
-		// fail if the best found needs more than 80% (234 * 0.8) in any uframe
-		if (best_bandwidth > 187) return false;
-		// save essential bandwidth specs, for cleanup in delete_Pipe
-		pipe->bandwidth_interval = interval;
-		pipe->bandwidth_offset = best_offset;
-		pipe->bandwidth_shift = best_shift;
-		pipe->bandwidth_stime = stime;
-		pipe->bandwidth_ctime = ctime;
-		for (uint32_t i=best_offset; i < PERIODIC_LIST_SIZE; i += interval) {
-			uint32_t n = (i << 3) + best_shift;
-			uframe_bandwidth[n+0] += stime;
-			uframe_bandwidth[n+2] += ctime;
-			uframe_bandwidth[n+3] += ctime;
-			uframe_bandwidth[n+4] += ctime;
-		}
-		pipe->start_mask = 0x01 << best_shift;
-		pipe->complete_mask = 0x1C << best_shift;
-		pipe->periodic_offset = best_offset;
+		plan->worst = best_bandwidth;
+		if (best_bandwidth > PERIODIC_BANDWIDTH_LIMIT) return false;
+		plan->interval = interval;
+		plan->offset = best_offset;
+		plan->shift = best_shift;
+		plan->stime = stime;
+		plan->ctime = ctime;
+		plan->smask = smask << best_shift;
+		plan->cmask = cmask << best_shift;
+		plan->periodic_interval = interval;
+		plan->periodic_offset = best_offset;
 	}
 	return true;
 }
 
+// Add (or subtract, when removing a pipe) a periodic pipe's bandwidth
+// in uframe_bandwidth.
+static void update_periodic_bandwidth(const Pipe_t *pipe, bool add)
+{
+	const uint32_t interval = pipe->bandwidth_interval;
+	const uint32_t stime = pipe->bandwidth_stime;
+	const uint32_t ctime = pipe->bandwidth_ctime;
+	if (pipe->device->speed == 2) {
+		for (uint32_t i=pipe->bandwidth_offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
+			if (add) uframe_bandwidth[i] += stime;
+			else uframe_bandwidth[i] -= stime;
+		}
+	} else {
+		for (uint32_t i=pipe->bandwidth_offset; i < PERIODIC_LIST_SIZE; i += interval) {
+			for (uint32_t j=0; j < 8; j++) {
+				uint32_t n = (i << 3) + j;
+				uint32_t bw = 0;
+				if (pipe->start_mask & (1 << j)) bw += stime;
+				if (pipe->complete_mask & (1 << j)) bw += ctime;
+				if (add) uframe_bandwidth[n] += bw;
+				else uframe_bandwidth[n] -= bw;
+			}
+			if (pipe->bandwidth_tt) {
+				tt_update(&tt_budget[pipe->bandwidth_tt - 1], i, pipe->bandwidth_shift,
+					pipe->bandwidth_usecs, add);
+			}
+		}
+		if (pipe->bandwidth_tt) {
+			tt_budget_t *tt = &tt_budget[pipe->bandwidth_tt - 1];
+			if (add) {
+				tt->hub_address = pipe->device->tt_address;
+				tt->port = pipe->device->tt_port;
+				tt->pipes++;
+			} else {
+				tt->pipes--;
+			}
+		}
+	}
+}
+
+// Allocate bandwidth for an interrupt or isochronous pipe, and set the
+// pipe's scheduling fields.  Returns false if not enough bandwidth.
+//
+//   pipe:
+//     device->speed      [in]   0=full speed, 1=low speed, 2=high speed
+//     type               [in]   1=isochronous, 3=interrupt
+//     direction          [in]   0=OUT, 1=IN
+//     start_mask         [out]  uframes to start transfer
+//     complete_mask      [out]  uframes to complete transfer (FS & LS only)
+//     periodic_interval  [out]  fream repeat level: 1, 2, 4, 8... PERIODIC_LIST_SIZE
+//     periodic_offset    [out]  frame repeat offset: 0 to periodic_interval-1
+//   maxlen:              [in]   maximum packet length (times mult for HS isochronous)
+//   interval:            [in]   polling interval: LS+FS: frames, HS: 2^(n-1) uframes
+//                               (FS isochronous: 2^(n-1) frames)
+//
+bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, uint32_t interval)
+{
+	println("allocate_interrupt_pipe_bandwidth");
+	bandwidth_plan_t plan;
+	if (!plan_periodic_bandwidth(pipe->device, pipe->type, pipe->direction,
+	  maxlen, interval, &plan)) {
+		println("  not enough periodic bandwidth");
+		periodic_failures++;
+		return false;
+	}
+	// save essential bandwidth specs, for cleanup in delete_Pipe
+	pipe->bandwidth_interval = plan.interval;
+	pipe->bandwidth_offset = plan.offset;
+	pipe->bandwidth_shift = plan.shift;
+	pipe->bandwidth_stime = plan.stime;
+	pipe->bandwidth_ctime = plan.ctime;
+	pipe->start_mask = plan.smask;
+	pipe->complete_mask = plan.cmask;
+	pipe->periodic_interval = plan.periodic_interval;
+	pipe->periodic_offset = plan.periodic_offset;
+	pipe->bandwidth_tt = plan.tt;
+	pipe->bandwidth_usecs = plan.tt_usecs;
+	update_periodic_bandwidth(pipe, true);
+	periodic_pipes++;
+	if (pipe->device->speed < 2 && !plan.tt) periodic_tt_overflows++;
+	return true;
+}
+
+// Check whether new_Pipe() could allocate bandwidth for an interrupt or
+// isochronous pipe, without creating it.  The parameters are the same
+// as new_Pipe().  If load isn't NULL, it receives the busiest uframe's
+// bandwidth with this pipe added, or 0 for control & bulk pipes, or
+// 0xFFFFFFFF if the full or low speed device's TT has no time left.
+bool USBHost::check_Pipe_Bandwidth(Device_t *dev, uint32_t type, uint32_t direction,
+	uint32_t maxlen, uint32_t interval, uint32_t *load)
+{
+	if (load) *load = 0;
+	if (type != 1 && type != 3) return true;
+	if (type == 1 && dev->speed == 2) {
+		maxlen = (maxlen & 0x7FF) * (((maxlen >> 11) & 3) + 1);
+	}
+	bandwidth_plan_t plan;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	bool ok = plan_periodic_bandwidth(dev, type, direction, maxlen, interval, &plan);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	if (load) *load = plan.worst;
+	return ok;
+}
+
+void USBHost::getPeriodicStats(periodic_stats_t &stats)
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	uint32_t max = 0, total = 0;
+	for (uint32_t i=0; i < PERIODIC_LIST_SIZE*8; i++) {
+		uint32_t bw = uframe_bandwidth[i];
+		if (bw > max) max = bw;
+		total += bw;
+	}
+	stats.uframes = PERIODIC_LIST_SIZE*8;
+	stats.capacity = 234;
+	stats.limit = PERIODIC_BANDWIDTH_LIMIT;
+	stats.max_load = max;
+	stats.available = (max < PERIODIC_BANDWIDTH_LIMIT) ? PERIODIC_BANDWIDTH_LIMIT - max : 0;
+	stats.total_load = total;
+	stats.pipes = periodic_pipes;
+	stats.failures = periodic_failures;
+	stats.tts = 0;
+	stats.tt_max_load = 0;
+	stats.tt_overflows = periodic_tt_overflows;
+	for (uint32_t i=0; i < USBHOST_TT_COUNT; i++) {
+		const tt_budget_t *tt = &tt_budget[i];
+		if (tt->pipes == 0) continue;
+		stats.tts++;
+		for (uint32_t f=0; f < PERIODIC_LIST_SIZE; f++) {
+			uint32_t usecs = 0;
+			for (uint32_t y=0; y < 8; y++) usecs += tt->usecs[f][y];
+			if (usecs > stats.tt_max_load) stats.tt_max_load = usecs;
+		}
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+uint32_t USBHost::getPeriodicLoad(uint8_t *list, uint32_t max)
+{
+	if (max > PERIODIC_LIST_SIZE*8) max = PERIODIC_LIST_SIZE*8;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	memcpy(list, uframe_bandwidth, max);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return PERIODIC_LIST_SIZE*8;
+}
+
 // put a new pipe into the periodic schedule tree
 // according to periodic_interval and periodic_offset
 //
@@ -1262,15 +2436,15 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 		//print("    old slot ", i);
 		//print(": ");
 		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
-		uint32_t num = periodictable[i];
+		volatile uint32_t *link = periodic_qh_link(i); // skip past iTD, siTD
+		uint32_t num = *link;
 		Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
-		if ((num & 1) || ((num & 6) == 2 && node->periodic_interval < interval)) {
+		if ((num & 1) || node->periodic_interval < interval) {
 			//println("  add to slot ", i);
 			pipe->qh.horizontal_link = num;
-			periodictable[i] = (uint32_t)&(pipe->qh) | 2; // 2=QH
+			*link = (uint32_t)&(pipe->qh) | 2; // 2=QH
 		} else {
 			//println("  traverse list ", i);
-			// TODO: skip past iTD, siTD when/if we support isochronous
 			while (node->periodic_interval >= interval) {
 				if (node == pipe) goto nextslot;
 				//print("  num ", num, HEX);
@@ -1313,6 +2487,106 @@ void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 }
 
 
+// Cancel all transfers queued on a control, bulk or interrupt pipe,
+// leaving the pipe ready for new transfers.  The optional callback is
+// called for each cancelled transfer with the number of bytes which
+// were actually transferred.  Normal completion callbacks are not
+// called, even for transfers which completed but were not yet handled
+// by the ISR.  Returns the number of transfers cancelled.
+//
+uint32_t USBHost::cancel_Transfers(Pipe_t *pipe, void (*callback)(const Transfer_t *, uint32_t))
+{
+	if (pipe->type == 1) return 0; // isochronous not supported
+	println("cancel_Transfers ", (uint32_t)pipe, HEX);
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+
+	// Stop the EHCI from using the QH, so we can safely modify it.
+	bool isasync = (pipe->type == 0 || pipe->type == 2);
+	Pipe_t *prev = NULL;
+	uint32_t smask = 0;
+	if (isasync) {
+		Pipe_t *next = (Pipe_t *)(pipe->qh.horizontal_link & 0xFFFFFFE0);
+		if (next == pipe) {
+			// the only QH, so just stop the async schedule
+			USBHS_USBCMD &= ~USBHS_USBCMD_ASE;
+			while (USBHS_USBSTS & USBHS_USBSTS_AS) ; // busy loop wait
+		} else {
+			// temporarily remove QH from the async schedule loop
+			prev = next;
+			while (1) {
+				Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
+				if (n == pipe) break;
+				prev = n;
+			}
+			if (pipe->qh.capabilities[0] & 0x8000) {
+				prev->qh.capabilities[0] |= 0x8000; // move H bit
+				pipe->qh.capabilities[0] &= ~0x8000;
+			}
+			prev->qh.horizontal_link = pipe->qh.horizontal_link;
+			// Async Advance Doorbell handshake, EHCI 4.8.2
+			USBHS_USBCMD |= USBHS_USBCMD_IAA;
+			while (!(USBHS_USBSTS & USBHS_USBSTS_AAI)) ; // busy loop wait
+			USBHS_USBSTS = USBHS_USBSTS_AAI;
+		}
+	} else {
+		// clear the QH's smask, so no new transactions start, and wait
+		// for a frame boundary so any in progress (or splits) finish
+		smask = pipe->qh.capabilities[1] & 0xFF;
+		pipe->qh.capabilities[1] &= ~0xFF;
+		uint32_t uframe = USBHS_FRINDEX;
+		while (((USBHS_FRINDEX - uframe) & 0x3FFF) <= 8) ; // busy loop wait
+	}
+
+	// Free all qTDs.  For each transfer, add up how many bytes remained
+	// in its qTDs.  The qTD in progress has its live token in the QH.
+	uint32_t count = 0;
+	uint32_t remaining = 0;
+	Transfer_t *t = pipe->followup_first;
+	while (t) {
+		Transfer_t *next = t->next_followup;
+		uint32_t token = t->qtd.token;
+		if ((uint32_t)t == (pipe->qh.current & 0xFFFFFFE0)) token = pipe->qh.token;
+		remaining += (token >> 16) & 0x7FFF;
+		if (t->pipe) {
+			// last qTD of a transfer has info for followup
+			uint32_t len = t->length;
+			println("  cancel, remaining=", remaining);
+#ifdef USBHOST_TRACE
+			trace_transfer('E', t, (remaining < len) ? len - remaining : 0, 0x100);
+#endif
+			if (callback) (*callback)(t, (remaining < len) ? len - remaining : 0);
+			remaining = 0;
+			count++;
+		}
+		remove_from_followup_list(pipe, t);
+		free_Transfer(t);
+		t = next;
+	}
+	remove_from_active_list(pipe);
+	pipe->stat_queued = 0;
+	pipe->stat_remaining = 0;
+
+	// Restore the QH with only its halt qTD, keeping the data toggle
+	pipe->qh.next = (uint32_t)pipe->halt;
+	pipe->qh.alt_next = 1;
+	pipe->qh.current = 0;
+	if (pipe->qh.token != 0x40) { // remains halted if Clear Feature pending
+		pipe->qh.token &= 0x80000000;
+	}
+	if (isasync) {
+		if (prev) {
+			prev->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2; // 2=QH
+		} else {
+			USBHS_USBCMD |= USBHS_USBCMD_ASE;
+		}
+	} else {
+		pipe->qh.capabilities[1] |= smask;
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return count;
+}
+
 void USBHost::delete_Pipe(Pipe_t *pipe)
 {
 	println("delete_Pipe ", (uint32_t)pipe, HEX);
@@ -1364,40 +2638,30 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 			USBHS_USBSTS = USBHS_USBSTS_AAI;
 			// TODO: does this write interfere UPI & UAI (bits 18 & 19) ??
 		}
-		// find & free all the transfers which completed
-		println("  Free transfers");
-		Transfer_t *t = async_followup_first;
-		while (t) {
-			print("    * ", (uint32_t)t);
-			Transfer_t *next = t->next_followup;
-			if (t->pipe == pipe) {
-				print(" * remove");
-				remove_from_async_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
-			} else {
-				println("");
+	} else if (pipe->type == 1) {
+		// remove all isochronous frames from the periodic schedule
+		Isochronous_t *iso = iso_followup_first;
+		while (iso) {
+			Isochronous_t *next = iso->next_followup;
+			if (iso->pipe == pipe) {
+				remove_from_iso_followup_list(iso);
+				retire_isochronous(iso);
 			}
-			t = next;
+			iso = next;
 		}
+		// wait for the next microframe, so EHCI can't still be using them
+		uint32_t uframe = USBHS_FRINDEX;
+		while (USBHS_FRINDEX == uframe) ; // busy loop wait
+		release_retired_Isochronous();
 	} else {
 		// remove from the periodic schedule
 		for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
-			uint32_t num = periodictable[i];
+			volatile uint32_t *link = periodic_qh_link(i);
+			uint32_t num = *link;
 			if (num & 1) continue;
 			Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
 			if (node == pipe) {
-				periodictable[i] = pipe->qh.horizontal_link;
+				*link = pipe->qh.horizontal_link;
 				continue;
 			}
 			Pipe_t *prev = node;
@@ -1412,55 +2676,39 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 				prev = node;
 			}
 		}
+	}
+	if (!isasync) {
 		// subtract bandwidth from uframe_bandwidth array
-		if (pipe->device->speed == 2) {
-			uint32_t interval = pipe->bandwidth_interval;
-			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t stime = pipe->bandwidth_stime;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
-				uframe_bandwidth[i] -= stime;
-			}
-		} else {
-			uint32_t interval = pipe->bandwidth_interval;
-			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t shift = pipe->bandwidth_shift;
-			uint32_t stime = pipe->bandwidth_stime;
-			uint32_t ctime = pipe->bandwidth_ctime;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				uint32_t n = (i << 3) + shift;
-				uframe_bandwidth[n+0] -= stime;
-				uframe_bandwidth[n+2] -= ctime;
-				uframe_bandwidth[n+3] -= ctime;
-				uframe_bandwidth[n+4] -= ctime;
-			}
-		}
+		update_periodic_bandwidth(pipe, false);
+		periodic_pipes--;
+	}
+	// find & free all the transfers which completed
+	println("  Free transfers");
+	Transfer_t *t = pipe->followup_first;
+	while (t) {
+		print("    * ", (uint32_t)t);
+		Transfer_t *next = t->next_followup;
+		print(" * remove");
+		remove_from_followup_list(pipe, t);
 
-		// find & free all the transfers which completed
-		println("  Free transfers");
-		Transfer_t *t = periodic_followup_first;
-		while (t) {
-			print("    * ", (uint32_t)t);
-			Transfer_t *next = t->next_followup;
-			if (t->pipe == pipe) {
-				print(" * remove");
-				remove_from_periodic_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
-			} else {
-				println("");
-			}
-			t = next;
+		// Only free if not in QH list
+		Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
+		while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
+			tr  = (Transfer_t *)(tr->qtd.next);
 		}
+		if (tr == t) {
+			println(" * defer free until QH");
+		} else {
+			println(" * free");
+			free_Transfer(t);  // The later code should actually free it...
+		}
+		t = next;
+	}
+	remove_from_active_list(pipe);
+	// completed transfers waiting for deferred callback must not use this pipe
+	for (uint32_t i=callback_ring_tail; i != callback_ring_head; ) {
+		if (++i >= CALLBACK_RING_SIZE) i = 0;
+		if (callback_ring[i]->pipe == pipe) callback_ring[i]->pipe = NULL;
 	}
 	//
 	// TODO: do we need to look at pipe->qh.current ??
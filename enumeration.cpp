@@ -41,16 +41,83 @@ static Device_t  *devlist=NULL;
 // devices.
 static USBDriver *available_drivers = NULL;
 
-// Static buffers used during enumeration.  One a single USB device
-// may enumerate at once, because USB address zero is used, and
-// because this static buffer & state info can't be shared.
-static uint8_t enumbuf[2048] __attribute__ ((aligned(16)));
-static setup_t enumsetup __attribute__ ((aligned(16)));
-static uint16_t enumlen;
-
-// True while any device is present but not yet fully configured.
-// Only one USB device may be in this state at a time (responding
-// to address zero) and using the enumeration static buffer.
+// Entries of the drivers' match tables, sorted by match_key so the
+// tables interested in a device or interface are found by binary
+// search rather than calling claim() on every driver.  Tables shared
+// by several instances of a driver are added once.
+typedef struct {
+	const usb_match_t *entry;
+	const usb_match_t *table;
+} match_index_t;
+static match_index_t match_index[USBHOST_MATCH_INDEX_SIZE];
+static uint32_t match_index_count = 0;
+#define MATCH_RESULTS  8
+
+// Buffers used during enumeration.  Only a single USB device may
+// respond to address zero, so port resets and enumeration are
+// exclusive until SET_ADDRESS completes.  Then each device reads
+// its descriptors into its own buffer, so several devices can
+// enumerate at once.
+#if USBHOST_ENUMERATION_BUFFERS < 1 || USBHOST_ENUMERATION_BUFFERS > 31
+#error "USBHOST_ENUMERATION_BUFFERS must be 1 to 31"
+#endif
+#define ENUMBUF_ALL  ((1 << USBHOST_ENUMERATION_BUFFERS) - 1)
+static enumbuf_t enumbufs[USBHOST_ENUMERATION_BUFFERS];
+static uint32_t enumbuf_in_use = 0;
+
+// The device responding to address zero, if any
+static Device_t *address0_device = NULL;
+
+#ifdef USBHOST_FAST_ATTACH
+static bool fast_attach = true;
+#else
+static bool fast_attach = false;
+#endif
+
+static enumeration_stats_t enum_stats;
+static uint32_t enum_stats_start;
+static bool enum_stats_started = false;
+
+// Optional cache of config and HID report descriptors, in a buffer
+// given to setDescriptorCache().  It begins with a header, followed by
+// entries, oldest first.  Each entry's data is checked before use, so
+// a buffer restored from a file can't give drivers corrupt descriptors.
+// Entries are matched by VID, PID & bcdDevice, and a hash of the serial
+// number.  Users of an entry also check its length, and the config
+// descriptor's first 9 bytes are always read from the device and
+// compared, as devices without a serial number share entries.
+#define CACHE_MAGIC  0x32434455  // "UDC2"
+typedef struct {
+	uint32_t magic;
+	uint32_t used;      // bytes, including this header
+} cache_header_t;
+typedef struct {
+	uint16_t size;      // bytes, including this header, multiple of 4
+	uint16_t len;       // descriptor bytes
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t  type;      // 2=config, 0x22=HID report
+	uint8_t  index;     // interface number for HID report
+	uint32_t serial;    // hash of the serial number string, 0 if none
+	uint32_t check;     // hash of the descriptor bytes
+} cache_entry_t;
+static cache_header_t *desc_cache = NULL;
+static uint32_t desc_cache_size = 0;
+
+// FNV-1a, a cheap hash for the cache serial numbers & checks
+#define FNV_OFFSET  2166136261u
+static uint32_t descriptor_hash(uint32_t hash, const uint8_t *data, uint32_t len)
+{
+	while (len-- > 0) {
+		hash = (hash ^ *data++) * 16777619u;
+	}
+	return hash;
+}
+
+// True while a device is responding to address zero, or all the
+// enumeration buffers are in use.  The hub driver waits to reset
+// another port until this is false.
 volatile bool USBHost::enumeration_busy = false;
 
 
@@ -58,6 +125,16 @@ volatile bool USBHost::enumeration_busy = false;
 static void pipe_set_maxlen(Pipe_t *pipe, uint32_t maxlen);
 static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
 
+// Drivers allocate pipes while claiming, so a driver is charged for
+// any Pipe_t allocation failures during its claim().  The pool's count
+// is 16 bits and wraps, so differences must be taken modulo 2^16.
+static uint32_t pipe_failures(void)
+{
+	pool_stats_t stats;
+	USBHost::poolStats(USBHost::POOL_PIPE, stats);
+	return stats.failures;
+}
+
 #define print   USBHost::print_
 #define println USBHost::println_
 
@@ -66,6 +143,8 @@ static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
 // call all the active driver Task() functions.
 void USBHost::Task()
 {
+	flushCompletions();
+	processCallbacks();
 	for (Device_t *dev = devlist; dev; dev = dev->next) {
 		for (USBDriver *driver = dev->drivers; driver; driver = driver->next) {
 			(driver->Task)();
@@ -83,6 +162,7 @@ void USBHost::driver_ready_for_device(USBDriver *driver)
 {
 	driver->device = NULL;
 	driver->next = NULL;
+	driver->match_table = NULL;
 	if (available_drivers == NULL) {
 		available_drivers = driver;
 	} else {
@@ -93,9 +173,96 @@ void USBHost::driver_ready_for_device(USBDriver *driver)
 	}
 }
 
+// Entries are grouped by level, VID/PID entries before class entries.
+// Class entries are sorted by class only, subclass & protocol are
+// checked by usb_match.
+static uint64_t match_key(uint32_t level, bool by_class, uint32_t value)
+{
+	return ((uint64_t)(level * 2 + by_class) << 32) | value;
+}
+
+static uint64_t match_key(const usb_match_t *m)
+{
+	if (m->flags & USB_MATCH_FLAG_ID) {
+		return match_key(m->level, false, ((uint32_t)m->idVendor << 16) | m->idProduct);
+	}
+	return match_key(m->level, true, m->bClass);
+}
+
+// Drivers with a match table also call this, so they're only offered the
+// devices and interfaces it lists.  If the table can't be indexed, the
+// driver is offered everything.
+//
+void USBHost::driver_ready_for_device(USBDriver *driver, const usb_match_t *table, uint32_t count)
+{
+	driver_ready_for_device(driver);
+	for (uint32_t i=0; i < match_index_count; i++) {
+		if (match_index[i].table == table) {
+			driver->match_table = table;
+			return;
+		}
+	}
+	if (count == 0 || count > USBHOST_MATCH_INDEX_SIZE - match_index_count) return;
+	for (uint32_t i=0; i < count; i++) {
+		if (table[i].level > 2) return;
+		if (!(table[i].flags & (USB_MATCH_FLAG_ID | USB_MATCH_FLAG_CLASS))) return;
+	}
+	for (uint32_t i=0; i < count; i++) {
+		uint64_t key = match_key(table + i);
+		uint32_t n = match_index_count++;
+		while (n > 0 && match_key(match_index[n-1].entry) > key) {
+			match_index[n] = match_index[n-1];
+			n--;
+		}
+		match_index[n].entry = table + i;
+		match_index[n].table = table;
+	}
+	driver->match_table = table;
+}
+
+// Find the match tables with an entry for a device (level 0), interface
+// (level 1) or IAD (level 2).  Returns how many were found, or more than MATCH_RESULTS if
+// there are too many to list.
+static uint32_t match_lookup(uint32_t level, const Device_t *dev, uint32_t cls,
+	uint32_t subclass, uint32_t protocol, const usb_match_t **found)
+{
+	uint32_t count = 0;
+	for (int by_class=0; by_class < 2; by_class++) {
+		uint64_t key = by_class ? match_key(level, true, cls) :
+			match_key(level, false, ((uint32_t)dev->idVendor << 16) | dev->idProduct);
+		uint32_t lo = 0, hi = match_index_count;
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+			if (match_key(match_index[mid].entry) < key) lo = mid + 1;
+			else hi = mid;
+		}
+		for (; lo < match_index_count && match_key(match_index[lo].entry) == key; lo++) {
+			if (!usb_match(*match_index[lo].entry, dev->idVendor, dev->idProduct,
+			  cls, subclass, protocol)) continue;
+			const usb_match_t *table = match_index[lo].table;
+			uint32_t i = 0;
+			while (i < count && found[i] != table) i++;
+			if (i < count) continue;
+			if (count == MATCH_RESULTS) return count + 1;
+			found[count++] = table;
+		}
+	}
+	return count;
+}
+
+static bool match_offered(const usb_match_t *table, const usb_match_t **found, uint32_t count)
+{
+	if (table == NULL || count > MATCH_RESULTS) return true;
+	for (uint32_t i=0; i < count; i++) {
+		if (found[i] == table) return true;
+	}
+	return false;
+}
+
 // Create a new device and begin the enumeration process
 //
-Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port)
+Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port,
+	uint32_t connect_micros, uint32_t reset_micros)
 {
 	Device_t *dev;
 
@@ -114,8 +281,36 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 	dev->address = 0;
 	dev->hub_address = hub_addr;
 	dev->hub_port = hub_port;
+	for (uint32_t i=0; i < USBHOST_ENUMERATION_BUFFERS; i++) {
+		if (!(enumbuf_in_use & (1 << i))) {
+			enumbuf_in_use |= (1 << i);
+			dev->enumbuf = enumbufs + i;
+			break;
+		}
+	}
+	if (!dev->enumbuf) {
+		free_Device(dev);
+		return NULL;
+	}
+	if (speed < 2 && hub_addr > 0) {
+		// Full & low speed devices use the transaction translator of
+		// the nearest high speed hub, or the root port's.  A full speed
+		// hub has no TT, so its devices use the same one as the hub.
+		for (Device_t *hub = devlist; hub; hub = hub->next) {
+			if (hub->address != hub_addr) continue;
+			if (hub->speed < 2) {
+				dev->tt_address = hub->tt_address;
+				dev->tt_port = hub->tt_port;
+			} else {
+				dev->tt_address = hub_addr;
+				dev->tt_port = (hub->bDeviceProtocol == 2) ? hub_port : 0; // Multi-TT
+			}
+			break;
+		}
+	}
 	dev->control_pipe = new_Pipe(dev, 0, 0, 0, 8);
 	if (!dev->control_pipe) {
+		enumbuf_in_use &= ~(1 << (dev->enumbuf - enumbufs));
 		free_Device(dev);
 		return NULL;
 	}
@@ -124,8 +319,24 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 	dev->control_pipe->error_callback_function = &enumeration_error;
 	dev->control_pipe->direction = 1; // 1=IN
 	// Here is where the enumeration process officially begins.
-	// Only a single device can enumerate at a time.
+	// Only a single device can be at address zero at a time.
+	address0_device = dev;
 	USBHost::enumeration_busy = true;
+	uint32_t now = micros();
+	enumbuf_t *e = dev->enumbuf;
+	e->start_micros = connect_micros;
+	memset(&e->times, 0, sizeof(e->times));
+	e->times.debounce = reset_micros - connect_micros;
+	e->times.reset = now - reset_micros;
+	e->phase = 0;
+	e->phase_micros = now;
+	if (!enum_stats_started) {
+		enum_stats_start = connect_micros;
+		enum_stats_started = true;
+	}
+	if (++enum_stats.active > enum_stats.max_active) {
+		enum_stats.max_active = enum_stats.active;
+	}
 	if (devlist == NULL) {
 		devlist = dev;
 	} else {
@@ -133,15 +344,47 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 		for (p = devlist; p->next; p = p->next) ; // walk devlist
 		p->next = dev;
 	}
-	dev->enum_state = 0;
+	if (fast_attach && speed > 0) {
+		// high and low speed allow only one control packet size, so
+		// skip reading the first 8 bytes of device descriptor
+		if (speed == 2) pipe_set_maxlen(dev->control_pipe, 64);
+		dev->enum_state = 1;
+	} else {
+		dev->enum_state = 0;
+	}
 	enumeration_transmit(dev);
 	return dev;
 }
 
 
+// Enumeration phase of each enum_state: 0=address, 1=device descriptor,
+// 2=strings, 3=config descriptor, 4=configure, 5=done
+static const uint8_t enum_phase[10] = {0, 0, 1, 2, 2, 2, 2, 3, 3, 4};
+
+// Record how long the previous phase took, when enum_state moves on
+static void enumeration_timing(enumbuf_t *e, uint32_t state)
+{
+	uint32_t phase = (state < sizeof(enum_phase)) ? enum_phase[state] : 5;
+	if (phase == e->phase) return;
+	uint32_t now = micros();
+	uint32_t us = now - e->phase_micros;
+	switch (e->phase) {
+	  case 0: e->times.address = us; break;
+	  case 1: e->times.device = us; break;
+	  case 2: e->times.strings = us; break;
+	  case 3: e->times.config = us; break;
+	  case 4: e->times.configure = us; break;
+	}
+	e->phase = phase;
+	e->phase_micros = now;
+}
+
 void USBHost::enumeration_transmit(Device_t *dev)
 {
 	println("enumeration_transmit, state ", dev->enum_state);
+	if (!dev->enumbuf) return;
+	uint8_t *enumbuf = dev->enumbuf->buffer;
+	setup_t &enumsetup = dev->enumbuf->setup;
 	switch (dev->enum_state) {
 
 	case 0: // request first 8 bytes of device descriptor
@@ -159,22 +402,22 @@ void USBHost::enumeration_transmit(Device_t *dev)
 		return;
 	case 3: // request Language ID
 		mk_setup(enumsetup, 0x80, 6 /*6=GET_DESCRIPTOR*/, 0x0300, 0,
-			sizeof(enumbuf) - 4);
+			sizeof(dev->enumbuf->buffer) - 4);
 		queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
 		return;
 	case 4: // request Manufacturer string
 		mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[0], dev->LanguageID,
-			sizeof(enumbuf) - 4);
+			sizeof(dev->enumbuf->buffer) - 4);
 		queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
 		return;
 	case 5: // request Product string
 		mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[1], dev->LanguageID,
-			sizeof(enumbuf) - 4);
+			sizeof(dev->enumbuf->buffer) - 4);
 		queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
 		return;
 	case 6: // request Serial Number string
 		mk_setup(enumsetup, 0x80, 6, 0x0300 | enumbuf[2], dev->LanguageID,
-			sizeof(enumbuf) - 4);
+			sizeof(dev->enumbuf->buffer) - 4);
 		queue_Control_Transfer(dev, &enumsetup, enumbuf + 4, NULL);
 		return;
 	case 7: // request first 9 bytes of config desc
@@ -182,9 +425,7 @@ void USBHost::enumeration_transmit(Device_t *dev)
 		queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
 		return;
 	case 8: // request all of config desc
-		enumlen = enumbuf[2] | (enumbuf[3] << 8);
-		// TODO: is fetching enumlen this way really safe?
-		mk_setup(enumsetup, 0x80, 6 /*6=GET_DESCRIPTOR*/, 0x0200, 0, enumlen);
+		mk_setup(enumsetup, 0x80, 6 /*6=GET_DESCRIPTOR*/, 0x0200, 0, dev->enumbuf->len);
 		queue_Control_Transfer(dev, &enumsetup, enumbuf, NULL);
 		return;
 	case 9: // send set config
@@ -214,6 +455,9 @@ void USBHost::enumeration_receive(const Transfer_t *transfer)
 	//print(transfer);
 	println("enumeration_receive, state ", dev->enum_state);
 	dev->enum_error_count = 0;
+	if (!dev->enumbuf) return; // enumeration already completed
+	uint8_t *enumbuf = dev->enumbuf->buffer;
+	uint32_t now;
 #if 0
 	while (1) {
 		// Within this large switch/case, "break" means we've done
@@ -230,8 +474,10 @@ void USBHost::enumeration_receive(const Transfer_t *transfer)
 		dev->enum_state = 1;
 		break;
 	case 1: // device address sucessfully set
-		dev->address = enumsetup.wValue;
-		pipe_set_addr(dev->control_pipe, enumsetup.wValue);
+		dev->address = dev->enumbuf->setup.wValue;
+		pipe_set_addr(dev->control_pipe, dev->address);
+		// another device may now be reset and use address zero
+		enumeration_release(dev, false);
 		println("queuing get device descriptor");
 		dev->enum_state = 2;
 		break;
@@ -242,6 +488,8 @@ void USBHost::enumeration_receive(const Transfer_t *transfer)
 		dev->bDeviceProtocol = enumbuf[6];
 		dev->idVendor = enumbuf[8] | (enumbuf[9] << 8);
 		dev->idProduct = enumbuf[10] | (enumbuf[11] << 8);
+		dev->bcdDevice = enumbuf[12] | (enumbuf[13] << 8);
+		dev->serial_hash = 0;
 		enumbuf[0] = enumbuf[14];
 		enumbuf[1] = enumbuf[15];
 		enumbuf[2] = enumbuf[16];
@@ -281,34 +529,54 @@ void USBHost::enumeration_receive(const Transfer_t *transfer)
 	case 6: // parse Serial Number string
 		print_string_descriptor("Serial Number: ", enumbuf + 4);
 		convertStringDescriptorToASCIIString(2, dev, transfer);
+		if (enumbuf[4] > 2 && enumbuf[5] == 3) {
+			dev->serial_hash = descriptor_hash(FNV_OFFSET, enumbuf + 6, enumbuf[4] - 2);
+		}
 		dev->enum_state = 7;
 		break;
 	case 7: // parse first 9 bytes of config, to learn it's length
-		enumlen = enumbuf[2] | (enumbuf[3] << 8);
-		// TODO: should enumlen be stored in device state?
-		println("Config data length = ", enumlen);
-		if (enumlen > sizeof(enumbuf)) {
-			enumlen = sizeof(enumbuf);
+		dev->enumbuf->len = enumbuf[2] | (enumbuf[3] << 8);
+		println("Config data length = ", dev->enumbuf->len);
+		if (dev->enumbuf->len > sizeof(dev->enumbuf->buffer)) {
+			dev->enumbuf->len = sizeof(dev->enumbuf->buffer);
 			// TODO: how to handle device with too much config data
 		}
+		// A cached copy is used only if it begins with this header,
+		// since devices without a serial number share cache entries.
+		if (find_Cached_Descriptor(dev, 2, 0, enumbuf, dev->enumbuf->len, enumbuf, 9)) {
+			// same config as an earlier connection, skip to set config
+			dev->bmAttributes = enumbuf[7];
+			dev->bMaxPower = enumbuf[8];
+			dev->enum_state = 9;
+			break;
+		}
 		dev->enum_state = 8;
 		break;
 	case 8: // parse config descriptor
-		print_config_descriptor(enumbuf, sizeof(enumbuf));
+		print_config_descriptor(enumbuf, sizeof(dev->enumbuf->buffer));
 		dev->bmAttributes = enumbuf[7];
 		dev->bMaxPower = enumbuf[8];
+		cache_Descriptor(dev, 2, 0, enumbuf, dev->enumbuf->len);
 		// TODO: actually do something with interface descriptor?
 		dev->enum_state = 9;
 		break;
 	case 9: // device is now configured
 		claim_drivers(dev);
 		dev->enum_state = 15;
-		// unlock exclusive access to enumeration process.  If any
-		// more devices are waiting, the hub driver is responsible
+		// free this device's enumeration buffer.  If any more
+		// devices are waiting, the hub driver is responsible
 		// for resetting their ports and starting their enumeration
 		// when the port enables.
 		dev->enum_state = 10;
-		USBHost::enumeration_busy = false;
+		enumeration_timing(dev->enumbuf, 10);
+		now = micros();
+		enum_stats.configured++;
+		if (now - dev->enumbuf->start_micros > enum_stats.max_micros) {
+			enum_stats.max_micros = now - dev->enumbuf->start_micros;
+		}
+		enum_stats.bringup_micros = now - enum_stats_start;
+		enum_stats.last = dev->enumbuf->times;
+		enumeration_release(dev, true);
 		return;
 	case 10: // control transfers for other stuff?
 		// TODO: handle other standard control: set/clear feature, etc
@@ -316,6 +584,7 @@ void USBHost::enumeration_receive(const Transfer_t *transfer)
 	default:
 		return;
 	}
+	enumeration_timing(dev->enumbuf, dev->enum_state);
 	enumeration_transmit(dev);
 }
 
@@ -323,6 +592,12 @@ void USBHost::enumeration_error(const Transfer_t *transfer)
 {
 	Device_t *dev = transfer->pipe->device;
 
+	if (is_clear_Halt(transfer)) {
+		// Clear Feature after a STALL, not enumeration.  Resume the
+		// pipe anyway, a still stalled endpoint halts again.
+		transfer->driver->control(transfer);
+		return;
+	}
 	println("enumeration_error, state ", dev->enum_state);
 
 	if (++(dev->enum_error_count) < 25) {
@@ -331,8 +606,201 @@ void USBHost::enumeration_error(const Transfer_t *transfer)
 		enumeration_transmit(dev);
 	} else {
 		println("too many errors, giving up enumeration");
-		USBHost::enumeration_busy = false;
+		if (dev->enumbuf) enum_stats.failures++;
+		enumeration_release(dev, true);
+	}
+}
+
+// Allow another device to begin enumeration.  Address zero is free
+// when SET_ADDRESS completes.  The buffer is freed when enumeration
+// completes or fails, or the device disconnects.
+void USBHost::enumeration_release(Device_t *dev, bool free_buffer)
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	if (address0_device == dev) address0_device = NULL;
+	if (free_buffer && dev->enumbuf) {
+		enumbuf_in_use &= ~(1 << (dev->enumbuf - enumbufs));
+		dev->enumbuf = NULL;
+		enum_stats.active--;
+	}
+	enumeration_busy = (address0_device != NULL) || (enumbuf_in_use == ENUMBUF_ALL);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void USBHost::getEnumerationStats(enumeration_stats_t &stats)
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	stats = enum_stats;
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void USBHost::resetEnumerationStats()
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	uint8_t active = enum_stats.active;
+	memset(&enum_stats, 0, sizeof(enum_stats));
+	enum_stats.active = active;
+	enum_stats.max_active = active;
+	enum_stats_started = false;
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void USBHost::setFastAttach(bool enable)
+{
+	fast_attach = enable;
+}
+
+bool USBHost::fastAttach()
+{
+	return fast_attach;
+}
+
+static cache_entry_t * cache_first(void)
+{
+	return (cache_entry_t *)(desc_cache + 1);
+}
+
+static cache_entry_t * cache_end(void)
+{
+	return (cache_entry_t *)((uint8_t *)desc_cache + desc_cache->used);
+}
+
+static cache_entry_t * cache_next(cache_entry_t *entry)
+{
+	return (cache_entry_t *)((uint8_t *)entry + entry->size);
+}
+
+static bool cache_match(const cache_entry_t *entry, const Device_t *dev,
+	uint32_t type, uint32_t index)
+{
+	return entry->idVendor == dev->idVendor && entry->idProduct == dev->idProduct
+	  && entry->bcdDevice == dev->bcdDevice && entry->serial == dev->serial_hash
+	  && entry->type == type && entry->index == index;
+}
+
+static void cache_remove(cache_entry_t *entry)
+{
+	uint32_t size = entry->size;
+	uint8_t *next = (uint8_t *)entry + size;
+	memmove(entry, next, (uint8_t *)cache_end() - next);
+	desc_cache->used -= size;
+}
+
+// Use buffer (at least 4 byte aligned) to cache descriptors.  If keep is
+// true, it holds entries saved earlier, for example restored from a file.
+// Any invalid entry, and all after it, are discarded.
+void USBHost::setDescriptorCache(void *buffer, uint32_t size, bool keep)
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	desc_cache = NULL;
+	desc_cache_size = 0;
+	if (buffer && size >= sizeof(cache_header_t) + sizeof(cache_entry_t)) {
+		desc_cache = (cache_header_t *)buffer;
+		desc_cache_size = size;
+		if (!keep || desc_cache->magic != CACHE_MAGIC
+		  || desc_cache->used < sizeof(cache_header_t) || desc_cache->used > size) {
+			desc_cache->magic = CACHE_MAGIC;
+			desc_cache->used = sizeof(cache_header_t);
+		}
+		cache_entry_t *entry = cache_first();
+		cache_entry_t *end = cache_end();
+		while (entry < end) {
+			uint32_t remain = (uint8_t *)end - (uint8_t *)entry;
+			if (remain < sizeof(cache_entry_t) || entry->size > remain
+			  || entry->size != ((sizeof(cache_entry_t) + entry->len + 3) & ~3)
+			  || entry->check != descriptor_hash(FNV_OFFSET,
+			    (uint8_t *)(entry + 1), entry->len)) {
+				println("descriptor cache: invalid entry discarded");
+				desc_cache->used = (uint8_t *)entry - (uint8_t *)desc_cache;
+				break;
+			}
+			entry = cache_next(entry);
+		}
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+void USBHost::clearDescriptorCache()
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	if (desc_cache) desc_cache->used = sizeof(cache_header_t);
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+// Bytes at the start of the cache buffer to save, to restore later.
+uint32_t USBHost::descriptorCacheUsed()
+{
+	return desc_cache ? desc_cache->used : 0;
+}
+
+// Copy a descriptor this device gave in an earlier connection into buf.
+// Returns len, or 0 if it isn't cached with that length, or the cached
+// copy doesn't begin with header_len bytes of header.
+uint32_t USBHost::find_Cached_Descriptor(Device_t *dev, uint32_t type, uint32_t index,
+	void *buf, uint32_t len, const void *header, uint32_t header_len)
+{
+	uint32_t found = 0;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	if (desc_cache) {
+		cache_entry_t *end = cache_end();
+		for (cache_entry_t *entry = cache_first(); entry < end; entry = cache_next(entry)) {
+			if (!cache_match(entry, dev, type, index)) continue;
+			if (entry->check != descriptor_hash(FNV_OFFSET,
+			  (uint8_t *)(entry + 1), entry->len)) {
+				cache_remove(entry);
+			} else if (entry->len == len && header_len <= len
+			  && (!header_len || memcmp(entry + 1, header, header_len) == 0)) {
+				memcpy(buf, entry + 1, len);
+				found = len;
+				enum_stats.cached++;
+			}
+			break;
+		}
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	println("find_Cached_Descriptor, len=", found);
+	return found;
+}
+
+// Remember a descriptor, replacing any older copy.  If the cache is
+// full, the oldest entries are discarded to make room.
+void USBHost::cache_Descriptor(Device_t *dev, uint32_t type, uint32_t index,
+	const void *data, uint32_t len)
+{
+	uint32_t size = (sizeof(cache_entry_t) + len + 3) & ~3;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	if (desc_cache && size <= desc_cache_size - sizeof(cache_header_t) && len <= 0xFFFF) {
+		cache_entry_t *end = cache_end();
+		for (cache_entry_t *entry = cache_first(); entry < end; entry = cache_next(entry)) {
+			if (cache_match(entry, dev, type, index)) {
+				cache_remove(entry);
+				break;
+			}
+		}
+		while (desc_cache->used + size > desc_cache_size) {
+			cache_remove(cache_first());
+		}
+		cache_entry_t *entry = cache_end();
+		entry->size = size;
+		entry->len = len;
+		entry->idVendor = dev->idVendor;
+		entry->idProduct = dev->idProduct;
+		entry->bcdDevice = dev->bcdDevice;
+		entry->type = type;
+		entry->index = index;
+		entry->serial = dev->serial_hash;
+		memcpy(entry + 1, data, len);
+		entry->check = descriptor_hash(FNV_OFFSET, (uint8_t *)(entry + 1), len);
+		desc_cache->used += size;
 	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
 }
 
 
@@ -368,32 +836,34 @@ void  USBHost::convertStringDescriptorToASCIIString(uint8_t string_index, Device
 }
 
 
-void USBHost::claim_drivers(Device_t *dev)
+// End of the descriptors for interfaces first to first+count-1, which
+// begin with the interface or IAD descriptor at p: their alternate
+// settings, class specific and endpoint descriptors, up to the next
+// IAD or other interface.
+static const uint8_t * interfaces_end(const uint8_t *p, const uint8_t *end,
+	uint32_t first, uint32_t count)
 {
-	USBDriver *driver, *prev=NULL;
+	p += p[0];
+	while (p + 3 <= end && p[0] >= 2 && p + p[0] <= end) {
+		if (p[1] == 11) break;
+		if (p[1] == 4 && (p[2] < first || p[2] >= first + count)) break;
+		p += p[0];
+	}
+	return p;
+}
 
+void USBHost::claim_drivers(Device_t *dev)
+{
 	// first check if any driver wishes to claim the entire device
-	for (driver=available_drivers; driver != NULL; driver = driver->next) {
-		if (driver->device != NULL) continue;
-		if (driver->claim(dev, 0, enumbuf + 9, enumlen - 9)) {
-			if (prev) {
-				prev->next = driver->next;
-			} else {
-				available_drivers = driver->next;
-			}
-			driver->device = dev;
-			driver->next = NULL;
-			dev->drivers = driver;
-			return;
-		}
-		prev = driver;
-	}
+	if (offer_drivers(dev, 0, dev->enumbuf->buffer + 9, dev->enumbuf->len - 9,
+	  dev->bDeviceClass, dev->bDeviceSubClass, dev->bDeviceProtocol)) return;
 	// parse interfaces from config descriptor
-	const uint8_t *p = enumbuf + 9;
-	const uint8_t *end = enumbuf + enumlen;
-	while (p < end) {
+	const uint8_t *p = dev->enumbuf->buffer + 9;
+	const uint8_t *end = dev->enumbuf->buffer + dev->enumbuf->len;
+	while (p + 2 <= end) {
 		uint8_t desclen = *p;
 		uint8_t desctype = *(p+1);
+		if (desclen < 2 || p + desclen > end) break;
 		print("Descriptor ");
 		print(desctype);
 		print(" = ");
@@ -405,39 +875,60 @@ void USBHost::claim_drivers(Device_t *dev)
 		else if (desctype == 33) println("HID");
 		else println(" ???");
 		if (desctype == 11 && desclen == 8) {
-			// TODO: parse IAD, ask drivers for claim
-			// TODO: how to skip over all interfaces IAD represented
+			// found an IAD, offer its group of interfaces together,
+			// or one at a time below if no driver wants them all
+			const uint8_t *next = interfaces_end(p, end, p[2], p[3]);
+			if (offer_drivers(dev, 2, p, next - p, p[4], p[5], p[6])) {
+				p = next;
+				continue;
+			}
 		}
 		if (desctype == 4 && desclen == 9) {
 			// found an interface, ask available drivers if they want it
-			prev = NULL;
-			for (driver=available_drivers; driver != NULL; driver = driver->next) {
-				if (driver->device != NULL) continue;
-				// TODO: should parse ahead and give claim()
-				// an accurate length.  (end - p) is the rest
-				// of ALL descriptors, likely more interfaces
-				// this driver has no business parsing
-				if (driver->claim(dev, 1, p, end - p)) {
-					// this driver claims iface
-					// remove it from available_drivers list
-					if (prev) {
-						prev->next = driver->next;
-					} else {
-						available_drivers = driver->next;
-					}
-					// add to list of drivers using this device
-					driver->next = dev->drivers;
-					dev->drivers = driver;
-					driver->device = dev;
-					// not done, may be more interface for more drivers
-				}
-				prev = driver;
-			}
+			const uint8_t *next = interfaces_end(p, end, p[2], 1);
+			offer_drivers(dev, 1, p, next - p, p[5], p[6], p[7]);
+			// not done, may be more interface for more drivers
+			p = next;
+			continue;
 		}
 		p += desclen;
 	}
 }
 
+// Offer a device (type 0), interface (type 1) or IAD group (type 2) to the
+// available drivers whose match table lists it, or which have no table.
+// The first to claim it is moved to the device's list of drivers.
+//
+bool USBHost::offer_drivers(Device_t *dev, int type, const uint8_t *descriptors,
+	uint32_t len, uint32_t cls, uint32_t subclass, uint32_t protocol)
+{
+	USBDriver *driver, *prev=NULL;
+	const usb_match_t *matches[MATCH_RESULTS];
+	uint32_t num_matches = match_lookup(type, dev, cls, subclass, protocol, matches);
+
+	for (driver=available_drivers; driver != NULL; prev = driver, driver = driver->next) {
+		if (driver->device != NULL) continue;
+		if (!match_offered(driver->match_table, matches, num_matches)) continue;
+		uint32_t failures = pipe_failures();
+		bool claimed = driver->claim(dev, type, descriptors, len);
+		driver->alloc_failures += (uint16_t)(pipe_failures() - failures);
+		if (claimed) {
+			// remove it from available_drivers list
+			if (prev) {
+				prev->next = driver->next;
+			} else {
+				available_drivers = driver->next;
+			}
+			// add to list of drivers using this device
+			driver->next = dev->drivers;
+			dev->drivers = driver;
+			driver->device = dev;
+			return true;
+		}
+	}
+	return false;
+}
+
 static bool address_in_use(uint32_t addr)
 {
 	for (Device_t *p = devlist; p; p = p->next) {
@@ -498,6 +989,7 @@ void USBHost::disconnect_Device(Device_t *dev)
 		p = next;
 	}
 	delete_Pipe(dev->control_pipe);
+	enumeration_release(dev, true);
 
 	// remove device from devlist and free its Device_t
 	Device_t *prev_dev = NULL;
@@ -520,3 +1012,97 @@ void USBHost::disconnect_Device(Device_t *dev)
 }
 
 
+
+
+// Transfer statistics snapshots.  Devices may connect or disconnect
+// at any time, so the USB interrupt is disabled while the device list
+// is walked, once, giving a consistent snapshot of all devices.
+
+static Pipe_t * next_device_pipe(Device_t *dev, Pipe_t *pipe)
+{
+	return (pipe == dev->control_pipe) ? dev->data_pipes : pipe->next;
+}
+
+uint32_t USBHost::getPipeStats(pipe_stats_t *list, uint32_t max)
+{
+	uint32_t count = 0;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	for (Device_t *dev = devlist; dev; dev = dev->next) {
+		for (Pipe_t *pipe = dev->control_pipe; pipe; pipe = next_device_pipe(dev, pipe)) {
+			if (count < max) {
+				pipe_stats_t *s = list + count;
+				s->pipe = pipe;
+				s->address = dev->address;
+				s->endpoint = (pipe->qh.capabilities[0] >> 8) & 15;
+				if (pipe->type != 0 && pipe->direction) s->endpoint |= 0x80;
+				s->type = pipe->type;
+				s->queued = (pipe->type == 1) ? pipe->iso_pending : pipe->stat_queued;
+				s->max_queued = pipe->stat_max_queued;
+				s->errors = pipe->stat_errors;
+				s->transfers = pipe->stat_transfers;
+				s->bytes = pipe->stat_bytes;
+				if (pipe->type == 1 || pipe->type == 3) {
+					uint32_t fs = (dev->speed < 2) ? 8 : 1;
+					s->interval = pipe->bandwidth_interval * fs;
+					s->uframe = pipe->bandwidth_offset * fs + pipe->bandwidth_shift;
+				} else {
+					s->interval = 0;
+					s->uframe = 0;
+				}
+				s->start_mask = pipe->start_mask;
+				s->complete_mask = pipe->complete_mask;
+				s->stime = pipe->bandwidth_stime;
+				s->ctime = pipe->bandwidth_ctime;
+			}
+			count++;
+		}
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return count;
+}
+
+uint32_t USBHost::getDeviceStats(device_stats_t *list, uint32_t max)
+{
+	uint32_t count = 0;
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	for (Device_t *dev = devlist; dev; dev = dev->next) {
+		if (count < max) {
+			device_stats_t *s = list + count;
+			s->device = dev;
+			s->address = dev->address;
+			s->speed = dev->speed;
+			s->idVendor = dev->idVendor;
+			s->idProduct = dev->idProduct;
+			s->num_pipes = 0;
+			s->errors = 0;
+			s->transfers = 0;
+			s->bytes = 0;
+			for (Pipe_t *pipe = dev->control_pipe; pipe; pipe = next_device_pipe(dev, pipe)) {
+				s->num_pipes++;
+				s->errors += pipe->stat_errors;
+				s->transfers += pipe->stat_transfers;
+				s->bytes += pipe->stat_bytes;
+			}
+		}
+		count++;
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return count;
+}
+
+void USBHost::clearStats()
+{
+	bool irq_was_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	for (Device_t *dev = devlist; dev; dev = dev->next) {
+		for (Pipe_t *pipe = dev->control_pipe; pipe; pipe = next_device_pipe(dev, pipe)) {
+			pipe->stat_bytes = 0;
+			pipe->stat_transfers = 0;
+			pipe->stat_errors = 0;
+			pipe->stat_max_queued = pipe->stat_queued;
+		}
+	}
+	if (irq_was_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
@@ -0,0 +1,88 @@
+// Measure how long a tree of hubs and devices takes to enumerate.
+//
+// Plug in a hub with several devices already connected (or power up
+// with them connected).  When no more devices are enumerating, this
+// sketch prints how many were configured, the total time from the
+// first device detected until the last was configured, how many
+// enumerated at the same time, and the slowest single device.
+//
+// Send "r" in the Arduino Serial Monitor to restart the measurement
+// before connecting the next group of devices.  Compare results with
+// the default USBHOST_ENUMERATION_BUFFERS of 1 (one device at a time)
+// and larger settings in USBHost_t36.h.
+//
+// Config and HID report descriptors are kept in a descriptor cache, so
+// devices connected a second time need fewer requests.  Send "c" to
+// clear the cache, to compare.
+//
+// Send "f" to turn fast attach on or off (see USBHOST_FAST_ATTACH).
+// The time each step took for the latest device is printed, to see
+// where the time goes.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+USBHub hub1(myusb);
+USBHub hub2(myusb);
+USBHub hub3(myusb);
+USBHub hub4(myusb);
+KeyboardController keyboard1(myusb);
+KeyboardController keyboard2(myusb);
+MouseController mouse1(myusb);
+JoystickController joystick1(myusb);
+USBHIDParser hid1(myusb);
+USBHIDParser hid2(myusb);
+USBHIDParser hid3(myusb);
+USBHIDParser hid4(myusb);
+USBSerial userial1(myusb);
+USBSerial userial2(myusb);
+MIDIDevice midi1(myusb);
+USBDrive drive1(myusb);
+
+uint32_t descriptor_cache[1024];
+uint16_t reported = 0;
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host enumeration benchmark");
+  Serial.printf("%u devices may enumerate at once\n", USBHOST_ENUMERATION_BUFFERS);
+  myusb.setDescriptorCache(descriptor_cache, sizeof(descriptor_cache));
+  myusb.begin();
+}
+
+void loop()
+{
+  myusb.Task();
+  if (Serial.available()) {
+    int c = Serial.read();
+    if (c == 'r') {
+      myusb.resetEnumerationStats();
+      reported = 0;
+      Serial.println("restarted");
+    } else if (c == 'c') {
+      myusb.clearDescriptorCache();
+      Serial.println("descriptor cache cleared");
+    } else if (c == 'f') {
+      myusb.setFastAttach(!myusb.fastAttach());
+      Serial.printf("fast attach %s\n", myusb.fastAttach() ? "on" : "off");
+    }
+  }
+  enumeration_stats_t stats;
+  myusb.getEnumerationStats(stats);
+  if (stats.active == 0 && stats.configured != reported) {
+    reported = stats.configured;
+    Serial.printf("%u devices configured in %u ms, %u at once, slowest %u ms",
+      stats.configured, stats.bringup_micros / 1000, stats.max_active,
+      stats.max_micros / 1000);
+    if (stats.cached) Serial.printf(", %u descriptors cached", stats.cached);
+    if (stats.failures) Serial.printf(", %u failed", stats.failures);
+    Serial.println();
+    const enumeration_times_t &t = stats.last;
+    Serial.printf("  last device (us): debounce %u, reset %u, address %u, device %u, "
+      "strings %u, config %u, configure %u\n", t.debounce, t.reset, t.address,
+      t.device, t.strings, t.config, t.configure);
+  }
+}
@@ -0,0 +1,129 @@
+// Measure how interrupt coalescing changes the CPU time used by a
+// fast USB bulk IN stream.
+//
+// Connect a device which sends data continuously on a CDC serial
+// data interface, for example another Teensy running:
+//
+//   void loop() { Serial.write(buf, sizeof(buf)); }
+//
+// Every second this sketch prints the received speed, the number of
+// completed transfers, and how many times loop() ran.  Fewer
+// interrupts leave more time for loop().  In the Arduino Serial
+// Monitor, send "t8" to set the interrupt threshold to 8 microframes
+// (0 to 64), or "e8" to request an interrupt for only every 8th
+// transfer, using TRANSFER_NO_INTERRUPT for the others.
+//
+// Higher thresholds add latency to every USB device, while
+// TRANSFER_NO_INTERRUPT only affects this stream.  If the threshold
+// is longer than the time needed to fill all DEPTH transfers, the
+// stream slows down.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+#define DEPTH  16
+
+class CoalesceBenchmark : public USBDriver {
+public:
+  CoalesceBenchmark(USBHost &host) {
+    contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+    contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+    driver_ready_for_device(this);
+  }
+  bool ready() { return rxpipe != nullptr; }
+  void start() {
+    if (started) return;
+    for (uint32_t i=0; i < DEPTH; i++) queue(i);
+    started = true;
+  }
+  void setInterruptEvery(uint32_t n) { every = (n > 0 && n <= DEPTH) ? n : 1; }
+  uint32_t interruptEvery() { return every; }
+  volatile uint32_t transfers = 0;
+  volatile uint32_t bytes = 0;
+protected:
+  virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+    if (type != 1) return false;
+    const uint8_t *p = descriptors;
+    const uint8_t *end = p + len;
+    if (p[0] != 9 || p[1] != 4 || p[5] != 10) return false; // CDC Data
+    for (p += 9; p + 7 <= end && p[0] >= 2; p += p[0]) {
+      if (p[1] == 5 && p[3] == 2 && (p[2] & 0x80)) {
+        rxsize = p[4] | (p[5] << 8);
+        if (rxsize > sizeof(buffer[0])) return false;
+        rxpipe = new_Pipe(dev, 2, p[2] & 15, 1, rxsize);
+        if (!rxpipe) return false;
+        rxpipe->callback_function = rx_callback;
+        started = false;
+        return true;
+      }
+    }
+    return false;
+  }
+  virtual void disconnect() {
+    rxpipe = nullptr;
+  }
+  static void rx_callback(const Transfer_t *transfer) {
+    if (transfer->driver) ((CoalesceBenchmark *)(transfer->driver))->rx_data(transfer);
+  }
+  void rx_data(const Transfer_t *transfer) {
+    transfers++;
+    bytes += transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+    queue((uint8_t (*)[512])transfer->buffer - buffer);
+  }
+  void queue(uint32_t i) {
+    uint32_t flags = (++count % every == 0) ? 0 : TRANSFER_NO_INTERRUPT;
+    queue_Data_Transfer(rxpipe, buffer[i], rxsize, this, flags);
+  }
+  Pipe_t *rxpipe = nullptr;
+  uint32_t rxsize = 0;
+  uint32_t every = 1;
+  uint32_t count = 0;
+  bool started = false;
+  Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+  Transfer_t mytransfers[DEPTH + 4] __attribute__ ((aligned(32)));
+  uint8_t buffer[DEPTH][512] __attribute__ ((aligned(32)));
+};
+
+USBHost myusb;
+USBHub hub1(myusb);
+CoalesceBenchmark bench(myusb);
+
+uint32_t threshold = USBHOST_INTERRUPT_THRESHOLD;
+uint32_t loops = 0;
+uint32_t prev_transfers = 0;
+uint32_t prev_bytes = 0;
+elapsedMillis msec;
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host interrupt coalescing benchmark");
+  myusb.begin();
+}
+
+void loop()
+{
+  myusb.Task();
+  loops++;
+  if (bench.ready()) bench.start();
+  if (Serial.available()) {
+    int c = Serial.read();
+    if (c == 't') {
+      threshold = Serial.parseInt();
+      myusb.setInterruptThreshold(threshold);
+    } else if (c == 'e') {
+      bench.setInterruptEvery(Serial.parseInt());
+    }
+  }
+  if (msec >= 1000) {
+    msec -= 1000;
+    uint32_t transfers = bench.transfers - prev_transfers;
+    uint32_t bytes = bench.bytes - prev_bytes;
+    prev_transfers += transfers;
+    prev_bytes += bytes;
+    Serial.printf("threshold=%u every=%u: %u KB/s, %u transfers, %u loops\n",
+      threshold, bench.interruptEvery(), bytes / 1024, transfers, loops);
+    loops = 0;
+  }
+}
@@ -0,0 +1,108 @@
+// Show which USB pipes are busiest, like the "top" program.
+//
+// Once per second, a snapshot of every pipe's transfer statistics is
+// compared with the previous second, and the pipes are listed by the
+// number of bytes they moved.  Connect any USB devices, through hubs
+// if you like, and use them normally while this runs.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+#define MAX_PIPES  40
+#define MAX_SHOW   12
+
+USBHost myusb;
+USBHub hub1(myusb);
+USBHub hub2(myusb);
+KeyboardController keyboard1(myusb);
+MouseController mouse1(myusb);
+USBHIDParser hid1(myusb);
+USBHIDParser hid2(myusb);
+USBSerial userial(myusb);
+MIDIDevice midi1(myusb);
+
+pipe_stats_t now[MAX_PIPES];
+pipe_stats_t before[MAX_PIPES];
+uint32_t num_before = 0;
+elapsedMillis msec;
+
+const char *type_name[4] = {"ctrl", "iso", "bulk", "intr"};
+
+// find the same pipe in the previous snapshot
+const pipe_stats_t * previous(const pipe_stats_t *p)
+{
+  for (uint32_t i=0; i < num_before; i++) {
+    if (before[i].pipe == p->pipe) return &before[i];
+  }
+  return nullptr;
+}
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host pipe statistics");
+  myusb.begin();
+}
+
+void loop()
+{
+  myusb.Task();
+  if (msec < 1000) return;
+  msec -= 1000;
+
+  uint32_t num = USBHost::getPipeStats(now, MAX_PIPES);
+  if (num > MAX_PIPES) num = MAX_PIPES;
+  // bytes, transfers and errors during the last second
+  uint32_t rate_bytes[MAX_PIPES], rate_transfers[MAX_PIPES];
+  uint32_t rate_errors[MAX_PIPES], order[MAX_PIPES];
+  for (uint32_t i=0; i < num; i++) {
+    const pipe_stats_t *p = previous(&now[i]);
+    rate_bytes[i] = now[i].bytes - (p ? p->bytes : 0);
+    rate_transfers[i] = now[i].transfers - (p ? p->transfers : 0);
+    rate_errors[i] = now[i].errors - (p ? p->errors : 0);
+    order[i] = i;
+  }
+  // sort busiest first
+  for (uint32_t i=1; i < num; i++) {
+    uint32_t n = order[i];
+    uint32_t j = i;
+    while (j > 0 && rate_bytes[order[j-1]] < rate_bytes[n]) {
+      order[j] = order[j-1];
+      j--;
+    }
+    order[j] = n;
+  }
+
+  device_stats_t devs[8];
+  uint32_t num_devs = USBHost::getDeviceStats(devs, 8);
+  Serial.printf("\n%u devices, %u pipes\n", num_devs, num);
+  // memory pools: how many are free now, fewest ever free, and failures
+  const char *pool_name[USBHost::POOL_COUNT] = {"Device", "Pipe", "Transfer", "String", "Isochronous", "DMA lines"};
+  for (uint32_t i=0; i < USBHost::POOL_COUNT; i++) {
+    pool_stats_t pool;
+    USBHost::poolStats(i, pool);
+    Serial.printf("%s %u/%u low %u fail %u   ", pool_name[i], pool.available,
+      pool.total, pool.low_water, pool.failures);
+  }
+  Serial.println();
+  // periodic schedule: busiest microframe, and how much more it can take
+  periodic_stats_t periodic;
+  USBHost::getPeriodicStats(periodic);
+  Serial.printf("Periodic: %u pipes, busiest uframe %u/%u (%u left), average %u, %u refused, "
+    "%u TTs, busiest TT frame %u us, %u over TT count\n",
+    periodic.pipes, periodic.max_load, periodic.limit, periodic.available,
+    periodic.total_load / periodic.uframes, periodic.failures,
+    periodic.tts, periodic.tt_max_load, periodic.tt_overflows);
+  Serial.println("addr  ep  type   bytes/s  xfers/s  err/s  queued  max  total bytes");
+  for (uint32_t i=0; i < num && i < MAX_SHOW; i++) {
+    const pipe_stats_t *p = &now[order[i]];
+    Serial.printf("%4u  %02X  %-4s  %8u  %7u  %5u  %6u  %3u  %u\n",
+      p->address, p->endpoint, type_name[p->type & 3], rate_bytes[order[i]],
+      rate_transfers[order[i]], rate_errors[order[i]], p->queued,
+      p->max_queued, p->bytes);
+  }
+
+  memcpy(before, now, sizeof(pipe_stats_t) * num);
+  num_before = num;
+}
@@ -0,0 +1,86 @@
+// Measure the CPU time needed to queue a USB transfer, as the
+// number of transfers already pending on the same pipe grows.
+//
+// Connect a USB flash drive (or any Mass Storage device) to the
+// USB host port.  This sketch uses its bulk IN endpoint without
+// sending any SCSI command, so the drive simply answers NAK and
+// every transfer queued remains pending.  Queuing cost should be
+// the same regardless of how many transfers are already waiting.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+#define MAX_DEPTH  32
+
+class QueueBenchmark : public USBDriver {
+public:
+  QueueBenchmark(USBHost &host) {
+    contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+    contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+    driver_ready_for_device(this);
+  }
+  bool ready() { return rxpipe != nullptr && !done; }
+  void run() {
+    Serial.println("depth  cycles  nanoseconds");
+    for (uint32_t depth=0; depth < MAX_DEPTH; depth++) {
+      uint32_t begin = ARM_DWT_CYCCNT;
+      bool ok = queue_Data_Transfer(rxpipe, buffer[depth], rxsize, this);
+      uint32_t cycles = ARM_DWT_CYCCNT - begin;
+      if (!ok) {
+        Serial.println("queue_Data_Transfer failed");
+        break;
+      }
+      Serial.printf("%5u  %6u  %11u\n", depth, cycles,
+        (uint32_t)((uint64_t)cycles * 1000000000 / F_CPU));
+    }
+    Serial.println("Done. Unplug the drive to run again.");
+    done = true;
+  }
+protected:
+  virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+    if (type != 1) return false;
+    const uint8_t *p = descriptors;
+    const uint8_t *end = p + len;
+    if (p[0] != 9 || p[1] != 4 || p[5] != 8) return false; // Mass Storage
+    for (p += 9; p + 7 <= end && p[0] >= 2; p += p[0]) {
+      if (p[1] == 5 && p[3] == 2 && (p[2] & 0x80)) {
+        rxsize = p[4] | (p[5] << 8);
+        if (rxsize > sizeof(buffer[0])) return false;
+        rxpipe = new_Pipe(dev, 2, p[2] & 15, 1, rxsize);
+        if (!rxpipe) return false;
+        done = false;
+        return true;
+      }
+    }
+    return false;
+  }
+  virtual void disconnect() {
+    rxpipe = nullptr;
+  }
+  Pipe_t *rxpipe = nullptr;
+  uint32_t rxsize = 0;
+  bool done = false;
+  Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+  Transfer_t mytransfers[MAX_DEPTH + 2] __attribute__ ((aligned(32)));
+  uint8_t buffer[MAX_DEPTH][512];
+};
+
+USBHost myusb;
+USBHub hub1(myusb);
+QueueBenchmark bench(myusb);
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host queue depth benchmark");
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+}
+
+void loop()
+{
+  myusb.Task();
+  if (bench.ready()) bench.run();
+}
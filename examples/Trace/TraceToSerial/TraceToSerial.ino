@@ -0,0 +1,51 @@
+// Stream the USB Host binary transfer trace to a computer, to
+// view in Wireshark.
+//
+// First uncomment "#define USBHOST_TRACE" in USBHost_t36.h.  Then
+// on Linux or MacOS, with no Serial Monitor open, run:
+//
+//   python3 extras/usbtrace2pcap.py /dev/ttyACM0 trace.pcap
+//
+// Use the USB devices, press Ctrl-C to stop, and open trace.pcap in
+// Wireshark.  The output is binary, so don't use the Serial Monitor.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+#ifndef USBHOST_TRACE
+#error "Please uncomment #define USBHOST_TRACE in USBHost_t36.h"
+#endif
+
+USBHost myusb;
+USBHub hub1(myusb);
+USBHub hub2(myusb);
+KeyboardController keyboard1(myusb);
+MouseController mouse1(myusb);
+USBHIDParser hid1(myusb);
+USBHIDParser hid2(myusb);
+USBSerial userial(myusb);
+MIDIDevice midi1(myusb);
+
+trace_event_t events[32];
+
+void setup()
+{
+  while (!Serial) ; // wait for the computer to open the port
+#if defined(__IMXRT1062__)
+  uint32_t hz = F_CPU_ACTUAL;
+#else
+  uint32_t hz = F_CPU;
+#endif
+  // 16 byte header: magic, size of each event, cycles per second
+  uint32_t header[4] = {0x54425355, 0x45434152, sizeof(trace_event_t), hz};
+  Serial.write((const uint8_t *)header, sizeof(header)); // "USBTRACE"
+  myusb.begin();
+}
+
+void loop()
+{
+  myusb.Task();
+  uint32_t n = USBHost::readTrace(events, sizeof(events) / sizeof(events[0]));
+  if (n > 0) Serial.write((const uint8_t *)events, n * sizeof(trace_event_t));
+}
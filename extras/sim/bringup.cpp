@@ -0,0 +1,85 @@
+// Connect a simulated CDC serial device several times, and print how
+// long each step of enumeration took.  The descriptor cache is enabled,
+// so connects after the first read only the config descriptor's first 9
+// bytes, and the rest from the cache.  Then a damaged copy of the saved
+// cache is restored, which must fall back to reading the descriptors from
+// the device.  Last the device reports a new bcdDevice, and then a config
+// with a different bMaxPower, which must not use the cached descriptors.
+//
+//   ./build/bringup [fast] [iad]
+//
+// fast:  USBHost::setFastAttach(true), shorter debounce and reset timing
+// iad:   the serial port is one function of a composite (IAD) device
+//
+// This file is in the public domain
+
+#include "cdc_device.h"
+
+USBHost myusb;
+USBSerial_BigBuffer userial(myusb);
+
+static uint32_t cache[256];
+static uint32_t saved[256];
+static uint8_t changed_config[sizeof(iad_config_desc)];
+static uint32_t cached = 0;
+
+static bool connect(EHCISimDevice *device, const char *name)
+{
+	USBHost::resetEnumerationStats();
+	uint32_t start = micros();
+	ehci_sim_connect(device);
+	for (int i=0; i < 20000 && !userial; i++) {
+		ehci_sim_run(100);
+		myusb.Task();
+	}
+	enumeration_stats_t es;
+	USBHost::getEnumerationStats(es);
+	cached = es.cached;
+	const enumeration_times_t &t = es.last;
+	printf("%s: %s in %u us, cached descriptors %u\n", name,
+		userial ? "configured" : "NOT CONFIGURED", micros() - start, es.cached);
+	printf("  debounce=%u reset=%u address=%u device=%u strings=%u config=%u configure=%u\n",
+		t.debounce, t.reset, t.address, t.device, t.strings, t.config, t.configure);
+	printf("  enumeration after reset: %u us\n",
+		t.address + t.device + t.strings + t.config + t.configure);
+	bool ok = userial;
+	ehci_sim_disconnect();
+	for (int i=0; i < 20; i++) {
+		ehci_sim_run(1000);
+		myusb.Task();
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+	bool fast = false, composite = false;
+	for (int i=1; i < argc; i++) {
+		if (strcmp(argv[i], "fast") == 0) fast = true;
+		if (strcmp(argv[i], "iad") == 0) composite = true;
+	}
+	static CDCSimDevice device(composite);
+	USBHost::setDescriptorCache(cache, sizeof(cache));
+	USBHost::setFastAttach(fast);
+	myusb.begin();
+	bool ok = connect(&device, "first connect");
+	ok &= connect(&device, "reconnect");
+	memcpy(saved, cache, sizeof(saved));
+	USBHost::setDescriptorCache(saved, sizeof(saved), true);
+	printf("restored %u bytes of saved cache\n", USBHost::descriptorCacheUsed());
+	ok &= connect(&device, "restored cache");
+	memcpy(saved, cache, sizeof(saved));
+	((uint8_t *)saved)[40] ^= 1;
+	USBHost::setDescriptorCache(saved, sizeof(saved), true);
+	printf("damaged cache, %u bytes kept\n", USBHost::descriptorCacheUsed());
+	ok &= connect(&device, "damaged cache");
+	cdc_device_desc[12]++; // new bcdDevice, cached descriptors must not be used
+	ok &= connect(&device, "new bcdDevice") && cached == 0;
+	const uint8_t *config = composite ? iad_config_desc : cdc_config_desc;
+	memcpy(changed_config, config, config[2]);
+	changed_config[8] = 100; // same length, different header
+	static EHCISimDevice changed(cdc_device_desc, changed_config, 2);
+	ok &= connect(&changed, "changed config") && cached == 0;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+// A simulated CDC ACM serial device (Teensy USB Serial), for the
+// scenario programs.  It streams a counting pattern on bulk IN endpoint
+// 4 when asked, and can instead describe itself as a composite device
+// using an Interface Association Descriptor.
+//
+// This file is in the public domain
+
+#ifndef CDC_DEVICE_H_
+#define CDC_DEVICE_H_
+
+#include <Arduino.h>
+#include "USBHost_t36.h"
+
+static uint8_t cdc_device_desc[18] = {
+	18, 1, 0x00, 0x02, 2, 0, 0, 64, // CDC class, 64 byte ep0
+	0xC0, 0x16, 0x83, 0x04, 0x00, 0x01, 1, 2, 3, 1 // VID 16C0, PID 0483
+};
+
+static const uint8_t cdc_config_desc[] = {
+	9, 2, 67, 0, 2, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 1, 2, 2, 1, 0,      // communication interface
+	5, 0x24, 0, 0x10, 1,            // header
+	5, 0x24, 1, 1, 1,               // call management
+	4, 0x24, 2, 6,                  // ACM
+	5, 0x24, 6, 0, 1,               // union
+	7, 5, 0x82, 3, 16, 0, 64,       // notification, interrupt IN
+	9, 4, 1, 0, 2, 10, 0, 0, 0,     // data interface
+	7, 5, 0x03, 2, 0x00, 0x02, 0,   // bulk OUT, 512 bytes
+	7, 5, 0x84, 2, 0x00, 0x02, 0,   // bulk IN, 512 bytes
+};
+
+// The same serial port as one function of a composite device, with a
+// vendor specific interface after it
+static const uint8_t iad_config_desc[] = {
+	9, 2, 84, 0, 3, 1, 0, 0xC0, 50,
+	8, 11, 0, 2, 2, 2, 1, 0,        // IAD: interfaces 0-1, CDC ACM
+	9, 4, 0, 0, 1, 2, 2, 1, 0,
+	5, 0x24, 0, 0x10, 1,
+	5, 0x24, 1, 1, 1,
+	4, 0x24, 2, 6,
+	5, 0x24, 6, 0, 1,
+	7, 5, 0x82, 3, 16, 0, 64,
+	9, 4, 1, 0, 2, 10, 0, 0, 0,
+	7, 5, 0x03, 2, 0x00, 0x02, 0,
+	7, 5, 0x84, 2, 0x00, 0x02, 0,
+	9, 4, 2, 0, 0, 0xFF, 0, 0, 0,   // vendor interface, no endpoints
+};
+
+class CDCSimDevice : public EHCISimDevice
+{
+public:
+	CDCSimDevice(bool composite = false) : EHCISimDevice(cdc_device_desc,
+		composite ? iad_config_desc : cdc_config_desc, 2) {
+		if (composite) {
+			cdc_device_desc[4] = 0xEF; // miscellaneous, IAD
+			cdc_device_desc[5] = 2;
+			cdc_device_desc[6] = 1;
+		}
+	}
+	// Send count bytes of 0, 1, 2 ... 250, 0, 1 ...
+	void stream(uint32_t count) { stream_left = count; }
+	uint32_t stream_left = 0;
+	bool nak_out = false; // NAK all data on bulk OUT endpoint 3
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (endpoint == 3 && nak_out) return EHCI_SIM_NAK;
+		return EHCISimDevice::out(endpoint, buf, len);
+	}
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint != 4 || stream_left == 0) {
+			return EHCISimDevice::in(endpoint, buf, maxlen);
+		}
+		uint32_t n = (maxlen < stream_left) ? maxlen : stream_left;
+		for (uint32_t i=0; i < n; i++) {
+			buf[i] = stream_seq;
+			stream_seq = (stream_seq == 250) ? 0 : stream_seq + 1;
+		}
+		stream_left -= n;
+		return n;
+	}
+private:
+	uint8_t stream_seq = 0;
+};
+
+// The next byte of the stream pattern
+static inline uint8_t cdc_stream_next(uint8_t n)
+{
+	return (n == 250) ? 0 : n + 1;
+}
+
+#endif
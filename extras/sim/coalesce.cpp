@@ -0,0 +1,149 @@
+// Measure how interrupt coalescing changes the number of interrupts,
+// the completion latency and the speed of a fast bulk IN stream.  Like
+// examples/Benchmark/Coalesce, 16 transfers of 512 bytes are kept queued
+// on a CDC data interface, here a simulated device which has a 512 byte
+// packet ready every 125 us (4 MB/sec), or always with 0.  Latency is from the device
+// sending a transfer's packet until its callback runs.  Task() runs
+// every 10 us, like a sketch with a short loop().
+//
+// The simulator runs each microframe's transactions at its start, and
+// raises the interrupt at the same instant, so interrupt latency is
+// only resolved to whole microframes (125 us).  0 means the same
+// microframe; on hardware that is anywhere up to 125 us.
+//
+//   ./build/coalesce [microseconds per packet]
+//
+// This file is in the public domain
+
+#include "cdc_device.h"
+
+#define DEPTH  16
+
+// Sends 512 bytes on endpoint 4 every packet_micros, and remembers when
+// each packet was sent.  Each transfer is one packet, so they complete
+// in this order.
+class FastDevice : public CDCSimDevice
+{
+public:
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint != 4) return CDCSimDevice::in(endpoint, buf, maxlen);
+		uint32_t now = micros();
+		if (sent > 0 && now - sent_micros[(sent - 1) % 64] < packet_micros) {
+			return EHCI_SIM_NAK;
+		}
+		memset(buf, 0, maxlen);
+		sent_micros[sent++ % 64] = now;
+		return maxlen;
+	}
+	uint32_t packet_micros = 125;
+	uint32_t sent = 0;
+	uint32_t sent_micros[64];
+};
+
+class CoalesceBenchmark : public USBDriver
+{
+public:
+	CoalesceBenchmark(USBHost &host) {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+		driver_ready_for_device(this);
+	}
+	bool ready() { return rxpipe != nullptr; }
+	void start() {
+		for (uint32_t i=0; i < DEPTH; i++) queue(i);
+	}
+	void setInterruptEvery(uint32_t n) { every = n; }
+	FastDevice *device = nullptr;
+	uint32_t transfers = 0;
+	uint32_t bytes = 0;
+	uint32_t latency_sum = 0;
+	uint32_t latency_max = 0;
+protected:
+	virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		if (type != 1 || descriptors[5] != 10) return false; // CDC Data
+		rxpipe = new_Pipe(dev, 2, 4, 1, 512);
+		if (!rxpipe) return false;
+		rxpipe->callback_function = rx_callback;
+		return true;
+	}
+	virtual void disconnect() {
+		rxpipe = nullptr;
+	}
+	static void rx_callback(const Transfer_t *transfer) {
+		if (transfer->driver) ((CoalesceBenchmark *)(transfer->driver))->rx_data(transfer);
+	}
+	void rx_data(const Transfer_t *transfer) {
+		uint32_t latency = micros() - device->sent_micros[completed++ % 64];
+		latency_sum += latency;
+		if (latency > latency_max) latency_max = latency;
+		transfers++;
+		bytes += transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+		queue((uint8_t (*)[512])transfer->buffer - buffer);
+	}
+	void queue(uint32_t i) {
+		uint32_t flags = (++count % every == 0) ? 0 : TRANSFER_NO_INTERRUPT;
+		queue_Data_Transfer(rxpipe, buffer[i], 512, this, flags);
+	}
+	Pipe_t *rxpipe = nullptr;
+	uint32_t every = 1;
+	uint32_t count = 0;
+	uint32_t completed = 0;
+	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[DEPTH + 4] __attribute__ ((aligned(32)));
+	uint8_t buffer[DEPTH][512] __attribute__ ((aligned(32)));
+};
+
+USBHost myusb;
+CoalesceBenchmark bench(myusb);
+FastDevice device;
+
+static void run(uint32_t usec)
+{
+	for (uint32_t i=0; i < usec; i += 10) {
+		ehci_sim_run(10);
+		myusb.Task();
+	}
+}
+
+static void measure(uint32_t threshold, uint32_t every)
+{
+	USBHost::setInterruptThreshold(threshold);
+	bench.setInterruptEvery(every);
+	run(10000); // settle
+	uint32_t transfers = bench.transfers, bytes = bench.bytes;
+	uint32_t irqs = ehci_sim_stats.interrupts;
+	bench.latency_sum = 0;
+	bench.latency_max = 0;
+	const uint32_t usec = 100000;
+	run(usec);
+	transfers = bench.transfers - transfers;
+	bytes = bench.bytes - bytes;
+	irqs = ehci_sim_stats.interrupts - irqs;
+	uint32_t avg = transfers ? bench.latency_sum / transfers : 0;
+	printf("threshold=%-2u every=%u: %5u KB/sec, %4u transfers, %4u interrupts, "
+		"latency avg %3u us (%4.1f uframes), max %3u us\n", threshold, every,
+		(uint32_t)((uint64_t)bytes * 1000000 / usec / 1024), transfers, irqs,
+		avg, avg / 125.0, bench.latency_max);
+}
+
+int main(int argc, char **argv)
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+	if (argc > 1) device.packet_micros = atoi(argv[1]);
+	bench.device = &device;
+	myusb.begin();
+	ehci_sim_connect(&device);
+	for (int i=0; i < 2000 && !bench.ready(); i++) run(1000);
+	if (!bench.ready()) {
+		printf("bulk IN pipe not created\n");
+		return 1;
+	}
+	bench.start();
+	printf("latency resolution: 1 microframe (125 us) for interrupts, "
+		"10 us for Task()\n");
+	measure(1, 1);
+	measure(8, 1);
+	measure(64, 1);
+	measure(1, 8);
+	return 0;
+}
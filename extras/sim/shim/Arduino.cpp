@@ -0,0 +1,96 @@
+// Minimal Arduino API for the simulated EHCI controller.  Time is the
+// simulator's time, and yield() lets the simulation run, because some
+// drivers busy wait for a response.
+//
+// This file is in the public domain
+
+#include <Arduino.h>
+#include <stdarg.h>
+
+uint32_t ehci_sim_micros(void);
+void ehci_sim_run(uint32_t microseconds);
+
+SimSerial Serial;
+
+uint32_t micros(void)
+{
+	return ehci_sim_micros();
+}
+
+uint32_t millis(void)
+{
+	return ehci_sim_micros() / 1000;
+}
+
+void delay(uint32_t msec)
+{
+	ehci_sim_run(msec * 1000);
+}
+
+void yield(void)
+{
+	ehci_sim_run(10);
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+	return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+void arm_dcache_flush(void *addr, uint32_t size) { }
+void arm_dcache_delete(void *addr, uint32_t size) { }
+void arm_dcache_flush_delete(void *addr, uint32_t size) { }
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+	size_t count = 0;
+	while (size--) count += write(*buffer++);
+	return count;
+}
+
+size_t Print::print(long n, int base)
+{
+	if (base == DEC) return printf("%ld", n);
+	return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+	return print((unsigned long long)n, base);
+}
+
+size_t Print::print(long long n, int base)
+{
+	if (base == DEC) return printf("%lld", n);
+	return print((unsigned long long)n, base);
+}
+
+size_t Print::print(unsigned long long n, int base)
+{
+	char buf[66], *p = buf + sizeof(buf) - 1;
+	if (base < 2) base = 10;
+	*p = 0;
+	do {
+		int digit = n % base;
+		*--p = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+		n /= base;
+	} while (n > 0);
+	return write(p);
+}
+
+size_t Print::print(double n, int digits)
+{
+	return printf("%.*f", digits, n);
+}
+
+int Print::printf(const char *format, ...)
+{
+	char buf[256];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	if (len < 0) return 0;
+	if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+	return write((const uint8_t *)buf, len);
+}
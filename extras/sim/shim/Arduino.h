@@ -0,0 +1,111 @@
+// Minimal Arduino API for building USBHost_t36 with the simulated EHCI
+// controller (utility/ehci_sim.h) on an ordinary computer.  Only what
+// the core files and the drivers used by the scenarios need is here.
+// Serial prints to stdout.
+//
+// This file is in the public domain
+
+#ifndef ARDUINO_SIM_H_
+#define ARDUINO_SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define PROGMEM
+#define DMAMEM
+#define FASTRUN
+#define F(s) (s)
+typedef bool boolean;
+
+uint32_t micros(void);
+uint32_t millis(void);
+void delay(uint32_t msec);
+void yield(void);
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+// No data cache on the host computer
+void arm_dcache_flush(void *addr, uint32_t size);
+void arm_dcache_delete(void *addr, uint32_t size);
+void arm_dcache_flush_delete(void *addr, uint32_t size);
+
+template <class T> T min(T a, T b) { return (a < b) ? a : b; }
+template <class T> T max(T a, T b) { return (a > b) ? a : b; }
+
+class Print
+{
+public:
+	virtual size_t write(uint8_t b) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size);
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+	size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+	virtual int availableForWrite(void) { return 0; }
+	virtual void flush() { }
+	size_t print(const char *s) { return write(s); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(int n, int base = DEC) { return print((long)n, base); }
+	size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+	size_t print(long n, int base = DEC);
+	size_t print(unsigned long n, int base = DEC);
+	size_t print(long long n, int base = DEC);
+	size_t print(unsigned long long n, int base = DEC);
+	size_t print(double n, int digits = 2);
+	size_t println(void) { return write('\n'); }
+	template <typename T> size_t println(T arg) { return print(arg) + println(); }
+	template <typename T> size_t println(T arg, int base) { return print(arg, base) + println(); }
+	int printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+};
+
+class Stream : public Print
+{
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+};
+
+// Serial writes to stdout, and never receives anything
+class SimSerial : public Stream
+{
+public:
+	void begin(uint32_t baud) { }
+	size_t write(uint8_t b) { return fputc(b, stdout) == EOF ? 0 : 1; }
+	size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+	using Print::write;
+	int available() { return 0; }
+	int read() { return -1; }
+	int peek() { return -1; }
+	operator bool() { return true; }
+};
+extern SimSerial Serial;
+
+class elapsedMicros
+{
+public:
+	elapsedMicros(void) { us = micros(); }
+	elapsedMicros(uint32_t val) { us = micros() - val; }
+	operator uint32_t() const { return micros() - us; }
+	elapsedMicros & operator = (uint32_t val) { us = micros() - val; return *this; }
+private:
+	uint32_t us;
+};
+
+class elapsedMillis
+{
+public:
+	elapsedMillis(void) { ms = millis(); }
+	elapsedMillis(uint32_t val) { ms = millis() - val; }
+	operator uint32_t() const { return millis() - ms; }
+	elapsedMillis & operator = (uint32_t val) { ms = millis() - val; return *this; }
+private:
+	uint32_t ms;
+};
+
+#endif
@@ -0,0 +1,55 @@
+// Stub of the Teensy FS.h File and FS classes, enough for USBHost_t36.h
+// to compile.  The simulator has no filesystem drivers.
+//
+// This file is in the public domain
+
+#ifndef FS_H
+#define FS_H
+
+#include <Arduino.h>
+
+#define FILE_READ  0
+#define FILE_WRITE 1
+#define FILE_WRITE_BEGIN 2
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+typedef struct {
+	uint8_t sec, min, hour, wday, mday, mon;
+	uint16_t year;
+} DateTimeFields;
+
+class FileImpl
+{
+public:
+	virtual ~FileImpl() { }
+};
+
+class File : public Stream
+{
+public:
+	File() { }
+	File(FileImpl *f) { }
+	operator bool() { return false; }
+	size_t write(uint8_t b) { return 0; }
+	size_t write(const void *buf, size_t size) { return 0; }
+	int available() { return 0; }
+	int read() { return -1; }
+	int peek() { return -1; }
+	size_t read(void *buf, size_t nbyte) { return 0; }
+	bool seek(uint64_t pos, int mode = SeekSet) { return false; }
+	uint64_t position() { return 0; }
+	uint64_t size() { return 0; }
+	void close() { }
+};
+
+class FS
+{
+public:
+	virtual ~FS() { }
+	File open(const char *filename, uint8_t mode = FILE_READ) { return File(); }
+	bool exists(const char *filepath) { return false; }
+	bool remove(const char *filepath) { return false; }
+};
+
+#endif
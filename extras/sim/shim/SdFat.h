@@ -0,0 +1,77 @@
+// Stub of the SdFat types USBHost_t36.h refers to.  The simulator does
+// not build the mass storage driver.
+//
+// This file is in the public domain
+
+#ifndef SdFat_h
+#define SdFat_h
+
+#include <Arduino.h>
+
+typedef int oflag_t;
+#define O_READ   0
+#define O_RDWR   2
+#define O_CREAT  4
+#define O_AT_END 8
+#define T_CREATE 1
+#define T_WRITE  2
+#define FS_YEAR(fatDate)   (1980 + ((fatDate) >> 9))
+#define FS_MONTH(fatDate)  (((fatDate) >> 5) & 0xF)
+#define FS_DAY(fatDate)    ((fatDate) & 0x1F)
+#define FS_HOUR(fatTime)   ((fatTime) >> 11)
+#define FS_MINUTE(fatTime) (((fatTime) >> 5) & 0x3F)
+#define FS_SECOND(fatTime) (2 * ((fatTime) & 0x1F))
+
+struct MbrSector_t {
+	uint8_t data[512];
+};
+
+class FsBlockDeviceInterface
+{
+public:
+	virtual ~FsBlockDeviceInterface() { }
+};
+
+class FsFile
+{
+public:
+	operator bool() { return false; }
+	bool isOpen() { return false; }
+	bool isDirectory() { return false; }
+	void close() { }
+	int available() { return 0; }
+	int peek() { return -1; }
+	int read(void *buf, size_t count) { return -1; }
+	size_t write(const void *buf, size_t count) { return 0; }
+	void flush() { }
+	bool truncate(uint64_t length) { return false; }
+	bool seekSet(uint64_t pos) { return false; }
+	bool seekCur(int64_t offset) { return false; }
+	bool seekEnd(int64_t offset = 0) { return false; }
+	uint64_t curPosition() { return 0; }
+	uint64_t size() { return 0; }
+	size_t getName(char *name, size_t len) { if (len) *name = 0; return 0; }
+	FsFile openNextFile(oflag_t oflag = O_READ) { return FsFile(); }
+	void rewindDirectory() { }
+	bool getCreateDateTime(uint16_t *pdate, uint16_t *ptime) { return false; }
+	bool getModifyDateTime(uint16_t *pdate, uint16_t *ptime) { return false; }
+	bool timestamp(uint8_t flags, uint16_t year, uint8_t month, uint8_t day,
+		uint8_t hour, uint8_t minute, uint8_t second) { return false; }
+};
+
+class FsVolume
+{
+public:
+	FsFile open(const char *path, oflag_t oflag = O_READ) { return FsFile(); }
+	bool exists(const char *path) { return false; }
+	bool mkdir(const char *path, bool pFlag = true) { return false; }
+	bool remove(const char *path) { return false; }
+	bool rename(const char *oldPath, const char *newPath) { return false; }
+	bool rmdir(const char *path) { return false; }
+	bool getVolumeLabel(char *name, size_t len) { return false; }
+	uint32_t clusterCount() { return 0; }
+	uint32_t freeClusterCount() { return 0; }
+	uint32_t bytesPerCluster() { return 0; }
+};
+
+#endif
@@ -0,0 +1,136 @@
+// Stream 1 MB from a simulated CDC serial device, then test bulk writes,
+// end() while the device NAKs all writes, recovery from a STALLed
+// endpoint and disconnect.
+//
+//   ./build/stream [threshold]
+//
+// threshold sets USBHost::setInterruptThreshold() for the stream.
+//
+// This file is in the public domain
+
+#include "cdc_device.h"
+
+USBHost myusb;
+USBSerial_BigBuffer userial(myusb);
+CDCSimDevice device;
+
+static void run(uint32_t msec)
+{
+	for (uint32_t i=0; i < msec; i++) {
+		ehci_sim_run(1000);
+		myusb.Task();
+	}
+}
+
+static void print_pipes()
+{
+	pipe_stats_t ps[8];
+	uint32_t n = USBHost::getPipeStats(ps, 8);
+	for (uint32_t i=0; i < n; i++) {
+		printf("  pipe addr=%u ep=%02X type=%u max_queued=%u errors=%u transfers=%u bytes=%u\n",
+			ps[i].address, ps[i].endpoint, ps[i].type, ps[i].max_queued,
+			ps[i].errors, ps[i].transfers, ps[i].bytes);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+	myusb.begin();
+	ehci_sim_connect(&device);
+	for (int i=0; i < 2000 && !userial; i++) run(1);
+	if (!userial) {
+		printf("serial device not configured\n");
+		return 1;
+	}
+	printf("configured at %u us, address %u\n", micros(), device.address);
+	if (argc > 1) USBHost::setInterruptThreshold(atoi(argv[1]));
+	userial.begin(115200);
+
+	// bulk IN stream
+	const uint32_t total = 1000000;
+	uint32_t start = micros(), irqs = ehci_sim_stats.interrupts;
+	uint32_t got = 0;
+	uint8_t expect = 0;
+	bool ok = true;
+	device.stream(total);
+	while (got < total && micros() - start < 5000000) {
+		myusb.Task();
+		while (userial.available()) {
+			int c = userial.read();
+			if (c != expect && ok) {
+				printf("data error at byte %u: %d, expected %d\n", got, c, expect);
+				ok = false;
+			}
+			expect = cdc_stream_next(c);
+			got++;
+		}
+		ehci_sim_run(100);
+	}
+	uint32_t us = micros() - start;
+	printf("received %u bytes in %u us, %s, %.1f KB/sec, %u interrupts\n",
+		got, us, ok ? "data ok" : "DATA ERROR", got * 1000.0 / us,
+		ehci_sim_stats.interrupts - irqs);
+	print_pipes();
+
+	// bulk and single byte writes.  flush() would busy wait for the
+	// USB interrupt, which only runs when simulated time advances.
+	static uint8_t buf[20000];
+	for (uint32_t i=0; i < sizeof(buf); i++) buf[i] = i;
+	start = micros();
+	size_t written = 0;
+	while (written < sizeof(buf)) {
+		written += userial.write(buf + written, sizeof(buf) - written);
+	}
+	for (int i=0; i < 2000 && device.out_bytes < sizeof(buf); i++) {
+		ehci_sim_run(10);
+		myusb.Task();
+	}
+	printf("bulk write: %u bytes received by device in %u us\n",
+		device.out_bytes, micros() - start);
+	for (int i=0; i < 1000; i++) userial.write((uint8_t)i);
+	run(20);
+	printf("byte write: %u bytes received by device\n", device.out_bytes);
+
+	// the device stops accepting data.  end() must cancel the queued
+	// transfers, so none of that data is sent later and the port works
+	// again after begin()
+	device.nak_out = true;
+	for (int i=0; i < 1000; i++) userial.write((uint8_t)i);
+	run(20);
+	uint32_t before = device.out_bytes;
+	userial.end();
+	device.nak_out = false;
+	run(20);
+	uint32_t after_end = device.out_bytes - before;
+	userial.begin(115200);
+	for (int i=0; i < 1000; i++) userial.write((uint8_t)i);
+	run(20);
+	uint32_t after_begin = device.out_bytes - before - after_end;
+	printf("end while NAKing: %u bytes sent after end, %u after begin\n",
+		after_end, after_begin);
+	if (after_end != 0 || after_begin != 1000) ok = false;
+
+	// a STALL on the bulk IN endpoint is cleared with CLEAR_FEATURE
+	device.stall(4);
+	device.stream(5000);
+	got = 0;
+	for (int i=0; i < 200; i++) {
+		run(1);
+		while (userial.available()) {
+			userial.read();
+			got++;
+		}
+	}
+	printf("after stall: received %u bytes, halted=%X\n", got, device.halted);
+	print_pipes();
+
+	ehci_sim_disconnect();
+	run(20);
+	printf("after disconnect: serial %s\n", userial ? "still present" : "gone");
+	uint32_t devices, pipes, transfers, strings;
+	USBHost::countFree(devices, pipes, transfers, strings);
+	printf("free: devices=%u pipes=%u transfers=%u strings=%u\n",
+		devices, pipes, transfers, strings);
+	return (ok && got == 5000 && !userial) ? 0 : 1;
+}
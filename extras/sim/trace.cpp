@@ -0,0 +1,41 @@
+// Record a binary transfer trace of a simulated CDC serial device
+// enumerating and moving a little data, to trace.bin.  Convert it to
+// pcap for Wireshark with:
+//
+//   ../usbtrace2pcap.py trace.bin trace.pcap
+//
+// This file is in the public domain
+
+#include "cdc_device.h"
+
+USBHost myusb;
+USBSerial_BigBuffer userial(myusb);
+CDCSimDevice device;
+
+int main()
+{
+	FILE *f = fopen("trace.bin", "wb");
+	if (!f) return 1;
+	fwrite("USBTRACE", 1, 8, f);
+	uint32_t header[2] = {sizeof(trace_event_t), 600000000}; // event size, CPU clock
+	fwrite(header, 1, sizeof(header), f);
+	myusb.begin();
+	ehci_sim_connect(&device);
+	trace_event_t list[16];
+	for (int i=0; i < 300; i++) {
+		ehci_sim_run(1000);
+		myusb.Task();
+		uint32_t n;
+		while ((n = USBHost::readTrace(list, 16)) > 0) {
+			fwrite(list, sizeof(trace_event_t), n, f);
+		}
+		if (i == 250) {
+			device.queue_in(4, "hello world", 11);
+			userial.write("abc", 3);
+		}
+	}
+	fclose(f);
+	printf("trace.bin written, %u events dropped, serial %s\n",
+		USBHost::traceDropped(), userial ? "configured" : "NOT CONFIGURED");
+	return userial ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+// Checks of the periodic schedule's transaction translator (TT) budgets:
+// tt_transaction_usecs(), tt_fits() and plan_periodic_bandwidth(), and
+// pipes created behind Single-TT and Multi-TT hubs.  No hub is simulated,
+// only Device_t records saying which TT each device uses, so the split
+// transactions themselves are never run: only their scheduling is checked.
+//
+//   ./build/tt_schedule
+//
+// These functions are static in ehci.cpp, so it's included here, and
+// this program is linked without ehci.o.
+//
+// This file is in the public domain
+
+#include "../../ehci.cpp"
+
+#undef print
+#undef println
+
+static uint32_t failed = 0;
+
+#define CHECK(expr) check((expr), #expr, __LINE__)
+static void check(bool ok, const char *expr, int line)
+{
+	if (!ok) {
+		printf("FAIL line %d: %s\n", line, expr);
+		failed++;
+	}
+}
+
+// A driver, only to create pipes
+class ScheduleTest : public USBDriver
+{
+public:
+	ScheduleTest() {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	}
+	// 8 byte interrupt IN, like a keyboard
+	Pipe_t * keyboard(Device_t *dev, uint32_t interval) {
+		return new_Pipe(dev, 3, 1, 1, 8, interval);
+	}
+	bool keyboard_fits(Device_t *dev, uint32_t interval, uint32_t *load = NULL) {
+		return check_Pipe_Bandwidth(dev, 3, 1, 8, interval, load);
+	}
+protected:
+	virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) { return false; }
+	virtual void disconnect() { }
+	Pipe_t mypipes[160] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[160] __attribute__ ((aligned(32)));
+};
+
+USBHost myusb;
+ScheduleTest test;
+
+static Device_t devices[64];
+static uint32_t num_devices = 0;
+
+// A device on a hub's port.  hub_address 0 is the root port, where the
+// EHCI's own TT is used.
+static Device_t * device(uint32_t speed, uint32_t hub_address, uint32_t port, bool multi_tt)
+{
+	Device_t *dev = &devices[num_devices++];
+	memset(dev, 0, sizeof(Device_t));
+	dev->speed = speed;
+	dev->address = num_devices + 10;
+	dev->hub_address = hub_address;
+	dev->hub_port = port;
+	dev->tt_address = hub_address;
+	dev->tt_port = multi_tt ? port : 0;
+	return dev;
+}
+
+// Forget all bandwidth allocations.  The test's pipes stay in the
+// periodic schedule, but the simulator isn't run.
+static void reset_schedule()
+{
+	memset(uframe_bandwidth, 0, sizeof(uframe_bandwidth));
+	memset(tt_budget, 0, sizeof(tt_budget));
+	periodic_pipes = 0;
+	periodic_failures = 0;
+	periodic_tt_overflows = 0;
+	num_devices = 0;
+}
+
+static void test_transaction_usecs()
+{
+	// USB 2.0 section 5.11.3, plus 1 us host delay, rounded up
+	CHECK(tt_transaction_usecs(1, 3, 1, 8) == 118);    // low speed interrupt IN
+	CHECK(tt_transaction_usecs(1, 3, 0, 8) == 118);    // low speed interrupt OUT
+	CHECK(tt_transaction_usecs(0, 3, 1, 8) == 17);     // full speed interrupt
+	CHECK(tt_transaction_usecs(0, 3, 1, 64) == 61);
+	CHECK(tt_transaction_usecs(0, 1, 1, 192) == 159);  // full speed isochronous IN
+	CHECK(tt_transaction_usecs(0, 1, 0, 1023) == 806); // full speed isochronous OUT
+}
+
+static void test_fits()
+{
+	static tt_budget_t tt;
+	memset(&tt, 0, sizeof(tt));
+	CHECK(tt_fits(&tt, 0, 0, 125));
+	CHECK(tt_fits(&tt, 0, 0, 126));   // continues in Y1
+	CHECK(tt_fits(&tt, 0, 5, 155));   // Y5 and 30 us of Y6
+	CHECK(!tt_fits(&tt, 0, 5, 156));
+	CHECK(tt_fits(&tt, 0, 6, 30));
+	CHECK(!tt_fits(&tt, 0, 6, 31));
+	CHECK(!tt_fits(&tt, 0, 7, 1));    // nothing may start in Y7
+	CHECK(tt_fits(&tt, 0, 0, 780));   // the whole B-frame
+	CHECK(!tt_fits(&tt, 0, 0, 781));
+	tt_update(&tt, 3, 0, 118, true);
+	CHECK(!tt_fits(&tt, 3, 0, 8));
+	CHECK(tt_fits(&tt, 3, 0, 7));
+	CHECK(tt_fits(&tt, 3, 1, 118));
+	CHECK(tt_fits(&tt, 2, 0, 125));   // other frames unchanged
+	tt_update(&tt, 3, 0, 118, false);
+	CHECK(tt_fits(&tt, 3, 0, 125));
+}
+
+// Low speed keyboards polled every frame, behind one Single-TT hub.  Each
+// takes 118 us of the TT's frame.  Its complete-splits need 3 more
+// uframes, so it can start in Y0 to Y3 only: 4 fit per frame.
+static void test_single_tt_every_frame()
+{
+	reset_schedule();
+	uint32_t shifts = 0;
+	for (uint32_t i=0; i < 4; i++) {
+		Device_t *dev = device(1, 1, i + 1, false);
+		bandwidth_plan_t plan;
+		CHECK(plan_periodic_bandwidth(dev, 3, 1, 8, 1, &plan));
+		CHECK(plan.tt == 1 && plan.tt_usecs == 118 && plan.shift < 4);
+		Pipe_t *pipe = test.keyboard(dev, 1);
+		CHECK(pipe != NULL);
+		if (!pipe) continue;
+		CHECK(pipe->bandwidth_shift == plan.shift);
+		CHECK(pipe->start_mask == (1u << plan.shift));
+		shifts |= 1 << plan.shift;
+	}
+	CHECK(shifts == 0x0F); // one in each of Y0 to Y3
+	Device_t *dev = device(1, 1, 5, false);
+	uint32_t load;
+	CHECK(!test.keyboard_fits(dev, 1, &load));
+	CHECK(load == 0xFFFFFFFF);
+	CHECK(test.keyboard(dev, 1) == NULL);
+	periodic_stats_t stats;
+	USBHost::getPeriodicStats(stats);
+	CHECK(stats.pipes == 4 && stats.failures == 1);
+	CHECK(stats.tts == 1 && stats.tt_max_load == 4 * 118);
+	CHECK(stats.tt_overflows == 0);
+}
+
+// Many keyboards with bInterval 10, polled every 8 frames: 4 in each of
+// the 8 frames, on one Single-TT hub.
+static void test_single_tt_keyboards()
+{
+	reset_schedule();
+	uint32_t created = 0;
+	for (uint32_t i=0; i < 33; i++) {
+		if (test.keyboard(device(1, 1, (i % 7) + 1, false), 10)) created++;
+	}
+	CHECK(created == 32);
+	periodic_stats_t stats;
+	USBHost::getPeriodicStats(stats);
+	CHECK(stats.tts == 1 && stats.failures == 1);
+}
+
+// A Multi-TT hub has a TT for each port, so each port gets its own 4
+// keyboards polled every frame.  One budget is left for another hub.
+static void test_multi_tt()
+{
+	reset_schedule();
+	const uint32_t ports = USBHOST_TT_COUNT - 1;
+	uint32_t created = 0;
+	for (uint32_t port=1; port <= ports; port++) {
+		for (uint32_t i=0; i < 4; i++) {
+			if (test.keyboard(device(1, 2, port, true), 1)) created++;
+		}
+	}
+	CHECK(created == ports * 4);
+	periodic_stats_t stats;
+	USBHost::getPeriodicStats(stats);
+	CHECK(stats.tts == ports && stats.tt_max_load == 4 * 118);
+	CHECK(stats.tt_overflows == 0);
+	CHECK(!test.keyboard_fits(device(1, 2, 1, true), 1));
+	CHECK(test.keyboard_fits(device(1, 1, 1, false), 1));
+}
+
+// More TTs in use than USBHOST_TT_COUNT: the extra pipes are scheduled
+// only by high speed bus load, and counted.
+static void test_tt_overflow()
+{
+	reset_schedule();
+	const uint32_t num_tts = USBHOST_TT_COUNT + 3;
+	uint32_t created = 0;
+	for (uint32_t i=0; i < num_tts; i++) {
+		if (test.keyboard(device(0, 2 + i / 7, (i % 7) + 1, true), 8)) created++;
+	}
+	CHECK(created == num_tts);
+	periodic_stats_t stats;
+	USBHost::getPeriodicStats(stats);
+	CHECK(stats.tts == USBHOST_TT_COUNT);
+	CHECK(stats.tt_overflows == 3);
+}
+
+int main()
+{
+	myusb.begin();
+	test_transaction_usecs();
+	test_fits();
+	test_single_tt_every_frame();
+	test_single_tt_keyboards();
+	test_multi_tt();
+	test_tt_overflow();
+	printf("tt_schedule: %s, USBHOST_TT_COUNT %u\n",
+		failed ? "FAILED" : "all checks passed", USBHOST_TT_COUNT);
+	return failed ? 1 : 0;
+}
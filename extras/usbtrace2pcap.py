@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+# Convert a USBHost_t36 binary transfer trace to a pcap file, in the
+# Linux usbmon format (LINKTYPE_USB_LINUX_MMAPPED), for Wireshark.
+#
+# usage: usbtrace2pcap.py <input> <output.pcap>
+#
+# The input may be a file holding the TraceToSerial example's output,
+# or the Teensy's serial device (/dev/ttyACM0), which is read until
+# Ctrl-C.  Only the first 16 bytes of each transfer's data (8 after a
+# SETUP packet) are captured.
+#
+# Timestamps come from the cycle counter, which wraps every few seconds.
+# The library adds a time sync record ('T', holding millis()) before any
+# event a second or more after the previous one, which is used to count
+# the wraps during longer gaps.
+#
+# This program is in the public domain
+
+import os
+import struct
+import sys
+
+MAGIC = b'USBTRACE'
+EVENT = struct.Struct('<IIBBBBHH16s')
+PCAP_HEADER = struct.Struct('<IHHiIII')
+PCAP_RECORD = struct.Struct('<IIII')
+USBMON = struct.Struct('<QBBBBHBBqiiII8siiII')
+LINKTYPE_USB_LINUX_MMAPPED = 220
+
+# trace pipe type to usbmon transfer type
+XFER_TYPE = {0: 2, 1: 0, 2: 3, 3: 1}
+
+EINPROGRESS = 115
+ENOENT = 2
+EXDEV = 18
+EPIPE = 32
+ENOSR = 63
+ECOMM = 70
+EPROTO = 71
+EOVERFLOW = 75
+
+
+def usbmon_status(event, status, ptype, is_in):
+    if event == 'S':
+        return -EINPROGRESS
+    if status & 0x100:
+        return -ENOENT      # cancelled
+    if ptype == 1:
+        # isochronous status bits, from followup_Isochronous
+        if status & 0x80:
+            return -EXDEV       # missed
+        if status & 0x40:
+            return -ECOMM if is_in else -ENOSR  # data buffer error
+        if status & 0x20:
+            return -EOVERFLOW   # babble
+        if status & 0x10:
+            return -EPROTO      # transaction error
+        return 0
+    if status & 0x10:
+        return -EOVERFLOW   # babble
+    if status & 0x3C:
+        return -EPROTO      # transaction or buffer error
+    if status & 0x40:
+        return -EPIPE       # stall
+    return 0
+
+
+def open_input(name):
+    f = open(name, 'rb', buffering=0)
+    if os.isatty(f.fileno()):
+        import termios
+        import tty
+        tty.setraw(f.fileno())
+        termios.tcflush(f.fileno(), termios.TCIFLUSH)
+    return f
+
+
+def read_exact(f, n):
+    data = b''
+    while len(data) < n:
+        chunk = f.read(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def find_header(f):
+    # skip anything before the magic, in case the port had old data
+    window = b''
+    while True:
+        c = f.read(1)
+        if not c:
+            return None
+        window = (window + c)[-len(MAGIC):]
+        if window == MAGIC:
+            return read_exact(f, 8)
+
+
+def convert(f, out):
+    header = find_header(f)
+    if header is None:
+        sys.exit('no USBTRACE header found')
+    size, hz = struct.unpack('<II', header)
+    if size != EVENT.size:
+        sys.exit('unexpected event size %d' % size)
+    out.write(PCAP_HEADER.pack(0xa1b2c3d4, 2, 4, 0, 0, 65535,
+                               LINKTYPE_USB_LINUX_MMAPPED))
+    count = 0
+    last_cycles = None
+    elapsed = 0   # total cycles since the first event
+    sync = None   # (millis, elapsed) at the last time sync record
+    while True:
+        raw = read_exact(f, size)
+        if raw is None:
+            break
+        (cycles, ident, event, address, endpoint, ptype, length, status,
+         data) = EVENT.unpack(raw)
+        event = chr(event)
+        if last_cycles is not None:
+            elapsed += (cycles - last_cycles) & 0xFFFFFFFF
+        last_cycles = cycles
+        if event == 'T':
+            if sync is not None:
+                # add the whole cycle counter wraps which best match
+                # the millis() difference
+                expect = ((ident - sync[0]) & 0xFFFFFFFF) * hz // 1000
+                wraps = round((expect - (elapsed - sync[1])) / 2**32)
+                if wraps > 0:
+                    elapsed += wraps << 32
+            sync = (ident, elapsed)
+            continue
+        usec = elapsed * 1000000 // hz
+        sec, usec = divmod(usec, 1000000)
+
+        is_in = (endpoint & 0x80) != 0
+        if event == 'S' and ptype == 0:
+            flag_setup = 0
+            setup = data[:8]
+            data = data[8:]
+        else:
+            flag_setup = ord('-')
+            setup = bytes(8)
+        if event == 'S':
+            captured = 0 if is_in else min(length, len(data))
+        elif event == 'C':
+            captured = min(length, len(data)) if is_in else 0
+        else:
+            captured = 0
+        if captured > 0:
+            flag_data = 0
+        else:
+            flag_data = ord('<') if (event == 'S' and is_in) else ord('>')
+        if ptype == 1:
+            setup = bytes(8)    # iso error_count & numdesc
+        packet = USBMON.pack(ident, ord('S' if event == 'S' else 'C'),
+                             XFER_TYPE[ptype & 3], endpoint, address, 1,
+                             flag_setup, flag_data, sec, usec,
+                             usbmon_status(event, status, ptype, is_in),
+                             length, captured,
+                             setup, 0, 0, 0, 0)
+        packet += data[:captured]
+        out.write(PCAP_RECORD.pack(sec, usec, len(packet), len(packet)))
+        out.write(packet)
+        out.flush()
+        count += 1
+    return count
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: usbtrace2pcap.py <input> <output.pcap>')
+    f = open_input(sys.argv[1])
+    with open(sys.argv[2], 'wb') as out:
+        try:
+            count = convert(f, out)
+        except KeyboardInterrupt:
+            count = None
+    if count is not None:
+        print('%d events' % count)
+
+
+if __name__ == '__main__':
+    main()
@@ -35,12 +35,17 @@
 #define print   USBHost::print_
 #define println USBHost::println_
 
+// any HID interface, the parser claims it if it can use the reports
+static const usb_match_t hid_match[] = {
+	USB_MATCH_CLASS(1, 3, 0)
+};
+
 void USBHIDParser::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
-	driver_ready_for_device(this);
+	driver_ready_for_device(this, hid_match, sizeof(hid_match)/sizeof(usb_match_t));
 }
 
 bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len)
@@ -150,6 +155,14 @@ bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
 	bInterfaceSubClass = descriptors[6]; // likewise sub type and protocol.
 	bInterfaceProtocol = descriptors[7];
 	
+	if (find_Cached_Descriptor(dev, 0x22, bInterfaceNumber, _bigBuffer, descsize) == descsize) {
+		// parse after the claim completes, as when the control transfer
+		// returns the report descriptor
+		println("report descriptor from cache");
+		report_from_cache = true;
+		hidTimer.start(0);
+		return true;
+	}
 	mk_setup(setup, 0x81, 6, 0x2200, descriptors[2], descsize); // get report desc
 	queue_Control_Transfer(dev, &setup, _bigBuffer, this);
 	return true;
@@ -171,26 +184,34 @@ void USBHIDParser::control(const Transfer_t *transfer)
 	println("  mesg = ", mesg, HEX);
 	if (mesg == 0x22000681 && transfer->length == descsize) { // HID report descriptor
 		println("  got report descriptor");
-		parse();
-		// We need to setup the buffer pointers. 
-		if (_rx1 == nullptr) {
-			_rx1 = _bigBufferEnd - in_size;
-			_rx2 = _rx1 - in_size;
-			_bigBufferEnd = _rx2;
-		}
+		cache_Descriptor(device, 0x22, bInterfaceNumber, _bigBuffer, descsize);
+		report_descriptor_ready();
+	}
+}
 
-		queue_Data_Transfer(in_pipe, _rx1, in_size, this);
-		if (_rx2) queue_Data_Transfer(in_pipe, _rx2, in_size, this);
-		if (_rx3) queue_Data_Transfer(in_pipe, _rx3, in_size, this);
-		if (_rx4) queue_Data_Transfer(in_pipe, _rx4, in_size, this);
-
-		if (device->idVendor == 0x054C && 
-				((device->idProduct == 0x0268) || (device->idProduct == 0x042F)/* || (device->idProduct == 0x03D5)*/)) {
-			println("send special PS3 feature command");
-			mk_setup(setup, 0x21, 9, 0x03F4, 0, 4); // ps3 tell to send report 1?
-			static uint8_t ps3_feature_F4_report[] = {0x42, 0x0c, 0x00, 0x00};
-			queue_Control_Transfer(device, &setup, ps3_feature_F4_report, this);
-		}
+// Find drivers for the report descriptor's collections, and begin
+// receiving reports.
+void USBHIDParser::report_descriptor_ready()
+{
+	parse();
+	// We need to setup the buffer pointers. 
+	if (_rx1 == nullptr) {
+		_rx1 = _bigBufferEnd - in_size;
+		_rx2 = _rx1 - in_size;
+		_bigBufferEnd = _rx2;
+	}
+
+	queue_Data_Transfer(in_pipe, _rx1, in_size, this);
+	if (_rx2) queue_Data_Transfer(in_pipe, _rx2, in_size, this);
+	if (_rx3) queue_Data_Transfer(in_pipe, _rx3, in_size, this);
+	if (_rx4) queue_Data_Transfer(in_pipe, _rx4, in_size, this);
+
+	if (device->idVendor == 0x054C && 
+			((device->idProduct == 0x0268) || (device->idProduct == 0x042F)/* || (device->idProduct == 0x03D5)*/)) {
+		println("send special PS3 feature command");
+		mk_setup(setup, 0x21, 9, 0x03F4, 0, 4); // ps3 tell to send report 1?
+		static uint8_t ps3_feature_F4_report[] = {0x42, 0x0c, 0x00, 0x00};
+		queue_Control_Transfer(device, &setup, ps3_feature_F4_report, this);
 	}
 }
 
@@ -213,6 +234,10 @@ void USBHIDParser::out_callback(const Transfer_t *transfer)
 // for all drivers which claimed a top level collection
 void USBHIDParser::disconnect()
 {
+	if (report_from_cache) {
+		hidTimer.stop();
+		report_from_cache = false;
+	}
 	for (uint32_t i=0; i < TOPUSAGE_LIST_LEN; i++) {
 		USBHIDInput *driver = topusage_drivers[i];
 		if (driver) {
@@ -253,9 +278,6 @@ void USBHIDParser::in_data(const Transfer_t *transfer)
 			}
 		}
 	}
-	#if defined(__IMXRT1062__) // Teensy 4.x
-    if ((uint32_t)buf >= 0x20200000u) arm_dcache_flush_delete((void*)buf, in_size);
-	#endif
 	queue_Data_Transfer(in_pipe, (void*)buf, in_size, this);
 }
 
@@ -283,6 +305,11 @@ void USBHIDParser::out_data(const Transfer_t *transfer)
 
 void USBHIDParser::timer_event(USBDriverTimer *whichTimer)
 {
+	if (report_from_cache) {
+		report_from_cache = false;
+		report_descriptor_ready();
+		return;
+	}
 	if (topusage_drivers[0]) {
 		topusage_drivers[0]->hid_timer_event(whichTimer);
 	}	
@@ -317,9 +344,6 @@ bool USBHIDParser::sendPacket(const uint8_t *buffer, int cb) {
 	// copy the users data into our out going buffer
 	memcpy(p, buffer, cb);	
 
-#if defined(__IMXRT1062__) // Teensy 4.x
-    if ((uint32_t)p >= 0x20200000u) arm_dcache_flush_delete(p, cb);
-#endif
 	println("USBHIDParser Send packet");
 	print_hexbytes(buffer, cb);
 	bool fReturn = queue_Data_Transfer(out_pipe, p, cb, this);
@@ -345,12 +369,6 @@ void USBHIDParser::setRXBuffers(uint8_t *buffer1, uint8_t *buffer2, uint8_t cb,
 	_rx2 = buffer2;
 	_rx3 = buffer3;
 	_rx4 = buffer4;
-	#if defined(__IMXRT1062__) // Teensy 4.x
-    if ((uint32_t)_rx1 >= 0x20200000u) arm_dcache_flush_delete(_rx1, in_size);
-    if ((uint32_t)_rx2 >= 0x20200000u) arm_dcache_flush_delete(_rx2, in_size);
-    if ((uint32_t)_rx3 >= 0x20200000u) arm_dcache_flush_delete(_rx3, in_size);
-    if ((uint32_t)_rx4 >= 0x20200000u) arm_dcache_flush_delete(_rx4, in_size);
-	#endif
 }
 
 bool USBHIDParser::sendControlPacket(uint32_t bmRequestType, uint32_t bRequest,
@@ -32,13 +32,18 @@ volatile bool USBHub::reset_busy = false;
 #define print   USBHost::print_
 #define println USBHost::println_
 
+// hubs are only claimed as a whole device
+static const usb_match_t hub_match[] = {
+	USB_MATCH_SUBCLASS(0, 9, 0, 0)
+};
+
 void USBHub::init()
 {
 	contribute_Devices(mydevices, sizeof(mydevices)/sizeof(Device_t));
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
 	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
-	driver_ready_for_device(this);
+	driver_ready_for_device(this, hub_match, sizeof(hub_match)/sizeof(usb_match_t));
 }
 
 bool USBHub::claim(Device_t *dev, int type, const uint8_t *d, uint32_t len)
@@ -365,7 +370,9 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 	  case PORT_OFF:
 	  case PORT_DISCONNECT:
 		if (status & 0x0001) { // connected
-			state = PORT_DEBOUNCE1;
+			// fast attach: reset after one stable poll
+			state = USBHost::fastAttach() ? PORT_DEBOUNCE5 : PORT_DEBOUNCE1;
+			connect_micros[port-1] = micros();
 			start_debounce_timer(port);
 			send_clearstatus_connect(port);
 		}
@@ -379,7 +386,8 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 			if (++state > PORT_DEBOUNCE5) {
 				if (USBHub::reset_busy || USBHost::enumeration_busy) {
 					// wait in debounce state if another port is
-					// resetting or a device is busy enumerating
+					// resetting, a device is still at address zero,
+					// or all enumeration buffers are in use
 					state = PORT_DEBOUNCE5;
 					break;
 				}
@@ -387,6 +395,7 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 				stop_debounce_timer(port);
 				state = PORT_RESET;
 				println("sending reset");
+				reset_micros = micros();
 				send_setreset(port);
 				port_doing_reset = port;
 			}
@@ -404,7 +413,7 @@ void USBHub::new_port_status(uint32_t port, uint32_t status)
 			if (status & 0x0200) speed = 1;
 			else if (status & 0x0400) speed = 2;
 			port_doing_reset_speed = speed;
-			resettimer.start(25000);
+			resettimer.start(USBHost::fastAttach() ? USBHOST_FAST_RECOVERY : 25000);
 		} else if (!(status & 0x0001)) {
 			send_clearstatus_connect(port);
 			USBHub::reset_busy = false;
@@ -447,7 +456,7 @@ void USBHub::timer_event(USBDriverTimer *timer)
 			for (uint32_t i=1; i <= numports; i++) {
 				if (in_use & (1 << i)) send_getstatus(i);
 			}
-			debouncetimer.start(20000);
+			debouncetimer.start(debounce_interval());
 		}
 	} else if (timer == &resettimer) {
 		uint8_t port = port_doing_reset;
@@ -459,7 +468,8 @@ void USBHub::timer_event(USBDriverTimer *timer)
 				println("PORT_RECOVERY");
 				// begin enumeration process
 				uint8_t speed = port_doing_reset_speed;
-				devicelist[port-1] = new_Device(speed, device->address, port);
+				devicelist[port-1] = new_Device(speed, device->address, port,
+					connect_micros[port-1], reset_micros);
 				// TODO: if return is NULL, what to do?  Panic?
 				// Can we disable the port?  Will this device
 				// play havoc if it sits unconfigured responding
@@ -477,9 +487,16 @@ void USBHub::timer_event(USBDriverTimer *timer)
 	//if (++count > 36) while (1) ; // stop here
 }
 
+// Ports are polled this often while debouncing, 5 times normally, or
+// once with fast attach
+uint32_t USBHub::debounce_interval()
+{
+	return USBHost::fastAttach() ? USBHOST_FAST_DEBOUNCE : 20000;
+}
+
 void USBHub::start_debounce_timer(uint32_t port)
 {
-	if (debounce_in_use == 0) debouncetimer.start(20000);
+	if (debounce_in_use == 0) debouncetimer.start(debounce_interval());
 	debounce_in_use |= (1 << port);
 }
 
@@ -58,21 +58,21 @@ bool JoystickController::queue_Data_Transfer_Debug(Pipe_t *pipe, void *buffer,
 // PID/VID to joystick mapping - Only the XBOXOne is used to claim the USB interface directly,
 // The others are used after claim-hid code to know which one we have and to use it for
 // doing other features.
-JoystickController::product_vendor_mapping_t JoystickController::pid_vid_mapping[] = {
-    { 0x045e, 0x02dd, XBOXONE, false },  // Xbox One Controller
-    { 0x045e, 0x02ea, XBOXONE, false },  // Xbox One S Controller
-    { 0x045e, 0x0b12, XBOXONE, false },  // Xbox Core Controller (Series S/X)
-    { 0x045e, 0x0719, XBOX360, false},
-    { 0x045e, 0x028E, SWITCH, false},  // Switch?
-    { 0x057E, 0x2009, SWITCH, true},   // Switch Pro controller.  // Let the swtich grab it, but...
-    { 0x0079, 0x201C, SWITCH, false},
-    { 0x054C, 0x0268, PS3, true},
-    { 0x054C, 0x042F, PS3, true},   // PS3 Navigation controller
-    { 0x054C, 0x03D5, PS3_MOTION, true},    // PS3 Motion controller
-    { 0x054C, 0x05C4, PS4, true},   {0x054C, 0x09CC, PS4, true },
-    { 0x0A5C, 0x21E8, PS4, true},
-    { 0x046D, 0xC626, SpaceNav, true},  // 3d Connextion Space Navigator, 0x10008
-    { 0x046D, 0xC628, SpaceNav, true}  // 3d Connextion Space Navigator, 0x10008
+const usb_match_t JoystickController::pid_vid_mapping[] = {
+    USB_MATCH_ID(1, 0x045e, 0x02dd, XBOXONE),  // Xbox One Controller
+    USB_MATCH_ID(1, 0x045e, 0x02ea, XBOXONE),  // Xbox One S Controller
+    USB_MATCH_ID(1, 0x045e, 0x0b12, XBOXONE),  // Xbox Core Controller (Series S/X)
+    USB_MATCH_ID(1, 0x045e, 0x0719, XBOX360),
+    USB_MATCH_ID(1, 0x045e, 0x028E, SWITCH),  // Switch?
+    USB_MATCH_ID(1, 0x057E, 0x2009, SWITCH | JOY_HID_DEVICE),   // Switch Pro controller.  // Let the swtich grab it, but...
+    USB_MATCH_ID(1, 0x0079, 0x201C, SWITCH),
+    USB_MATCH_ID(1, 0x054C, 0x0268, PS3 | JOY_HID_DEVICE),
+    USB_MATCH_ID(1, 0x054C, 0x042F, PS3 | JOY_HID_DEVICE),   // PS3 Navigation controller
+    USB_MATCH_ID(1, 0x054C, 0x03D5, PS3_MOTION | JOY_HID_DEVICE),    // PS3 Motion controller
+    USB_MATCH_ID(1, 0x054C, 0x05C4, PS4 | JOY_HID_DEVICE),   USB_MATCH_ID(1, 0x054C, 0x09CC, PS4 | JOY_HID_DEVICE),
+    USB_MATCH_ID(1, 0x0A5C, 0x21E8, PS4 | JOY_HID_DEVICE),
+    USB_MATCH_ID(1, 0x046D, 0xC626, SpaceNav | JOY_HID_DEVICE),  // 3d Connextion Space Navigator, 0x10008
+    USB_MATCH_ID(1, 0x046D, 0xC628, SpaceNav | JOY_HID_DEVICE)  // 3d Connextion Space Navigator, 0x10008
 };
 
 
@@ -134,7 +134,7 @@ void JoystickController::init()
     contribute_Pipes(mypipes, sizeof(mypipes) / sizeof(Pipe_t));
     contribute_Transfers(mytransfers, sizeof(mytransfers) / sizeof(Transfer_t));
     contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs) / sizeof(strbuf_t));
-    driver_ready_for_device(this);
+    driver_ready_for_device(this, pid_vid_mapping, sizeof(pid_vid_mapping) / sizeof(pid_vid_mapping[0]));
     USBHIDParser::driver_ready_for_hid_collection(this);
     BluetoothController::driver_ready_for_bluetooth(this);
 }
@@ -145,8 +145,8 @@ JoystickController::joytype_t JoystickController::mapVIDPIDtoJoystickType(uint16
     for (uint8_t i = 0; i < (sizeof(pid_vid_mapping) / sizeof(pid_vid_mapping[0])); i++) {
         if ((idVendor == pid_vid_mapping[i].idVendor) && (idProduct == pid_vid_mapping[i].idProduct)) {
             println("Match PID/VID: ", i, DEC);
-            if (exclude_hid_devices && pid_vid_mapping[i].hidDevice) return UNKNOWN;
-            return pid_vid_mapping[i].joyType;
+            if (exclude_hid_devices && (pid_vid_mapping[i].info & JOY_HID_DEVICE)) return UNKNOWN;
+            return (joytype_t)(pid_vid_mapping[i].info & ~JOY_HID_DEVICE);
         }
     }
     return UNKNOWN;     // Not in our list
@@ -23,6 +23,7 @@
 
 #include <Arduino.h>
 #include "USBHost_t36.h"  // Read this header first for key info
+#include <malloc.h>
 
 
 // Memory allocation for Device_t, Pipe_t and Transfer_t structures.
@@ -54,12 +55,39 @@ static Device_t * free_Device_list = NULL;
 static Pipe_t * free_Pipe_list = NULL;
 static Transfer_t * free_Transfer_list = NULL;
 static strbuf_t * free_strbuf_list = NULL;
+static Isochronous_t * free_Isochronous_list = NULL;
+// Usage of each pool, so the free lists never need to be walked.
+// low_water is raised by contributions, so it always means the fewest
+// which were free, relative to the total now contributed.
+static pool_stats_t pool[USBHost::POOL_COUNT];
 // A small amount of non-driver memory, just to get things started
 // TODO: is this really necessary?  Can these be eliminated, so we
 // use only memory from the drivers?
 static Device_t memory_Device[1];
 static Pipe_t memory_Pipe[1] __attribute__ ((aligned(32)));
 static Transfer_t memory_Transfer[4] __attribute__ ((aligned(32)));
+// Cache line aligned buffers for allocate_DMA_Buffer.  Each bit of
+// dma_used is 1 line in use, and dma_last marks each buffer's last line.
+#if USBHOST_DMA_POOL_SIZE > 0
+#define DMA_LINES  ((USBHOST_DMA_POOL_SIZE + 31) / 32)
+#ifdef USBHOST_DMA_POOL_DMAMEM
+DMAMEM
+#endif
+static uint8_t dma_pool[DMA_LINES * 32] __attribute__ ((aligned(32)));
+static uint32_t dma_used[(DMA_LINES + 31) / 32];
+static uint32_t dma_last[(DMA_LINES + 31) / 32];
+#endif
+
+static inline void pool_allocated(pool_stats_t *p)
+{
+	if (--p->available < p->low_water) p->low_water = p->available;
+}
+
+static inline void pool_contributed(pool_stats_t *p, uint32_t num)
+{
+	p->total += num;
+	p->low_water += num;
+}
 
 void USBHost::init_Device_Pipe_Transfer_memory(void)
 {
@@ -71,7 +99,12 @@ void USBHost::init_Device_Pipe_Transfer_memory(void)
 Device_t * USBHost::allocate_Device(void)
 {
 	Device_t *device = free_Device_list;
-	if (device) free_Device_list = *(Device_t **)device;
+	if (device) {
+		free_Device_list = *(Device_t **)device;
+		pool_allocated(&pool[POOL_DEVICE]);
+	} else {
+		pool[POOL_DEVICE].failures++;
+	}
 	return device;
 }
 
@@ -79,12 +112,18 @@ void USBHost::free_Device(Device_t *device)
 {
 	*(Device_t **)device = free_Device_list;
 	free_Device_list = device;
+	pool[POOL_DEVICE].available++;
 }
 
 Pipe_t * USBHost::allocate_Pipe(void)
 {
 	Pipe_t *pipe = free_Pipe_list;
-	if (pipe) free_Pipe_list = *(Pipe_t **)pipe;
+	if (pipe) {
+		free_Pipe_list = *(Pipe_t **)pipe;
+		pool_allocated(&pool[POOL_PIPE]);
+	} else {
+		pool[POOL_PIPE].failures++;
+	}
 	return pipe;
 }
 
@@ -92,12 +131,18 @@ void USBHost::free_Pipe(Pipe_t *pipe)
 {
 	*(Pipe_t **)pipe = free_Pipe_list;
 	free_Pipe_list = pipe;
+	pool[POOL_PIPE].available++;
 }
 
 Transfer_t * USBHost::allocate_Transfer(void)
 {
 	Transfer_t *transfer = free_Transfer_list;
-	if (transfer) free_Transfer_list = *(Transfer_t **)transfer;
+	if (transfer) {
+		free_Transfer_list = *(Transfer_t **)transfer;
+		pool_allocated(&pool[POOL_TRANSFER]);
+	} else {
+		pool[POOL_TRANSFER].failures++;
+	}
 	return transfer;
 }
 
@@ -105,6 +150,26 @@ void USBHost::free_Transfer(Transfer_t *transfer)
 {
 	*(Transfer_t **)transfer = free_Transfer_list;
 	free_Transfer_list = transfer;
+	pool[POOL_TRANSFER].available++;
+}
+
+Isochronous_t * USBHost::allocate_Isochronous(void)
+{
+	Isochronous_t *iso = free_Isochronous_list;
+	if (iso) {
+		free_Isochronous_list = *(Isochronous_t **)iso;
+		pool_allocated(&pool[POOL_ISOCHRONOUS]);
+	} else {
+		pool[POOL_ISOCHRONOUS].failures++;
+	}
+	return iso;
+}
+
+void USBHost::free_Isochronous(Isochronous_t *iso)
+{
+	*(Isochronous_t **)iso = free_Isochronous_list;
+	free_Isochronous_list = iso;
+	pool[POOL_ISOCHRONOUS].available++;
 }
 
 strbuf_t * USBHost::allocate_string_buffer(void)
@@ -116,7 +181,10 @@ strbuf_t * USBHost::allocate_string_buffer(void)
 		strbuf->iStrings[strbuf_t::STR_ID_PROD] = 0;
 		strbuf->iStrings[strbuf_t::STR_ID_SERIAL] = 0;
 		strbuf->buffer[0] = 0;	// have trailing NULL..
-	} 
+		pool_allocated(&pool[POOL_STRBUF]);
+	} else {
+		pool[POOL_STRBUF].failures++;
+	}
 	return strbuf;
 }
 
@@ -124,6 +192,7 @@ void USBHost::free_string_buffer(strbuf_t *strbuf)
 {
 	*(strbuf_t **)strbuf = free_strbuf_list;
 	free_strbuf_list = strbuf;
+	pool[POOL_STRBUF].available++;
 }
 
 void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
@@ -132,6 +201,7 @@ void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
 	for (Device_t *device = devices ; device < end; device++) {
 		free_Device(device);
 	}
+	pool_contributed(&pool[POOL_DEVICE], num);
 }
 
 void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
@@ -140,7 +210,7 @@ void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
 	for (Pipe_t *pipe = pipes; pipe < end; pipe++) {
 		free_Pipe(pipe);
 	}
-
+	pool_contributed(&pool[POOL_PIPE], num);
 }
 
 void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num)
@@ -149,6 +219,7 @@ void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num)
 	for (Transfer_t *transfer = transfers ; transfer < end; transfer++) {
 		free_Transfer(transfer);
 	}
+	pool_contributed(&pool[POOL_TRANSFER], num);
 }
 
 void USBHost::contribute_String_Buffers(strbuf_t *strbufs, uint32_t num)
@@ -157,36 +228,111 @@ void USBHost::contribute_String_Buffers(strbuf_t *strbufs, uint32_t num)
 	for (strbuf_t *str = strbufs ; str < end; str++) {
 		free_string_buffer(str);
 	}
+	pool_contributed(&pool[POOL_STRBUF], num);
 }
 
-// for debugging, hopefully never needed...
-void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers, uint32_t &strs)
+void USBHost::contribute_Isochronous(Isochronous_t *isos, uint32_t num)
+{
+	Isochronous_t *end = isos + num;
+	for (Isochronous_t *iso = isos ; iso < end; iso++) {
+		free_Isochronous(iso);
+	}
+	pool_contributed(&pool[POOL_ISOCHRONOUS], num);
+}
+
+#if USBHOST_DMA_POOL_SIZE > 0
+static inline bool dma_line_used(uint32_t line)
 {
-	uint32_t ndev=0, npipe=0, ntransfer=0, nstr=0;
+	return dma_used[line >> 5] & (1 << (line & 31));
+}
+
+void * USBHost::allocate_DMA_Buffer(uint32_t size)
+{
+	uint32_t lines = (size + 31) >> 5;
+	if (lines == 0 || lines > DMA_LINES) return NULL;
 	__disable_irq();
-	Device_t *dev = free_Device_list;
-	while (dev) {
-		ndev++;
-		dev = *(Device_t **)dev;
+	if (pool[POOL_DMA_BUFFER].total == 0) {
+		pool_contributed(&pool[POOL_DMA_BUFFER], DMA_LINES);
+		pool[POOL_DMA_BUFFER].available = DMA_LINES;
 	}
-	Pipe_t *pipe = free_Pipe_list;
-	while (pipe) {
-		npipe++;
-		pipe = *(Pipe_t **)pipe;
+	// first fit
+	uint32_t start = 0, count = 0;
+	for (uint32_t line=0; line < DMA_LINES; line++) {
+		if (dma_line_used(line)) {
+			count = 0;
+			start = line + 1;
+		} else if (++count == lines) {
+			for (uint32_t i=start; i <= line; i++) {
+				dma_used[i >> 5] |= 1 << (i & 31);
+			}
+			dma_last[line >> 5] |= 1 << (line & 31);
+			pool_stats_t *p = &pool[POOL_DMA_BUFFER];
+			p->available -= lines;
+			if (p->available < p->low_water) p->low_water = p->available;
+			__enable_irq();
+			return dma_pool + start * 32;
+		}
 	}
-	Transfer_t *transfer = free_Transfer_list;
-	while (transfer) {
-		ntransfer++;
-		transfer = *(Transfer_t **)transfer;
+	pool[POOL_DMA_BUFFER].failures++;
+	__enable_irq();
+	return NULL;
+}
+
+void USBHost::free_DMA_Buffer(void *buffer)
+{
+	uint32_t offset = (uint8_t *)buffer - dma_pool;
+	if (buffer == NULL || offset >= sizeof(dma_pool) || (offset & 31)) return;
+	__disable_irq();
+	for (uint32_t line = offset >> 5; line < DMA_LINES && dma_line_used(line); line++) {
+		uint32_t bit = 1 << (line & 31);
+		dma_used[line >> 5] &= ~bit;
+		pool[POOL_DMA_BUFFER].available++;
+		if (dma_last[line >> 5] & bit) {
+			dma_last[line >> 5] &= ~bit;
+			break;
+		}
 	}
-	strbuf_t *str = free_strbuf_list;
-	while (str) {
-		nstr++;
-		str = *(strbuf_t **)str;
+	__enable_irq();
+}
+#else
+void * USBHost::allocate_DMA_Buffer(uint32_t size)
+{
+	if (size == 0) return NULL;
+	return memalign(32, (size + 31) & ~31);
+}
+
+void USBHost::free_DMA_Buffer(void *buffer)
+{
+	free(buffer);
+}
+#endif
+
+// for debugging, hopefully never needed...
+void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers, uint32_t &strs)
+{
+	devices = pool[POOL_DEVICE].available;
+	pipes = pool[POOL_PIPE].available;
+	transfers = pool[POOL_TRANSFER].available;
+	strs = pool[POOL_STRBUF].available;
+}
+
+void USBHost::poolStats(uint32_t which, pool_stats_t &stats)
+{
+	if (which >= POOL_COUNT) {
+		memset(&stats, 0, sizeof(stats));
+		return;
+	}
+	__disable_irq();
+	stats = pool[which];
+	__enable_irq();
+}
+
+void USBHost::resetPoolStats()
+{
+	__disable_irq();
+	for (uint32_t i=0; i < POOL_COUNT; i++) {
+		pool[i].low_water = pool[i].available;
+		pool[i].failures = 0;
 	}
 	__enable_irq();
-	devices = ndev;
-	pipes = npipe;
-	transfers = ntransfer;
-	strs = nstr;
 }
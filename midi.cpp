@@ -27,10 +27,10 @@
 #define print   USBHost::print_
 #define println USBHost::println_
 
-void MIDIDeviceBase::init()
+void MIDIDeviceBase::init(Pipe_t *pipes, uint32_t num_pipes, Transfer_t *transfers, uint32_t num_transfers)
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Pipes(pipes, num_pipes);
+	contribute_Transfers(transfers, num_transfers);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	handleNoteOff = NULL;
 	handleNoteOn = NULL;
@@ -52,8 +52,6 @@ void MIDIDeviceBase::init()
 	handleActiveSensing = NULL;
 	handleSystemReset = NULL;
 	handleRealTimeSystem = NULL;
-	rx_head = 0;
-	rx_tail = 0;
 	rxpipe = NULL;
 	txpipe = NULL;
 	driver_ready_for_device(this);
@@ -208,8 +206,7 @@ bool MIDIDeviceBase::claim(Device_t *dev, int type, const uint8_t *descriptors,
 	} else {
 		txpipe = NULL;
 	}
-	rx_head = 0;
-	rx_tail = 0;
+	rx_ring.clear();
 	msg_channel = 0;
 	msg_type = 0;
 	msg_data1 = 0;
@@ -239,18 +236,11 @@ void MIDIDeviceBase::rx_data(const Transfer_t *transfer)
 	print("  MIDI Data: ");
 	uint32_t len = (transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF)) >> 2;
 	print_hexbytes(transfer->buffer, len * 4);
-	uint32_t head = rx_head;
-	uint32_t tail = rx_tail;
 	for (uint32_t i=0; i < len; i++) {
 		uint32_t msg = rx_buffer[i];
-		if (msg) {
-			if (++head >= rx_queue_size) head = 0;
-			rx_queue[head] = msg;
-		}
+		if (msg && !rx_ring.put(msg)) rx_dropped++;
 	}
-	rx_head = head;
-	rx_tail = tail;
-	uint32_t avail = (head < tail) ? tail - head - 1 : rx_queue_size - 1 - head + tail;
+	uint32_t avail = rx_ring.space();
 	//println("rx_size = ", rx_size);
 	println("avail = ", avail);
 	if (avail >= (uint32_t)(rx_size>>2)) {
@@ -394,19 +384,11 @@ void MIDIDeviceBase::send_sysex_add_term_bytes(const uint8_t *data, uint32_t len
 
 bool MIDIDeviceBase::read(uint8_t channel)
 {
-	uint32_t n, head, tail, avail, ch, type1, type2, b1;
-	__disable_irq();
+	uint32_t n, ch, type1, type2, b1;
 	bool packet_queued = rx_packet_queued;
-	head = rx_head;
-	tail = rx_tail;
-	__enable_irq();
-	if (head == tail) return false;
-	if (++tail >= rx_queue_size) tail = 0;
-	n = rx_queue[tail];
-	rx_tail = tail;
+	if (!rx_ring.get(n)) return false;
 	if (!packet_queued && rxpipe) {
-	        avail = (head < tail) ? tail - head - 1 : rx_queue_size - 1 - head + tail;
-		if (avail >= (uint32_t)(rx_size>>2)) {
+		if (rx_ring.space() >= (uint32_t)(rx_size>>2)) {
 			rx_packet_queued = true;
 			queue_Data_Transfer(rxpipe, rx_buffer, rx_size, this);
 		}
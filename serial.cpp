@@ -42,23 +42,28 @@
 /************************************************************/
 //  Define mapping VID/PID - to Serial Device type.
 /************************************************************/
-USBSerialBase::product_vendor_mapping_t USBSerialBase::pid_vid_mapping[] = {
+const usb_match_t USBSerialBase::pid_vid_mapping[] = {
 	// FTDI mappings. 
-	{0x0403, 0x6001, USBSerialBase::FTDI, 0},
-	{0x0403, 0x8088, USBSerialBase::FTDI, 1},  // 2 devices try to claim at interface level
-	{0x0403, 0x6010, USBSerialBase::FTDI, 1},  // Also Dual Serial, so claim at interface level
+	USB_MATCH_ID(0, 0x0403, 0x6001, USBSerialBase::FTDI),
+	USB_MATCH_ID(1, 0x0403, 0x8088, USBSerialBase::FTDI),  // 2 devices try to claim at interface level
+	USB_MATCH_ID(1, 0x0403, 0x6010, USBSerialBase::FTDI),  // Also Dual Serial, so claim at interface level
 
 	// PL2303
-	{0x67B,0x2303, USBSerialBase::PL2303, 0}, 
+	USB_MATCH_ID(0, 0x67B,0x2303, USBSerialBase::PL2303), 
 
 	// CH341
-	{0x4348, 0x5523, USBSerialBase::CH341, 0},
-	{0x1a86, 0x7523, USBSerialBase::CH341, 0 },
-	{0x1a86, 0x5523, USBSerialBase::CH341, 0 },
+	USB_MATCH_ID(0, 0x4348, 0x5523, USBSerialBase::CH341),
+	USB_MATCH_ID(0, 0x1a86, 0x7523, USBSerialBase::CH341),
+	USB_MATCH_ID(0, 0x1a86, 0x5523, USBSerialBase::CH341),
 
 	// Silex CP210...
-	{0x10c4, 0xea60, USBSerialBase::CP210X, 0 },
-	{0x10c4, 0xea70, USBSerialBase::CP210X, 0 }
+	USB_MATCH_ID(0, 0x10c4, 0xea60, USBSerialBase::CP210X),
+	USB_MATCH_ID(0, 0x10c4, 0xea70, USBSerialBase::CP210X),
+
+	// CDCACM, as a whole device, an IAD group or the data interface of a composite device
+	USB_MATCH_SUBCLASS(0, 2, 0, USBSerialBase::CDCACM),
+	USB_MATCH_SUBCLASS(2, 2, 2, USBSerialBase::CDCACM),
+	USB_MATCH_PROTOCOL(1, 0x0A, 0, 0, USBSerialBase::CDCACM)
 };
 
 
@@ -66,12 +71,16 @@ USBSerialBase::product_vendor_mapping_t USBSerialBase::pid_vid_mapping[] = {
 //  Initialization and claiming of devices & interfaces
 /************************************************************/
 
-void USBSerialBase::init()
+void USBSerialBase::init(Pipe_t *pipes, uint32_t num_pipes, Transfer_t *transfers, uint32_t num_transfers)
 {
-	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Pipes(pipes, num_pipes);
+	contribute_Transfers(transfers, num_transfers);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
-	driver_ready_for_device(this);
+	if (_vid_to_claim) {
+		driver_ready_for_device(this); // also offered the custom VID/PID
+	} else {
+		driver_ready_for_device(this, pid_vid_mapping, sizeof(pid_vid_mapping)/sizeof(pid_vid_mapping[0]));
+	}
 	format_ = USBHOST_SERIAL_8N1;
 }
 
@@ -86,10 +95,22 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
    	println(", bDeviceProtocol = ", dev->bDeviceProtocol);
 	print_hexbytes(descriptors, len);
 
+	//---------------------------------------------------------------------------
+	// A composite device's CDCACM function, grouped by an IAD, is claimed
+	// like a whole CDCACM device.  Skip the IAD to its interfaces.
+	bool cdc_function = false;
+	if (type == 2) {
+		if (descriptors[4] != 2 || descriptors[5] != 2) return false; // CDC ACM
+		if (len < (uint32_t)descriptors[0] + 9) return false;
+		len -= descriptors[0];
+		descriptors += descriptors[0];
+		cdc_function = true;
+	}
+
 	//---------------------------------------------------------------------------
 	// Lets try to map CDCACM devices only at device level
-	if ((dev->bDeviceClass == 2) && (dev->bDeviceSubClass == 0)) {
-		if (type != 0) return false;
+	if (cdc_function || ((dev->bDeviceClass == 2) && (dev->bDeviceSubClass == 0))) {
+		if (type == 1) return false;
 
 		// It is a communication device see if we can extract the data... 
 		// Try some ttyACM types? 
@@ -183,8 +204,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		println(", tx:", tx_ep);
 		if (!rx_ep || !tx_ep) return false; 	// did not get our two end points
 		if (!init_buffers(rx_size, tx_size)) return false;
-		println("  rx buffer size:", rxsize);
-		println("  tx buffer size:", txsize);
+		println("  rx buffer size:", rxring.size());
+		println("  tx buffer size:", txring.size());
 		rxpipe = new_Pipe(dev, 2, rx_ep & 15, 1, rx_size);
 		if (!rxpipe) return false;
 		txpipe = new_Pipe(dev, 2, tx_ep, 0, tx_size);
@@ -234,9 +255,10 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		sertype =_vid_pid_sertype;
 	} else {
 		for (uint8_t i = 0; i < (sizeof(pid_vid_mapping)/sizeof(pid_vid_mapping[0])); i++) {
+			if (!(pid_vid_mapping[i].flags & USB_MATCH_FLAG_ID)) continue;
 			if ((dev->idVendor == pid_vid_mapping[i].idVendor) && (dev->idProduct == pid_vid_mapping[i].idProduct)) {
-				sertype = pid_vid_mapping[i].sertype;
-				if (pid_vid_mapping[i].claim_at_type != type) {
+				sertype = (sertype_t)pid_vid_mapping[i].info;
+				if (pid_vid_mapping[i].level != type) {
 					println("Serial device wants to map at interface level");
 					return false;
 				}
@@ -314,8 +336,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 	println(")");
 
 	if (!init_buffers(rx_size, tx_size)) return false;
-	println("  rx buffer size:", rxsize);
-	println("  tx buffer size:", txsize);
+	println("  rx buffer size:", rxring.size());
+	println("  tx buffer size:", txring.size());
 
 	rxpipe = new_Pipe(dev, 2, rxep & 15, 1, rx_size);
 	if (!rxpipe) return false;
@@ -435,15 +457,12 @@ bool USBSerialBase::init_buffers(uint32_t rsize, uint32_t tsize)
 	rx2 = rx1 + rsize;
 	tx1 = rx2 + rsize;
 	tx2 = tx1 + tsize;
-	rxbuf = tx2 + tsize;
-	// FIXME: this assume 50-50 split - not true when rsize != tsize
-	rxsize = (_big_buffer_size - (rsize + tsize) * 2) / 2;
-	txsize = rxsize;
-	txbuf = rxbuf + rxsize;
-	rxhead = 0;
-	rxtail = 0;
-	txhead = 0;
-	txtail = 0;
+	// the rest is split between the rings, receive gets any odd byte
+	uint32_t remain = _big_buffer_size - (rsize + tsize) * 2;
+	uint32_t txsize = remain / 2;
+	uint32_t rxsize = remain - txsize;
+	rxring.begin(tx2 + tsize, rxsize);
+	txring.begin(tx2 + tsize + rxsize, txsize);
 	rxstate = 0;
 	return true;
 }
@@ -1037,58 +1056,36 @@ void USBSerialBase::rx_data(const Transfer_t *transfer)
 	// Copy data from packet buffer to circular buffer.
 	// Assume the buffer will always have space, since we
 	// check before queuing the buffers
-	uint32_t head = rxhead;
-	uint32_t tail = rxtail;
-	if (++head >= rxsize) head = 0;
-	uint32_t avail;
-	if (len > 0) {
-		//print("head=", head);
-		//print(", tail=", tail);
-		avail = rxsize - head;
-		//print(", avail=", avail);
-		//println(", rxsize=", rxsize);
-		if (avail > len) avail = len;
-		memcpy(rxbuf + head, p, avail);
-		if (len <= avail) {
-			head += avail - 1;
-			if (head >= rxsize) head = 0;
-		} else {
-			head = len - avail - 1;
-			memcpy(rxbuf, p + avail, head + 1);
-		}
-		rxhead = head;
-	}
+	if (len > 0) rxring.write(p, len);
 	// TODO: can be this more efficient?  We know from above which
 	// buffer is no longer queued, so possible skip most of this work?
-	rx_queue_packets(head, tail);
+	rx_queue_packets();
 }
 
 // re-queue packet buffer(s) if possible
-void USBSerialBase::rx_queue_packets(uint32_t head, uint32_t tail)
+void USBSerialBase::rx_queue_packets()
 {
-	uint32_t avail;
-	if (head >= tail) {
-		avail = rxsize - 1 - head + tail;
-	} else {
-		avail = tail - head - 1;
-	}
+	uint32_t avail = rxring.space();
 	uint32_t packetsize = rx2 - rx1;
+	// a buffer already queued may still fill, so reserve space for it
+	if (rxstate & 0x01) avail = (avail > packetsize) ? avail - packetsize : 0;
+	if (rxstate & 0x02) avail = (avail > packetsize) ? avail - packetsize : 0;
 	if (avail >= packetsize) {
-		if ((rxstate & 0x01) == 0) {
-			queue_Data_Transfer(rxpipe, rx1, packetsize, this);
-			rxstate |= 0x01;
-		} else if ((rxstate & 0x02) == 0) {
-			queue_Data_Transfer(rxpipe, rx2, packetsize, this);
-			rxstate |= 0x02;
+		// queue 1 or both buffers together, as space allows
+		uint32_t count = (avail >= packetsize * 2) ? 2 : 1;
+		uint32_t state = rxstate;
+		batch_t batch[2];
+		uint32_t num = 0;
+		if ((state & 0x01) == 0) {
+			batch[num++] = {rx1, packetsize, this};
+			state |= 0x01;
 		}
-		if ((rxstate & 0x03) != 0x03 && avail >= packetsize * 2) {
-			if ((rxstate & 0x01) == 0) {
-				queue_Data_Transfer(rxpipe, rx1, packetsize, this);
-				rxstate |= 0x01;
-			} else if ((rxstate & 0x02) == 0) {
-				queue_Data_Transfer(rxpipe, rx2, packetsize, this);
-				rxstate |= 0x02;
-			}
+		if ((state & 0x02) == 0 && num < count) {
+			batch[num++] = {rx2, packetsize, this};
+			state |= 0x02;
+		}
+		if (num > 0 && queue_Data_Transfers(rxpipe, batch, num)) {
+			rxstate = state;
 		}
 	}
 }
@@ -1111,14 +1108,7 @@ void USBSerialBase::tx_data(const Transfer_t *transfer)
 		return; // should never happen
 	}
 	// check how much more data remains in the transmit buffer
-	uint32_t head = txhead;
-	uint32_t tail = txtail;
-	uint32_t count;
-	if (head >= tail) {
-		count = head - tail;
-	} else {
-		count = txsize + head - tail;
-	}
+	uint32_t count = txring.available();
 	uint32_t packetsize = tx2 - tx1;
 	// Only output full packets unless the flush bit was set.
 	if ((count == 0) || ((count < packetsize) && ((txstate & 0x4) == 0) )) {
@@ -1132,19 +1122,7 @@ void USBSerialBase::tx_data(const Transfer_t *transfer)
 	else txstate &= ~(mask | 4); // This packet will complete any outstanding flush
 
 	println("TX:moar data!!!!");
-	if (++tail >= txsize) tail = 0;
-	uint32_t n = txsize - tail;
-	if (n > count) n = count;
-	memcpy(p, txbuf + tail, n);
-	if (n >= count) {
-		tail += n - 1;
-		if (tail >= txsize) tail = 0;
-	} else {
-		uint32_t len = count - n;
-		memcpy(p + n, txbuf, len);
-		tail = len - 1;
-	}
-	txtail = tail;
+	txring.read(p, count);
 	queue_Data_Transfer(txpipe, p, count, this);
 	debugDigitalWrite(5, LOW);
 }
@@ -1152,7 +1130,7 @@ void USBSerialBase::tx_data(const Transfer_t *transfer)
 void USBSerialBase::flush()
 {
 	print("USBSerialBase::flush");
- 	if (txhead == txtail) {
+ 	if (txring.empty()) {
  		println(" - Empty");
  		return;  // empty.
  	}
@@ -1173,17 +1151,11 @@ void USBSerialBase::timer_event(USBDriverTimer *whichTimer)
 {
 	debugDigitalWrite(7, HIGH);
 	println("txtimer");
-	uint32_t count;
-	uint32_t head = txhead;
-	uint32_t tail = txtail;
-	if (head == tail) {
+	uint32_t count = txring.available();
+	if (count == 0) {
 		println("  *** Empty ***");
 		debugDigitalWrite(7, LOW);
 		return; // nothing to transmit
-	} else if (head > tail) {
-		count = head - tail;
-	} else {
-		count = txsize + head - tail;
 	}
 
 	uint8_t *p;
@@ -1208,19 +1180,7 @@ void USBSerialBase::timer_event(USBDriverTimer *whichTimer)
 		count = packetsize;
 	}
 
-	if (++tail >= txsize) tail = 0;
-	uint32_t n = txsize - tail;
-	if (n > count) n = count;
-	memcpy(p, txbuf + tail, n);
-	if (n >= count) {
-		tail += n - 1;
-		if (tail >= txsize) tail = 0;
-	} else {
-		uint32_t len = count - n;
-		memcpy(p + n, txbuf, len);
-		tail = len - 1;
-	}
-	txtail = tail;
+	txring.read(p, count);
 	print("  TX data (", count);
 	print(") ");
 	print_hexbytes(p, count);
@@ -1276,41 +1236,47 @@ void USBSerialBase::end(void)
 
 	// Wait until all packets have been queued before we return to caller. 
 	elapsedMillis em;
-	while (pending_control && em < 1000) {
+	while ((pending_control || (txstate & 3)) && em < 1000) {
 		yield();	// not sure if we want to yield or what? 
 	}
 	if (pending_control) {
 		println("USBSerialBase::end timeout", pending_control, HEX);
 	}
+	// discard transmit data the device didn't accept, so a stuck
+	// transfer can't hold the buffers after begin() is called again
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	txtimer.stop();
+	if (device && (txstate & 3)) {
+		uint32_t n = cancel_Transfers(txpipe);
+		println("USBSerialBase::end cancelled ", n);
+	}
+	txstate = 0;
+	txring.clear();
+	NVIC_ENABLE_IRQ(IRQ_USBHS);
 }
 
 int USBSerialBase::available(void)
 {
 	if (!device) return 0;
-	uint32_t head = rxhead;
-	uint32_t tail = rxtail;
-	if (head >= tail) return head - tail;
-	return rxsize + head - tail;
+	return rxring.available();
 }
 
 int USBSerialBase::peek(void)
 {
 	if (!device) return -1;
-	if (rxhead == rxtail) return -1;
-	uint16_t tail = rxtail + 1;
-	if (tail >= rxsize) tail = 0;
-	return rxbuf[tail];
+	const uint8_t *p = rxring.peek();
+	if (!p) return -1;
+	return *p;
 }
 
 int USBSerialBase::read(void)
 {
 	if (!device) return -1;
-	if (rxhead == rxtail) return -1;
-	if (++rxtail >= rxsize) rxtail = 0;
-	int c = rxbuf[rxtail];
+	uint8_t c;
+	if (!rxring.get(c)) return -1;
 	if ((rxstate & 0x03) != 0x03) {
 		NVIC_DISABLE_IRQ(IRQ_USBHS);
-		rx_queue_packets(rxhead, rxtail);
+		rx_queue_packets();
 		NVIC_ENABLE_IRQ(IRQ_USBHS);
 	}
 	return c;
@@ -1319,78 +1285,58 @@ int USBSerialBase::read(void)
 int USBSerialBase::availableForWrite()
 {
 	if (!device) return 0;
-	uint32_t head = txhead;
-	uint32_t tail = txtail;
-	if (head >= tail) return txsize - 1 - head + tail;
-	return tail - head - 1;
+	return txring.space();
 }
 
 size_t USBSerialBase::write(uint8_t c)
+{
+	return write(&c, 1);
+}
+
+size_t USBSerialBase::write(const uint8_t *buffer, size_t size)
 {
 	if (!device) return 0;
-	uint32_t head = txhead;
-	if (++head >= txsize) head = 0;
-	while (txtail == head) {
-		// wait...
+	size_t count = 0;
+	while (count < size) {
+		uint32_t n = txring.write(buffer + count, size - count);
+		count += n;
+		if (n == 0) {
+			yield(); // wait for the transmit buffer to drain
+			continue;
+		}
+		NVIC_DISABLE_IRQ(IRQ_USBHS);
+		tx_queue_packets();
+		NVIC_ENABLE_IRQ(IRQ_USBHS);
 	}
-	txbuf[head] = c;
-	txhead = head;
-	//print("head=", head);
-	//println(", tail=", txtail);
+	return count;
+}
 
-	// if full packet in buffer and tx packet ready, queue it
-	NVIC_DISABLE_IRQ(IRQ_USBHS);
-	uint32_t tail = txtail;
-	if ((txstate & 0x03) != 0x03) {
-		// at least one packet buffer is ready to transmit
-		uint32_t count;
-		if (head >= tail) {
-			count = head - tail;
+// with USB interrupt disabled: if full packets are in the buffer and
+// tx packets are ready, queue them
+void USBSerialBase::tx_queue_packets()
+{
+	uint32_t packetsize = tx2 - tx1;
+	bool queued = false;
+	while ((txstate & 0x03) != 0x03 && txring.available() >= packetsize) {
+		uint8_t *p;
+		if ((txstate & 0x01) == 0) {
+			p = tx1;
+			txstate |= 0x01;
 		} else {
-			count = txsize + head - tail;
-		}
-		uint32_t packetsize = tx2 - tx1;
-		if (count >= packetsize) {
-			//println("txsize=", txsize);
-			uint8_t *p;
-			if ((txstate & 0x01) == 0) {
-				p = tx1;
-				txstate |= 0x01;
-			} else /* if ((txstate & 0x02) == 0) */ {
-				p = tx2;
-				txstate |= 0x02;
-			}
-			// copy data to packet buffer
-			if (++tail >= txsize) tail = 0;
-			uint32_t n = txsize - tail;
-			if (n > packetsize) n = packetsize;
-			//print("memcpy, offset=", tail);
-			//println(", len=", n);
-			memcpy(p, txbuf + tail, n);
-			if (n >= packetsize) {
-				tail += n - 1;
-				if (tail >= txsize) tail = 0;
-			} else {
-				//n = txsize - n;
-				uint32_t len = packetsize - n;
-				//println("memcpy, offset=0, len=", len);
-				memcpy(p + n, txbuf, len);
-				tail = len - 1;
-			}
-			txtail = tail;
-			//println("queue tx packet, newtail=", tail);
-			debugDigitalWrite(7, HIGH);
-			queue_Data_Transfer(txpipe, p, packetsize, this);
-			debugDigitalWrite(7, LOW);
-			NVIC_ENABLE_IRQ(IRQ_USBHS);
-			return 1;
+			p = tx2;
+			txstate |= 0x02;
 		}
+		// copy data to packet buffer
+		txring.read(p, packetsize);
+		debugDigitalWrite(7, HIGH);
+		queue_Data_Transfer(txpipe, p, packetsize, this);
+		debugDigitalWrite(7, LOW);
+		queued = true;
 	}
+	if (queued && txring.empty()) return;
 	// otherwise, set a latency timer to later transmit partial packet
 	txtimer.stop();
 	txtimer.start(write_timeout_);
-	NVIC_ENABLE_IRQ(IRQ_USBHS);
-	return 1;
 }
 
 bool USBSerialBase::setDTR(bool fSet)
@@ -0,0 +1,663 @@
+/* USB EHCI Host for Teensy 3.6
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#if defined(USBHOST_SIMULATOR)
+#include <stdint.h>
+#include <string.h>
+#include "ehci_sim.h"
+
+// Simulated EHCI controller.  See ehci_sim.h for usage.
+//
+// Only what ehci.cpp actually uses is modeled.  Each microframe, the
+// periodic schedule entry for the current frame is walked, then the
+// async schedule loop, executing transactions with the connected
+// device until the microframe's bus time is used up.  Completion and
+// error interrupts follow the USBCMD interrupt threshold (ITC).
+
+#define ACCESS_NS	50	// simulated time used by each register access
+#define UFRAME_NS	125000
+#define RESET_US	20000	// port reset duration
+
+#define P(addr) ((volatile uint32_t *)(uintptr_t)(addr))
+
+static uint32_t regs[EHCI_SIM_NUM_REGS];
+static uint64_t sim_ns=0;
+static uint64_t next_uframe_ns=UFRAME_NS;
+static uint64_t gptimer_ns[2];       // time when each GPTIMER expires
+static uint64_t port_reset_ns=0;     // time when port reset completes
+static uint32_t sts_pending=0;       // interrupts waiting for ITC
+static uint32_t uframe_count=0;
+static bool irq_enabled=false;
+static bool irq_global=true;
+static bool in_isr=false;
+static void (*isr_function)(void) = NULL;
+static EHCISimDevice *device = NULL;
+static int budget;                   // bytes of bus time left this microframe
+static uint32_t skip_uframes=0;      // periodic schedule not run, to model missed frames
+
+// control transfer state, for the device's endpoint 0
+static uint8_t ctrl_setup[8];
+static uint8_t ctrl_buf[4096];
+static uint32_t ctrl_len, ctrl_pos;
+static bool ctrl_stall;
+
+ehci_sim_stats_t ehci_sim_stats;
+uint32_t ehci_sim_dummy;
+
+static void sim_advance(uint64_t ns);
+
+static void deliver_interrupts(void)
+{
+	if (!isr_function || !irq_enabled || !irq_global || in_isr) return;
+	for (int i=0; i < 8; i++) {
+		if (!(regs[EHCI_SIM_USBSTS] & regs[EHCI_SIM_USBINTR] & 0x030F003F)) break;
+		in_isr = true;
+		ehci_sim_stats.interrupts++;
+		(*isr_function)();
+		in_isr = false;
+	}
+}
+
+static void controller_reset(void)
+{
+	memset(regs + EHCI_SIM_USBCMD, 0, EHCI_SIM_PORTSC1 * sizeof(uint32_t));
+	regs[EHCI_SIM_USBCMD] = USBHS_USBCMD_ITC(8);
+	regs[EHCI_SIM_USBSTS] = USBHS_USBSTS_HCH;
+	regs[EHCI_SIM_PORTSC1] &= USBHS_PORTSC_CCS | USBHS_PORTSC_PSPD(3);
+	regs[EHCI_SIM_GPTIMER0CTL] = 0;
+	regs[EHCI_SIM_GPTIMER1CTL] = 0;
+	sts_pending = 0;
+}
+
+uint32_t ehci_sim_read(uint32_t reg)
+{
+	sim_advance(ACCESS_NS);
+	if (reg == EHCI_SIM_GPTIMER0CTL || reg == EHCI_SIM_GPTIMER1CTL) {
+		int n = (reg == EHCI_SIM_GPTIMER0CTL) ? 0 : 1;
+		uint32_t ctl = regs[reg];
+		if (ctl & USBHS_GPTIMERCTL_RUN) {
+			uint64_t remain = (gptimer_ns[n] - sim_ns) / 1000;
+			ctl = (ctl & 0xFF000000) | (remain & 0xFFFFFF);
+		}
+		return ctl;
+	}
+	return regs[reg];
+}
+
+void ehci_sim_write(uint32_t reg, uint32_t val)
+{
+	switch (reg) {
+	case EHCI_SIM_USBCMD:
+		if (val & USBHS_USBCMD_RST) {
+			controller_reset();
+			return;
+		}
+		regs[reg] = val;
+		if (val & USBHS_USBCMD_RS) {
+			regs[EHCI_SIM_USBSTS] &= ~USBHS_USBSTS_HCH;
+		} else {
+			regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_HCH;
+		}
+		break;
+	case EHCI_SIM_USBSTS: // write 1 to clear
+		regs[reg] &= ~(val & 0x030F01FF);
+		break;
+	case EHCI_SIM_PORTSC1: {
+		const uint32_t ro = USBHS_PORTSC_CCS | USBHS_PORTSC_HSP | USBHS_PORTSC_PSPD(3);
+		const uint32_t w1c = USBHS_PORTSC_CSC | USBHS_PORTSC_PEC | USBHS_PORTSC_OCC;
+		const uint32_t hw = USBHS_PORTSC_PE | USBHS_PORTSC_PR;
+		uint32_t old = regs[reg];
+		uint32_t n = (old & ro) | (val & ~(ro | w1c | hw)) | (old & w1c & ~val)
+			| (old & val & USBHS_PORTSC_PE); // PE can only be cleared
+		if (old & USBHS_PORTSC_PR) {
+			n |= USBHS_PORTSC_PR; // reset in progress
+		} else if ((val & USBHS_PORTSC_PR) && (old & USBHS_PORTSC_CCS)) {
+			n = (n | USBHS_PORTSC_PR) & ~USBHS_PORTSC_PE;
+			port_reset_ns = sim_ns + (uint64_t)RESET_US * 1000;
+		}
+		regs[reg] = n;
+		} break;
+	case EHCI_SIM_GPTIMER0CTL:
+	case EHCI_SIM_GPTIMER1CTL: {
+		int n = (reg == EHCI_SIM_GPTIMER0CTL) ? 0 : 1;
+		regs[reg] = val & 0xFF000000;
+		if ((val & USBHS_GPTIMERCTL_RUN) && (val & USBHS_GPTIMERCTL_RST)) {
+			uint32_t ld = regs[reg - 1] & 0xFFFFFF;
+			gptimer_ns[n] = sim_ns + (uint64_t)(ld + 1) * 1000;
+		}
+		regs[reg] &= ~USBHS_GPTIMERCTL_RST;
+		} break;
+	case EHCI_SIM_PHY_CTRL:
+		break;
+	default:
+		regs[reg] = val;
+	}
+	deliver_interrupts();
+}
+
+// Copy data between a qTD's buffer, at its current offset, and buf
+static void qtd_copy(volatile uint32_t *q, volatile uint32_t *token, uint8_t *buf,
+	uint32_t len, bool to_memory)
+{
+	uint32_t cpage = (*token >> 12) & 7;
+	uint32_t offset = q[0] & 0xFFF;
+	while (len > 0 && cpage < 5) {
+		uint32_t n = 0x1000 - offset;
+		if (n > len) n = len;
+		uint8_t *p = (uint8_t *)(uintptr_t)((q[cpage] & 0xFFFFF000) + offset);
+		if (to_memory) {
+			memcpy(p, buf, n);
+		} else {
+			memcpy(buf, p, n);
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+		if (offset >= 0x1000) {
+			offset = 0;
+			cpage++;
+		}
+	}
+	q[0] = (q[0] & 0xFFFFF000) | offset;
+	*token = (*token & ~0x7000) | ((cpage & 7) << 12);
+}
+
+static int sim_in(EHCISimDevice *dev, uint32_t ep, uint8_t *buf, uint32_t maxlen)
+{
+	if (dev->halted & (1 << ep)) return EHCI_SIM_STALL;
+	int n = dev->in(ep, buf, maxlen);
+	if (n == EHCI_SIM_NAK) dev->naks++;
+	else if (n > 0) dev->in_bytes += n;
+	return n;
+}
+
+static int sim_out(EHCISimDevice *dev, uint32_t ep, const uint8_t *buf, uint32_t len)
+{
+	if (dev->halted & (1 << ep)) return EHCI_SIM_STALL;
+	int n = dev->out(ep, buf, len);
+	if (n == EHCI_SIM_NAK) dev->naks++;
+	else if (n > 0) dev->out_bytes += n;
+	return n;
+}
+
+// One transaction on endpoint 0.  Returns bytes, NAK or STALL
+static int control_packet(uint32_t pid, uint8_t *buf, uint32_t len)
+{
+	bool dir_in = (ctrl_setup[0] & 0x80);
+	uint16_t wLength = ctrl_setup[6] | (ctrl_setup[7] << 8);
+	if (pid == 2) { // SETUP
+		memcpy(ctrl_setup, buf, 8);
+		ctrl_pos = 0;
+		ctrl_len = 0;
+		ctrl_stall = false;
+		if (ctrl_setup[0] & 0x80) {
+			wLength = ctrl_setup[6] | (ctrl_setup[7] << 8);
+			if (wLength > sizeof(ctrl_buf)) wLength = sizeof(ctrl_buf);
+			int n = device->control(ctrl_setup, ctrl_buf, wLength);
+			if (n < 0) ctrl_stall = true;
+			else ctrl_len = n;
+		}
+		return 8;
+	}
+	if (ctrl_stall) return EHCI_SIM_STALL;
+	if (pid == 1) {
+		if (dir_in) { // data stage
+			uint32_t n = ctrl_len - ctrl_pos;
+			if (n > len) n = len;
+			memcpy(buf, ctrl_buf + ctrl_pos, n);
+			ctrl_pos += n;
+			return n;
+		}
+		// status stage of OUT or no data request
+		int n = device->control(ctrl_setup, ctrl_buf, ctrl_pos);
+		return (n < 0) ? EHCI_SIM_STALL : 0;
+	}
+	if (!dir_in) { // OUT data stage
+		if (ctrl_pos + len > sizeof(ctrl_buf) || ctrl_pos + len > wLength) return EHCI_SIM_STALL;
+		memcpy(ctrl_buf + ctrl_pos, buf, len);
+		ctrl_pos += len;
+	}
+	return len; // or status stage of IN request
+}
+
+static void qtd_writeback(volatile uint32_t *qh)
+{
+	volatile uint32_t *qtd = P(qh[3] & 0xFFFFFFE0);
+	qtd[2] = qh[6];
+	qtd[3] = qh[7];
+}
+
+// Execute transactions on a QH, up to max_packets or until the bus time
+// is used.  The QH overlay is updated as EHCI does, and completed qTD
+// tokens are written back.
+static void execute_qh(volatile uint32_t *qh, int max_packets, uint32_t done_irq)
+{
+	uint8_t buf[1024];
+	while (max_packets > 0 && budget > 0) {
+		uint32_t token = qh[6];
+		if (token & 0x40) return; // halted
+		if (!(token & 0x80)) {
+			// advance queue, fetch next qTD into the overlay
+			uint32_t next = qh[4];
+			if (next & 1) return;
+			volatile uint32_t *qtd = P(next & 0xFFFFFFE0);
+			if (!(qtd[2] & 0x80)) return;
+			qh[3] = next & 0xFFFFFFE0;
+			qh[4] = qtd[0];
+			qh[5] = qtd[1];
+			token = qtd[2];
+			if (!(qh[1] & 0x4000)) { // DTC=0, toggle from the QH
+				token = (token & 0x7FFFFFFF) | (qh[6] & 0x80000000);
+			}
+			qh[6] = token;
+			for (int i=0; i < 5; i++) qh[7+i] = qtd[3+i];
+			continue;
+		}
+		uint32_t pid = (token >> 8) & 3;
+		uint32_t remaining = (token >> 16) & 0x7FFF;
+		uint32_t maxp = (qh[1] >> 16) & 0x7FF;
+		uint32_t ep = (qh[1] >> 8) & 15;
+		uint32_t addr = qh[1] & 0x7F;
+		uint32_t len = (pid == 2) ? 8 : ((remaining < maxp) ? remaining : maxp);
+		if (len > sizeof(buf)) len = sizeof(buf);
+		int n;
+		if (!device || !(regs[EHCI_SIM_PORTSC1] & USBHS_PORTSC_PE) || device->address != addr) {
+			// nobody answers: transaction error, halt
+			qh[6] = (token & ~0x80) | 0x40 | 0x08;
+			qtd_writeback(qh);
+			sts_pending |= USBHS_USBSTS_UEI;
+			return;
+		}
+		ehci_sim_stats.transactions++;
+		budget -= len + 20;
+		if (pid == 1) { // IN
+			n = (ep == 0) ? control_packet(pid, buf, len) : sim_in(device, ep, buf, len);
+			if (n > (int)len) n = len;
+			if (n > 0) qtd_copy(qh + 7, qh + 6, buf, n, true);
+		} else { // OUT or SETUP
+			uint32_t tok = token;
+			uint32_t offset = qh[7];
+			qtd_copy(qh + 7, &tok, buf, len, false);
+			n = (ep == 0) ? control_packet(pid, buf, len) : sim_out(device, ep, buf, len);
+			if (n >= 0) {
+				qh[6] = tok;
+				n = len;
+			} else {
+				qh[7] = offset; // retry same data later
+			}
+		}
+		if (n == EHCI_SIM_NAK) {
+			ehci_sim_stats.naks++;
+			return;
+		}
+		if (n == EHCI_SIM_STALL) {
+			qh[6] = (qh[6] & ~0x80) | 0x40;
+			qtd_writeback(qh);
+			sts_pending |= USBHS_USBSTS_UEI;
+			return;
+		}
+		ehci_sim_stats.bytes += n;
+		max_packets--;
+		remaining -= n;
+		token = qh[6] ^ 0x80000000;
+		token = (token & 0x8000FFFF) | (remaining << 16);
+		bool short_packet = (pid == 1 && (uint32_t)n < maxp);
+		if (remaining == 0 || short_packet) {
+			token &= ~0x80;
+			qh[6] = token;
+			qtd_writeback(qh);
+			if (token & 0x8000) sts_pending |= USBHS_USBSTS_UI | done_irq;
+			if (short_packet && remaining > 0 && !(qh[5] & 1)) qh[4] = qh[5];
+		} else {
+			qh[6] = token;
+		}
+	}
+}
+
+static void execute_itd(volatile uint32_t *itd, uint32_t uframe)
+{
+	uint8_t buf[3072];
+	uint32_t t = itd[1 + uframe];
+	if (!(t & 0x80000000)) return;
+	uint32_t len = (t >> 16) & 0xFFF;
+	uint32_t ep = (itd[9] >> 8) & 15;
+	uint32_t addr = itd[9] & 0x7F;
+	if (len > sizeof(buf)) len = sizeof(buf);
+	uint8_t *p = (uint8_t *)(uintptr_t)((itd[9 + ((t >> 12) & 7)] & 0xFFFFF000) + (t & 0xFFF));
+	int n = 0;
+	if (device && device->address == addr) {
+		if (itd[10] & 0x800) { // IN
+			n = sim_in(device, ep, buf, len);
+			if (n > 0) memcpy(p, buf, n);
+		} else {
+			n = sim_out(device, ep, p, len);
+		}
+	}
+	if (n < 0) n = 0;
+	ehci_sim_stats.transactions++;
+	ehci_sim_stats.bytes += n;
+	budget -= len + 20;
+	t = (t & 0x0000FFFF) | ((n & 0xFFF) << 16);
+	if (itd[10] & 0x800 || n == (int)len) itd[1 + uframe] = t;
+	else itd[1 + uframe] = t | 0x40000000; // data buffer error
+	if (t & 0x8000) sts_pending |= USBHS_USBSTS_UI | USBHS_USBSTS_UPI;
+}
+
+static void execute_sitd(volatile uint32_t *sitd, uint32_t uframe)
+{
+	uint8_t buf[1024];
+	uint32_t state = sitd[3];
+	if (!(state & 0x80)) return;
+	if (!(sitd[2] & (1 << uframe))) return;
+	uint32_t total = (state >> 16) & 0x3FF;
+	uint32_t ep = (sitd[1] >> 8) & 15;
+	uint32_t addr = sitd[1] & 0x7F;
+	uint8_t *p = (uint8_t *)(uintptr_t)sitd[4];
+	int n = 0;
+	if (device && device->address == addr) {
+		if (sitd[1] & 0x80000000) { // IN
+			n = sim_in(device, ep, buf, total);
+			if (n > 0) memcpy(p, buf, n);
+		} else {
+			n = sim_out(device, ep, p, total);
+		}
+	}
+	if (n < 0) n = 0;
+	ehci_sim_stats.transactions++;
+	ehci_sim_stats.bytes += n;
+	budget -= total + 20;
+	state = (state & 0xFC00FF00) | ((total - n) << 16);
+	sitd[3] = state;
+	if (state & 0x80000000) sts_pending |= USBHS_USBSTS_UI | USBHS_USBSTS_UPI;
+}
+
+static void periodic_schedule(void)
+{
+	uint32_t cmd = regs[EHCI_SIM_USBCMD];
+	uint32_t size = ((cmd & USBHS_USBCMD_FS2) ? 64 : 1024) >> ((cmd >> 2) & 3);
+	uint32_t frindex = regs[EHCI_SIM_FRINDEX];
+	uint32_t uframe = frindex & 7;
+	uint32_t link = P(regs[EHCI_SIM_PERIODICLISTBASE])[(frindex >> 3) & (size - 1)];
+	for (int count=0; !(link & 1) && count < 1000; count++) {
+		volatile uint32_t *p = P(link & 0xFFFFFFE0);
+		switch ((link >> 1) & 3) {
+		case 0: execute_itd(p, uframe); break;
+		case 1:
+			if (p[2] & (1 << uframe)) {
+				execute_qh(p, (p[2] >> 30) ? (p[2] >> 30) : 1, USBHS_USBSTS_UPI);
+			}
+			break;
+		case 2: execute_sitd(p, uframe); break;
+		default: return; // FSTN not used
+		}
+		link = p[0];
+	}
+}
+
+static void async_schedule(void)
+{
+	uint32_t head = regs[EHCI_SIM_ASYNCLISTADDR] & 0xFFFFFFE0;
+	if (!head) return;
+	// walk the loop of QHs until no progress, or bus time used up
+	while (budget > 0) {
+		int before = budget;
+		uint32_t q = head;
+		int count = 0;
+		do {
+			volatile uint32_t *qh = P(q);
+			execute_qh(qh, 1, USBHS_USBSTS_UAI);
+			q = qh[0] & 0xFFFFFFE0;
+		} while (q != head && budget > 0 && ++count < 1000);
+		if (budget == before) break;
+	}
+}
+
+static void microframe(void)
+{
+	uint32_t cmd = regs[EHCI_SIM_USBCMD];
+	ehci_sim_stats.microframes++;
+	uframe_count++;
+	budget = 7500; // 60 bytes/usec at 480 Mbit/sec
+	if (device && device->speed == 0) budget = 188;
+	if (device && device->speed == 1) budget = 24;
+	if (cmd & USBHS_USBCMD_RS) {
+		uint32_t size = ((cmd & USBHS_USBCMD_FS2) ? 64 : 1024) >> ((cmd >> 2) & 3);
+		uint32_t frindex = (regs[EHCI_SIM_FRINDEX] + 1) & 0x3FFF;
+		regs[EHCI_SIM_FRINDEX] = frindex;
+		if ((frindex & (size * 8 - 1)) == 0) {
+			regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_FRI; // frame list rollover
+		}
+		if (cmd & USBHS_USBCMD_PSE) {
+			regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_PS;
+			if (skip_uframes > 0) {
+				skip_uframes--;
+			} else {
+				periodic_schedule();
+			}
+		} else {
+			regs[EHCI_SIM_USBSTS] &= ~USBHS_USBSTS_PS;
+		}
+		if (cmd & USBHS_USBCMD_ASE) {
+			regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_AS;
+			async_schedule();
+		} else {
+			regs[EHCI_SIM_USBSTS] &= ~USBHS_USBSTS_AS;
+		}
+	}
+	if (regs[EHCI_SIM_USBCMD] & USBHS_USBCMD_IAA) {
+		// no QH is cached between microframes, so the async
+		// schedule has always advanced by now
+		regs[EHCI_SIM_USBCMD] &= ~USBHS_USBCMD_IAA;
+		regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_AAI;
+	}
+	uint32_t itc = (cmd >> 16) & 0xFF;
+	if (itc == 0 || (uframe_count % itc) == 0) {
+		regs[EHCI_SIM_USBSTS] |= sts_pending;
+		sts_pending = 0;
+	}
+}
+
+static void sim_advance(uint64_t ns)
+{
+	uint64_t end = sim_ns + ns;
+	while (1) {
+		// find the next event
+		uint64_t next = end;
+		if (next_uframe_ns < next) next = next_uframe_ns;
+		for (int i=0; i < 2; i++) {
+			if ((regs[EHCI_SIM_GPTIMER0CTL + i*2] & USBHS_GPTIMERCTL_RUN)
+			  && gptimer_ns[i] < next) next = gptimer_ns[i];
+		}
+		if (port_reset_ns && port_reset_ns < next) next = port_reset_ns;
+		// interrupts may have already advanced time beyond next
+		if (next > sim_ns) sim_ns = next;
+		while (next_uframe_ns <= sim_ns) {
+			next_uframe_ns += UFRAME_NS;
+			microframe();
+		}
+		for (int i=0; i < 2; i++) {
+			uint32_t ctl = EHCI_SIM_GPTIMER0CTL + i*2;
+			if ((regs[ctl] & USBHS_GPTIMERCTL_RUN) && gptimer_ns[i] <= sim_ns) {
+				regs[ctl] &= ~USBHS_GPTIMERCTL_RUN; // one shot mode
+				regs[EHCI_SIM_USBSTS] |= (i == 0) ? USBHS_USBSTS_TI0 : USBHS_USBSTS_TI1;
+			}
+		}
+		if (port_reset_ns && port_reset_ns <= sim_ns) {
+			port_reset_ns = 0;
+			uint32_t portsc = regs[EHCI_SIM_PORTSC1] & ~USBHS_PORTSC_PR;
+			if (device && (portsc & USBHS_PORTSC_CCS)) {
+				portsc |= USBHS_PORTSC_PE;
+				if (device->speed == 2) portsc |= USBHS_PORTSC_HSP;
+				device->address = 0;
+				device->configuration = 0;
+				device->halted = 0;
+			}
+			regs[EHCI_SIM_PORTSC1] = portsc;
+			regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_PCI;
+		}
+		deliver_interrupts();
+		if (sim_ns >= end) break;
+	}
+}
+
+void ehci_sim_run(uint32_t microseconds)
+{
+	sim_advance((uint64_t)microseconds * 1000);
+}
+
+void ehci_sim_skip_frames(uint32_t frames)
+{
+	skip_uframes = frames * 8;
+}
+
+uint32_t ehci_sim_micros(void)
+{
+	sim_advance(ACCESS_NS);
+	return sim_ns / 1000;
+}
+
+uint32_t ehci_sim_cycles(void)
+{
+	return sim_ns * 600 / 1000; // as if 600 MHz
+}
+
+void ehci_sim_irq_enable(bool enable)
+{
+	irq_enabled = enable;
+	if (enable) deliver_interrupts();
+}
+
+bool ehci_sim_irq_enabled(void)
+{
+	return irq_enabled;
+}
+
+void ehci_sim_irq_global(bool enable)
+{
+	irq_global = enable;
+	if (enable) deliver_interrupts();
+}
+
+void ehci_sim_attach_isr(void (*isr)(void))
+{
+	isr_function = isr;
+}
+
+void ehci_sim_connect(EHCISimDevice *dev)
+{
+	device = dev;
+	dev->address = 0;
+	dev->configuration = 0;
+	regs[EHCI_SIM_PORTSC1] = (regs[EHCI_SIM_PORTSC1] & ~USBHS_PORTSC_PSPD(3))
+		| USBHS_PORTSC_CCS | USBHS_PORTSC_CSC | USBHS_PORTSC_PSPD(dev->speed);
+	regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_PCI;
+	deliver_interrupts();
+}
+
+void ehci_sim_disconnect(void)
+{
+	device = NULL;
+	regs[EHCI_SIM_PORTSC1] = (regs[EHCI_SIM_PORTSC1] & ~(USBHS_PORTSC_CCS
+		| USBHS_PORTSC_PE | USBHS_PORTSC_HSP)) | USBHS_PORTSC_CSC;
+	regs[EHCI_SIM_USBSTS] |= USBHS_USBSTS_PCI;
+	deliver_interrupts();
+}
+
+
+int EHCISimDevice::control(const uint8_t *setup, uint8_t *data, uint32_t maxlen)
+{
+	uint32_t type = setup[0];
+	uint32_t request = setup[1];
+	uint32_t value = setup[2] | (setup[3] << 8);
+	uint32_t index = setup[4] | (setup[5] << 8);
+	const uint8_t *desc = NULL;
+	uint32_t len = 0;
+	if (type == 0x80 && request == 6) { // GET_DESCRIPTOR
+		static const uint8_t lang[4] = {4, 3, 0x09, 0x04};
+		static const uint8_t name[20] = {20, 3, 'S',0, 'i',0, 'm',0, 'u',0,
+			'l',0, 'a',0, 't',0, 'e',0, 'd',0};
+		switch (value >> 8) {
+		case 1: desc = device_descriptor; len = desc[0]; break;
+		case 2: desc = config_descriptor; len = desc[2] | (desc[3] << 8); break;
+		case 3: desc = (value & 0xFF) ? name : lang; len = desc[0]; break;
+		default: return EHCI_SIM_STALL;
+		}
+		if (len > maxlen) len = maxlen;
+		memcpy(data, desc, len);
+		return len;
+	}
+	if (type == 0x00 && request == 5) { // SET_ADDRESS
+		address = value & 0x7F;
+		return 0;
+	}
+	if (type == 0x00 && request == 9) { // SET_CONFIGURATION
+		configuration = value;
+		return 0;
+	}
+	if (type == 0x02 && request == 1 && value == 0) { // CLEAR_FEATURE(ENDPOINT_HALT)
+		halted &= ~(1 << (index & 15));
+		return 0;
+	}
+	if (type & 0x60) return 0; // accept class & vendor requests, with no data
+	return EHCI_SIM_STALL;
+}
+
+int EHCISimDevice::in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen)
+{
+	if (script_count == 0) return EHCI_SIM_NAK;
+	if (script[script_first].endpoint != endpoint) return EHCI_SIM_NAK;
+	uint32_t len = script[script_first].len;
+	if (len > maxlen) len = maxlen;
+	for (uint32_t i=0; i < len; i++) {
+		buf[i] = script_data[script_read++ & (SCRIPT_SIZE - 1)];
+	}
+	script[script_first].len -= len;
+	if (script[script_first].len == 0) {
+		script_first = (script_first + 1) & (SCRIPT_ENTRIES - 1);
+		script_count--;
+	}
+	return len;
+}
+
+int EHCISimDevice::out(uint32_t endpoint, const uint8_t *buf, uint32_t len)
+{
+	return len;
+}
+
+// IN data is sent in the order queued.  Data for one endpoint waits
+// (NAK) until all earlier data for other endpoints is read.
+bool EHCISimDevice::queue_in(uint32_t endpoint, const void *data, uint16_t len)
+{
+	uint32_t used = script_write - script_read; // bytes queued, not yet read
+	if (script_count >= SCRIPT_ENTRIES || used + len > SCRIPT_SIZE) return false;
+	uint32_t n = (script_first + script_count) & (SCRIPT_ENTRIES - 1);
+	script[n].endpoint = endpoint;
+	script[n].len = len;
+	for (uint32_t i=0; i < len; i++) {
+		script_data[script_write++ & (SCRIPT_SIZE - 1)] = ((const uint8_t *)data)[i];
+	}
+	script_count++;
+	return true;
+}
+
+#endif // USBHOST_SIMULATOR
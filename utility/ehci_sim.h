@@ -0,0 +1,251 @@
+#ifndef EHCI_SIM_H_
+#define EHCI_SIM_H_
+
+#if defined(USBHOST_SIMULATOR)
+
+// Software model of the EHCI controller, so the host stack and drivers
+// can run on an ordinary computer, for testing and benchmarking.
+//
+// Like imxrt_usbhs.h does for Teensy 4, this file maps the USBHS_*
+// register names used by ehci.cpp, here onto a simulated controller.
+// Simulated time only advances when the library reads a register, asks
+// for the time (micros, millis), calls delay(), or the program calls
+// ehci_sim_run().  The model walks the real QH, qTD, iTD and siTD
+// structures in the async and periodic schedules, so pointers stored
+// in them must fit in 32 bits: build as a 32 bit program, or a 64 bit
+// non-PIE program whose static data and heap are below 4 GB.
+//
+// The Arduino API (Serial, Print, etc) must be provided by the program.
+// Its micros() and millis(), used by elapsedMillis, should return
+// ehci_sim_micros(), and yield() should call ehci_sim_run(), because
+// some drivers busy wait for a response.  Only a single device
+// connected to the root port is modeled, there is no hub model.
+// extras/sim has such an Arduino API, a Makefile, example scenario
+// programs and a README with the model's limits.
+//
+// Simulated devices inherit from EHCISimDevice.  A minimal test:
+//
+//   EHCISimDevice mydev(device_descriptor, config_descriptor);
+//   myusb.begin();
+//   ehci_sim_connect(&mydev);
+//   ehci_sim_run(500000); // enumerate, 0.5 seconds simulated time
+
+#include <stdint.h>
+
+#define EHCI_SIM_USBCMD		0
+#define EHCI_SIM_USBSTS		1
+#define EHCI_SIM_USBINTR	2
+#define EHCI_SIM_FRINDEX	3
+#define EHCI_SIM_PERIODICLISTBASE 4
+#define EHCI_SIM_ASYNCLISTADDR	5
+#define EHCI_SIM_PORTSC1	6
+#define EHCI_SIM_USBMODE	7
+#define EHCI_SIM_SBUSCFG	8
+#define EHCI_SIM_GPTIMER0LD	9
+#define EHCI_SIM_GPTIMER0CTL	10
+#define EHCI_SIM_GPTIMER1LD	11
+#define EHCI_SIM_GPTIMER1CTL	12
+#define EHCI_SIM_PHY_CTRL	13
+#define EHCI_SIM_NUM_REGS	14
+
+uint32_t ehci_sim_read(uint32_t reg);
+void ehci_sim_write(uint32_t reg, uint32_t val);
+
+// Each register behaves like a volatile uint32_t, but reads and writes
+// go through the simulated controller.
+class EHCISimRegister {
+public:
+    explicit constexpr EHCISimRegister(uint32_t n) : reg(n) { }
+    operator uint32_t() const { return ehci_sim_read(reg); }
+    template <typename T> explicit operator T*() const { return (T *)(uintptr_t)ehci_sim_read(reg); }
+    uint32_t operator=(uint32_t val) const { ehci_sim_write(reg, val); return val; }
+    uint32_t operator|=(uint32_t val) const { return *this = (ehci_sim_read(reg) | val); }
+    uint32_t operator&=(uint32_t val) const { return *this = (ehci_sim_read(reg) & val); }
+private:
+    const uint32_t reg;
+};
+
+// USBHS registers & bits, same as Teensy 3.6 (K66 reference manual, chapter 57)
+#define USBHS_USBCMD		(EHCISimRegister(EHCI_SIM_USBCMD))
+#define USBHS_USBSTS		(EHCISimRegister(EHCI_SIM_USBSTS))
+#define USBHS_USBINTR		(EHCISimRegister(EHCI_SIM_USBINTR))
+#define USBHS_FRINDEX		(EHCISimRegister(EHCI_SIM_FRINDEX))
+#define USBHS_PERIODICLISTBASE	(EHCISimRegister(EHCI_SIM_PERIODICLISTBASE))
+#define USBHS_ASYNCLISTADDR	(EHCISimRegister(EHCI_SIM_ASYNCLISTADDR))
+#define USBHS_PORTSC1		(EHCISimRegister(EHCI_SIM_PORTSC1))
+#define USBHS_USBMODE		(EHCISimRegister(EHCI_SIM_USBMODE))
+#define USBHS_USB_SBUSCFG	(EHCISimRegister(EHCI_SIM_SBUSCFG))
+#define USBHS_GPTIMER0LD	(EHCISimRegister(EHCI_SIM_GPTIMER0LD))
+#define USBHS_GPTIMER0CTL	(EHCISimRegister(EHCI_SIM_GPTIMER0CTL))
+#define USBHS_GPTIMER1LD	(EHCISimRegister(EHCI_SIM_GPTIMER1LD))
+#define USBHS_GPTIMER1CTL	(EHCISimRegister(EHCI_SIM_GPTIMER1CTL))
+#define USBPHY_CTRL_SET		(EHCISimRegister(EHCI_SIM_PHY_CTRL))
+#define USBPHY_CTRL_CLR		(EHCISimRegister(EHCI_SIM_PHY_CTRL))
+#define USBPHY_CTRL_ENHOSTDISCONDETECT	0
+
+#define USBHS_USBCMD_RS		((uint32_t)(1<<0))
+#define USBHS_USBCMD_RST	((uint32_t)(1<<1))
+#define USBHS_USBCMD_FS(n)	((uint32_t)(((n) & 3) << 2))
+#define USBHS_USBCMD_PSE	((uint32_t)(1<<4))
+#define USBHS_USBCMD_ASE	((uint32_t)(1<<5))
+#define USBHS_USBCMD_IAA	((uint32_t)(1<<6))
+#define USBHS_USBCMD_ASP(n)	((uint32_t)(((n) & 3) << 8))
+#define USBHS_USBCMD_ASPE	((uint32_t)(1<<11))
+#define USBHS_USBCMD_FS2	((uint32_t)(1<<15))
+#define USBHS_USBCMD_ITC(n)	((uint32_t)(((n) & 0xFF) << 16))
+
+#define USBHS_USBSTS_UI		((uint32_t)(1<<0))
+#define USBHS_USBSTS_UEI	((uint32_t)(1<<1))
+#define USBHS_USBSTS_PCI	((uint32_t)(1<<2))
+#define USBHS_USBSTS_FRI	((uint32_t)(1<<3))
+#define USBHS_USBSTS_SEI	((uint32_t)(1<<4))
+#define USBHS_USBSTS_AAI	((uint32_t)(1<<5))
+#define USBHS_USBSTS_URI	((uint32_t)(1<<6))
+#define USBHS_USBSTS_SRI	((uint32_t)(1<<7))
+#define USBHS_USBSTS_SLI	((uint32_t)(1<<8))
+#define USBHS_USBSTS_HCH	((uint32_t)(1<<12))
+#define USBHS_USBSTS_RCL	((uint32_t)(1<<13))
+#define USBHS_USBSTS_PS		((uint32_t)(1<<14))
+#define USBHS_USBSTS_AS		((uint32_t)(1<<15))
+#define USBHS_USBSTS_NAKI	((uint32_t)(1<<16))
+#define USBHS_USBSTS_UAI	((uint32_t)(1<<18))
+#define USBHS_USBSTS_UPI	((uint32_t)(1<<19))
+#define USBHS_USBSTS_TI0	((uint32_t)(1<<24))
+#define USBHS_USBSTS_TI1	((uint32_t)(1<<25))
+
+#define USBHS_USBINTR_UE	((uint32_t)(1<<0))
+#define USBHS_USBINTR_UEE	((uint32_t)(1<<1))
+#define USBHS_USBINTR_PCE	((uint32_t)(1<<2))
+#define USBHS_USBINTR_FRE	((uint32_t)(1<<3))
+#define USBHS_USBINTR_SEE	((uint32_t)(1<<4))
+#define USBHS_USBINTR_AAE	((uint32_t)(1<<5))
+#define USBHS_USBINTR_UAIE	((uint32_t)(1<<18))
+#define USBHS_USBINTR_UPIE	((uint32_t)(1<<19))
+#define USBHS_USBINTR_TIE0	((uint32_t)(1<<24))
+#define USBHS_USBINTR_TIE1	((uint32_t)(1<<25))
+
+#define USBHS_PORTSC_CCS	((uint32_t)(1<<0))
+#define USBHS_PORTSC_CSC	((uint32_t)(1<<1))
+#define USBHS_PORTSC_PE		((uint32_t)(1<<2))
+#define USBHS_PORTSC_PEC	((uint32_t)(1<<3))
+#define USBHS_PORTSC_OCA	((uint32_t)(1<<4))
+#define USBHS_PORTSC_OCC	((uint32_t)(1<<5))
+#define USBHS_PORTSC_FPR	((uint32_t)(1<<6))
+#define USBHS_PORTSC_SUSP	((uint32_t)(1<<7))
+#define USBHS_PORTSC_PR		((uint32_t)(1<<8))
+#define USBHS_PORTSC_HSP	((uint32_t)(1<<9))
+#define USBHS_PORTSC_PP		((uint32_t)(1<<12))
+#define USBHS_PORTSC_PHCD	((uint32_t)(1<<23))
+#define USBHS_PORTSC_PFSC	((uint32_t)(1<<24))
+#define USBHS_PORTSC_PSPD(n)	((uint32_t)(((n) & 3) << 26))
+
+#define USBHS_USBMODE_CM(n)	((uint32_t)(((n) & 3) << 0))
+#define USBHS_USBMODE_TXHSD(n)	((uint32_t)(((n) & 7) << 12))
+
+#define USBHS_GPTIMERCTL_RUN	((uint32_t)(1<<31))
+#define USBHS_GPTIMERCTL_RST	((uint32_t)(1<<30))
+
+// Interrupts, clock & cycle counter are simulated too
+#define IRQ_USBHS		0
+#undef NVIC_ENABLE_IRQ
+#undef NVIC_DISABLE_IRQ
+#undef NVIC_IS_ENABLED
+#undef NVIC_SET_PRIORITY
+#undef __disable_irq
+#undef __enable_irq
+#define NVIC_ENABLE_IRQ(n)	ehci_sim_irq_enable(true)
+#define NVIC_DISABLE_IRQ(n)	ehci_sim_irq_enable(false)
+#define NVIC_IS_ENABLED(n)	ehci_sim_irq_enabled()
+#define NVIC_SET_PRIORITY(n, p)
+#define __disable_irq()		ehci_sim_irq_global(false)
+#define __enable_irq()		ehci_sim_irq_global(true)
+#define attachInterruptVector(n, f) ehci_sim_attach_isr(f)
+#define micros()		ehci_sim_micros()
+#define millis()		(ehci_sim_micros() / 1000)
+#define delay(ms)		ehci_sim_run((uint32_t)(ms) * 1000)
+#define delayMicroseconds(us)	ehci_sim_run(us)
+#define ARM_DWT_CYCCNT		ehci_sim_cycles()
+#define ARM_DEMCR		ehci_sim_dummy
+#define ARM_DEMCR_TRCENA	0
+#define ARM_DWT_CTRL		ehci_sim_dummy
+#define ARM_DWT_CTRL_CYCCNTENA	0
+
+void ehci_sim_irq_enable(bool enable);
+bool ehci_sim_irq_enabled(void);
+void ehci_sim_irq_global(bool enable);
+void ehci_sim_attach_isr(void (*isr)(void));
+uint32_t ehci_sim_micros(void);
+uint32_t ehci_sim_cycles(void);
+extern uint32_t ehci_sim_dummy;
+
+// Run the simulated controller, and any interrupts it causes
+void ehci_sim_run(uint32_t microseconds);
+
+// Don't run the periodic schedule for a number of frames, as if the
+// controller missed them (isochronous frames are not executed)
+void ehci_sim_skip_frames(uint32_t frames);
+
+// Result codes for simulated devices
+#define EHCI_SIM_NAK	-1
+#define EHCI_SIM_STALL	-2
+
+// A simulated USB device.  The default implementation answers standard
+// control requests from its descriptors, NAKs all IN tokens except data
+// added by queue_in(), and accepts all OUT data.  Override the virtual
+// functions to script other behavior.
+class EHCISimDevice {
+public:
+    EHCISimDevice(const uint8_t *device_desc, const uint8_t *config_desc,
+        uint32_t speed = 2) : device_descriptor(device_desc),
+        config_descriptor(config_desc), speed(speed) { }
+    // Handle a control request, fill data for IN requests.  Return the
+    // number of bytes, or EHCI_SIM_STALL
+    virtual int control(const uint8_t *setup, uint8_t *data, uint32_t maxlen);
+    // IN token: copy up to maxlen bytes into buf, return the number of
+    // bytes, EHCI_SIM_NAK or EHCI_SIM_STALL
+    virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen);
+    // OUT token: return len if accepted, EHCI_SIM_NAK or EHCI_SIM_STALL
+    virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len);
+    // Add data for in() to send, as packets of up to maxlen bytes.
+    // Returns false if the script buffer is full.
+    bool queue_in(uint32_t endpoint, const void *data, uint16_t len);
+    // Make an endpoint answer with STALL, until CLEAR_FEATURE(ENDPOINT_HALT)
+    void stall(uint32_t endpoint) { halted |= (1 << (endpoint & 15)); }
+    const uint8_t *device_descriptor;
+    const uint8_t *config_descriptor;
+    uint32_t speed; // 0=12 Mbit/sec, 1=1.5 Mbit/sec, 2=480 Mbit/sec
+    uint32_t address = 0;
+    uint32_t configuration = 0;
+    uint32_t halted = 0;     // bitmask of stalled endpoints
+    uint32_t in_bytes = 0;   // data sent to host
+    uint32_t out_bytes = 0;  // data received from host
+    uint32_t naks = 0;
+protected:
+    enum { SCRIPT_ENTRIES = 64, SCRIPT_SIZE = 4096 };
+    struct {
+        uint8_t  endpoint;
+        uint16_t len;
+    } script[SCRIPT_ENTRIES];
+    uint8_t  script_data[SCRIPT_SIZE];
+    uint32_t script_first = 0;  // oldest script[] entry
+    uint32_t script_count = 0;  // number of script[] entries
+    uint32_t script_write = 0;  // total bytes written to script_data
+    uint32_t script_read = 0;   // total bytes read from script_data
+};
+
+// Connect or disconnect a device on the simulated root port
+void ehci_sim_connect(EHCISimDevice *device);
+void ehci_sim_disconnect(void);
+
+// Counters, for benchmarks
+typedef struct {
+	uint32_t microframes;
+	uint32_t transactions;
+	uint32_t naks;
+	uint32_t bytes;
+	uint32_t interrupts;
+} ehci_sim_stats_t;
+extern ehci_sim_stats_t ehci_sim_stats;
+
+#endif // USBHOST_SIMULATOR
+#endif
@@ -42,6 +42,7 @@
 #define USBHS_USBSTS_UPI	((uint32_t)(1<<19))
 #define USBHS_USBSTS_UEI	USB_USBSTS_UEI
 #define USBHS_USBSTS_PCI	USB_USBSTS_PCI
+#define USBHS_USBSTS_FRI	USB_USBSTS_FRI
 #define USBHS_USBSTS_TI0	USB_USBSTS_TI0
 #define USBHS_USBSTS_TI1	USB_USBSTS_TI1
 #define USBHS_USBSTS_SEI	USB_USBSTS_SEI
@@ -55,6 +56,7 @@
 #define USBHS_USBINTR_TIE1	USB_USBINTR_TIE1
 #define USBHS_USBINTR_UEE	USB_USBINTR_UEE
 #define USBHS_USBINTR_SEE	USB_USBINTR_SEE
+#define USBHS_USBINTR_FRE	USB_USBINTR_FRE
 #define USBHS_USBINTR_UPIE	USB_USBINTR_UPIE
 #define USBHS_USBINTR_UAIE	USB_USBINTR_UAIE
 
@@ -0,0 +1,151 @@
+#ifndef USBHOST_RING_BUFFER_H_
+#define USBHOST_RING_BUFFER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Single producer, single consumer ring buffer, shared by the drivers
+// which pass data between the USB interrupt and the sketch.  One side
+// may run inside the interrupt, the other outside it, without disabling
+// interrupts: only the producer writes head and only the consumer writes
+// tail.  Both count from 0 to 2*size-1 and wrap, so all size elements
+// are usable and head - tail (modulo 2*size) is the number stored.
+//
+//   USBRingBuffer<uint8_t, 1024> ring;   // storage inside the object
+//   USBRingBuffer<uint8_t> ring;         // storage given to begin()
+//
+// Any size may be used, so buffers carved from a driver's memory use all
+// of it.  write() and read() copy with at most two memcpy calls.
+// writeSpan()/commit() and readSpan()/consume() give direct access to
+// the largest contiguous free or filled region.
+//
+// This program is in the public domain
+
+template <typename T, uint32_t SIZE = 0>
+class USBRingBuffer;
+
+template <typename T>
+class USBRingBuffer<T, 0> {
+public:
+	// discards any data
+	void begin(T *buffer, uint32_t size) {
+		buf = buffer;
+		len = size;
+		head = 0;
+		tail = 0;
+	}
+	uint32_t size() const { return len; }
+	uint32_t available() const { return used(head, tail); }
+	uint32_t space() const { return len - used(head, tail); }
+	bool empty() const { return head == tail; }
+
+	// producer
+	bool put(const T &val) {
+		uint32_t h = head;
+		if (used(h, tail) >= len) return false;
+		buf[index(h)] = val;
+		barrier();
+		head = advance(h, 1);
+		return true;
+	}
+	uint32_t write(const T *data, uint32_t count) {
+		uint32_t h = head;
+		uint32_t n = len - used(h, tail);
+		if (count > n) count = n;
+		uint32_t i = index(h);
+		n = len - i;
+		if (n > count) n = count;
+		memcpy(buf + i, data, n * sizeof(T));
+		if (count > n) memcpy(buf, data + n, (count - n) * sizeof(T));
+		barrier();
+		head = advance(h, count);
+		return count;
+	}
+	T * writeSpan(uint32_t &count) {
+		uint32_t h = head;
+		uint32_t i = index(h);
+		uint32_t n = len - used(h, tail);
+		if (n > len - i) n = len - i;
+		count = n;
+		return buf + i;
+	}
+	void commit(uint32_t count) {
+		barrier();
+		head = advance(head, count);
+	}
+
+	// consumer
+	bool get(T &val) {
+		uint32_t t = tail;
+		if (head == t) return false;
+		barrier();
+		val = buf[index(t)];
+		barrier();
+		tail = advance(t, 1);
+		return true;
+	}
+	const T * peek() const {
+		uint32_t t = tail;
+		if (head == t) return nullptr;
+		barrier();
+		return buf + index(t);
+	}
+	uint32_t read(T *data, uint32_t count) {
+		uint32_t t = tail;
+		uint32_t n = used(head, t);
+		if (count > n) count = n;
+		barrier();
+		uint32_t i = index(t);
+		n = len - i;
+		if (n > count) n = count;
+		memcpy(data, buf + i, n * sizeof(T));
+		if (count > n) memcpy(data + n, buf, (count - n) * sizeof(T));
+		barrier();
+		tail = advance(t, count);
+		return count;
+	}
+	const T * readSpan(uint32_t &count) {
+		uint32_t t = tail;
+		uint32_t i = index(t);
+		uint32_t n = used(head, t);
+		if (n > len - i) n = len - i;
+		barrier();
+		count = n;
+		return buf + i;
+	}
+	void consume(uint32_t count) {
+		barrier();
+		tail = advance(tail, count);
+	}
+	// consumer side: discard everything stored
+	void clear() { tail = head; }
+
+private:
+	// keep the compiler from moving buffer accesses across head/tail
+	// updates.  The other side is an interrupt on the same core, so no
+	// hardware barrier is needed.
+	static void barrier() { __asm__ volatile("" ::: "memory"); }
+	uint32_t used(uint32_t h, uint32_t t) const { return (h >= t) ? h - t : h + 2 * len - t; }
+	uint32_t index(uint32_t n) const { return (n < len) ? n : n - len; }
+	uint32_t advance(uint32_t n, uint32_t count) const {
+		n += count;
+		return (n < 2 * len) ? n : n - 2 * len;
+	}
+	T *buf = nullptr;
+	uint32_t len = 0;
+	volatile uint32_t head = 0;
+	volatile uint32_t tail = 0;
+};
+
+template <typename T, uint32_t SIZE>
+class USBRingBuffer : public USBRingBuffer<T, 0> {
+public:
+	static_assert(SIZE > 0, "USBRingBuffer SIZE must not be 0");
+	USBRingBuffer() { this->begin(storage, SIZE); }
+	void begin() { this->begin(storage, SIZE); }
+	using USBRingBuffer<T, 0>::begin;
+private:
+	T storage[SIZE];
+};
+
+#endif